@@ -13,6 +13,7 @@ LOCAL_C_INCLUDES += $(multirom_local_path) \
 
 LOCAL_SRC_FILES:= \
     kexec.c \
+    klog_view.c \
     main.c \
     multirom.c \
     multirom_ui.c \
@@ -23,6 +24,7 @@ LOCAL_SRC_FILES:= \
     rcadditions.c \
     rom_quirks.c \
     rq_inject_file_contexts.c \
+    status_snapshot.c \
 
 # With these, GCC optimizes aggressively enough so full-screen alpha blending
 # is quick enough to be done in an animation
@@ -81,6 +83,9 @@ include $(multirom_local_path)/trampoline/Android.mk
 # Kernel Inject
 include $(multirom_local_path)/kernel_inject/Android.mk
 
+# Rendering benchmark, uses the in-memory framebuffer
+include $(multirom_local_path)/fb_bench/Android.mk
+
 # ZIP installer
 include $(multirom_local_path)/install_zip/Android.mk
 
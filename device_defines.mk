@@ -69,6 +69,11 @@ ifeq ($(MR_DISABLE_ALPHA),true)
     LOCAL_CFLAGS += -DMR_DISABLE_ALPHA
 endif
 
+# Memory budget in bytes for unused fonts, rendered strings and PNG images
+ifneq ($(MR_FB_CACHE_BUDGET),)
+    LOCAL_CFLAGS += -DMR_FB_CACHE_BUDGET=$(MR_FB_CACHE_BUDGET)
+endif
+
 ifneq ($(TW_BRIGHTNESS_PATH),)
     LOCAL_CFLAGS += -DTW_BRIGHTNESS_PATH=\"$(TW_BRIGHTNESS_PATH)\"
 endif
@@ -115,6 +120,10 @@ ifeq ($(MR_CONTINUOUS_FB_UPDATE),true)
     LOCAL_CFLAGS += -DMR_CONTINUOUS_FB_UPDATE
 endif
 
+ifeq ($(MR_NO_TOUCH_RESAMPLING),true)
+    LOCAL_CFLAGS += -DMR_NO_TOUCH_RESAMPLING
+endif
+
 LOCAL_CFLAGS += -DPLATFORM_SDK_VERSION=$(PLATFORM_SDK_VERSION)
 
 ifneq ($(BOARD_BOOTIMAGE_PARTITION_SIZE),)
@@ -0,0 +1,26 @@
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES += \
+    $(multirom_local_path) \
+    $(multirom_local_path)/lib \
+
+LOCAL_SRC_FILES:= \
+    fb_bench.c \
+
+LOCAL_MODULE:= multirom_fb_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_UNSTRIPPED_PATH := $(TARGET_OUT_EXECUTABLES_UNSTRIPPED)
+LOCAL_STATIC_LIBRARIES := libcutils libc libmultirom_static
+LOCAL_WHOLE_STATIC_LIBRARIES := libm libpng libz libft2_mrom_static
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+# With these, GCC optimizes aggressively enough so full-screen alpha blending
+# is quick enough to be done in an animation
+LOCAL_CFLAGS += -O3 -funsafe-math-optimizations
+
+include $(multirom_local_path)/device_defines.mk
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,524 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "lib/framebuffer.h"
+#include "lib/listview.h"
+#include "lib/notification_card.h"
+#include "lib/termview.h"
+#include "lib/tabview.h"
+#include "lib/animation.h"
+#include "lib/workers.h"
+#include "lib/colors.h"
+#include "lib/containers.h"
+#include "lib/mrom_data.h"
+#include "lib/util.h"
+#include "lib/log.h"
+
+// Renders representative MultiROM scenes into the in-memory framebuffer
+// and prints how long the parts of each frame took.
+
+#define DEFAULT_W 1080
+#define DEFAULT_H 1920
+#define DEFAULT_FRAMES 120
+
+struct bench_result
+{
+    const char *name;
+    uint64_t setup_us;
+    struct fb_frame_stats *frames;
+    int frames_cnt;
+};
+
+struct bench_scene
+{
+    const char *name;
+    void (*run)(struct bench_result *res, int frames);
+};
+
+static uint64_t bench_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+static void bench_frame(struct bench_result *res)
+{
+    fb_force_draw();
+    fb_get_frame_stats(&res->frames[res->frames_cnt++]);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_print(struct bench_result *res)
+{
+    int i;
+    uint64_t *totals;
+    struct fb_frame_stats sum;
+
+    if(res->frames_cnt == 0)
+    {
+        printf("%-10s no frames\n", res->name);
+        return;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    totals = malloc(res->frames_cnt*sizeof(uint64_t));
+    for(i = 0; i < res->frames_cnt; ++i)
+    {
+        struct fb_frame_stats *f = &res->frames[i];
+        sum.items += f->items;
+        sum.culled += f->culled;
+        sum.fill_us += f->fill_us;
+        sum.rect_us += f->rect_us;
+        sum.img_us += f->img_us;
+        sum.line_us += f->line_us;
+        sum.listview_us += f->listview_us;
+        sum.update_us += f->update_us;
+        sum.lock_us += f->lock_us;
+        sum.capture_us += f->capture_us;
+        sum.blit_us += f->blit_us;
+        sum.total_us += f->total_us;
+        totals[i] = f->total_us;
+    }
+    qsort(totals, res->frames_cnt, sizeof(uint64_t), compare_u64);
+
+#define AVG(x) (double)(sum.x)/res->frames_cnt
+    printf("%-10s %6d %9llu %8u %8u %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %9.1f %8llu %8llu\n",
+        res->name, res->frames_cnt, (unsigned long long)res->setup_us,
+        sum.items/res->frames_cnt, sum.culled/res->frames_cnt, AVG(fill_us), AVG(rect_us), AVG(img_us),
+        AVG(line_us), AVG(listview_us), AVG(capture_us), AVG(blit_us), AVG(update_us), AVG(lock_us), AVG(total_us),
+        (unsigned long long)totals[(res->frames_cnt*95)/100],
+        (unsigned long long)totals[res->frames_cnt-1]);
+#undef AVG
+
+    free(totals);
+}
+
+static const char *rom_names[] = {
+    "Internal",
+    "LineageOS 15.1",
+    "AOSP Extended v5.8 (Official build with a very long name)",
+    "Resurrection Remix",
+    "Ubuntu Touch",
+    "crDroid",
+    "Pixel Experience Plus Edition 2018-12-03 nightly",
+    "OmniROM",
+};
+
+static void scene_romlist(struct bench_result *res, int frames)
+{
+    int i, step;
+    char icon[256];
+    const char *icon_path = NULL;
+    uint64_t start = bench_time_us();
+
+    snprintf(icon, sizeof(icon), "%s/icons/romic_default.png", mrom_dir());
+    if(access(icon, R_OK) >= 0)
+        icon_path = icon;
+
+    listview *view = mzalloc(sizeof(listview));
+    view->item_draw = &rom_item_draw;
+    view->item_hide = &rom_item_hide;
+    view->item_height = &rom_item_height;
+    view->item_destroy = &rom_item_destroy;
+    view->x = 0;
+    view->y = fb_height/8;
+    view->w = fb_width;
+    view->h = fb_height - view->y;
+
+    listview_init_ui(view);
+    for(i = 0; i < 48; ++i)
+    {
+        const char *part = (i % 3) == 2 ? "sda1 (ext4)" : NULL;
+        listview_add_item(view, i, rom_item_create(rom_names[i % ARRAY_SIZE(rom_names)], part, icon_path));
+    }
+    listview_update_ui(view);
+
+    res->setup_us = bench_time_us() - start;
+
+    step = imax(1, (view->fullH - view->h)/imax(1, frames/2));
+    for(i = 0; i < frames; ++i)
+    {
+        listview_scroll_by(view, i < frames/2 ? step : -step);
+        bench_frame(res);
+    }
+
+    listview_destroy(view);
+}
+
+static void scene_ncard(struct bench_result *res, int frames)
+{
+    int i;
+    uint64_t start = bench_time_us();
+
+    fb_add_text(0, fb_height/3, C_TEXT, SIZE_BIG, "Background text behind the card");
+    fb_add_rect(0, 0, fb_width, fb_height/8, C_HIGHLIGHT_BG);
+
+    ncard_builder *b = ncard_create_builder();
+    ncard_set_title(b, "Notification");
+    ncard_set_text(b, "This card is revealed from the bottom of the screen,\nwhile the frames are being measured.");
+    ncard_add_btn(b, BTN_POSITIVE, "ok", NULL, NULL);
+    ncard_add_btn(b, BTN_NEGATIVE, "cancel", NULL, NULL);
+    ncard_set_pos(b, NCARD_POS_CENTER);
+    ncard_show(b, 1);
+
+    res->setup_us = bench_time_us() - start;
+
+    for(i = 0; i < frames; ++i)
+    {
+        bench_frame(res);
+        if(i == frames/2)
+            ncard_hide();
+    }
+
+    fb_clear();
+}
+
+static void scene_pong(struct bench_result *res, int frames)
+{
+    int i;
+    const int ball_w = 25*DPI_MUL;
+    const int paddle_w = 150*DPI_MUL;
+    const int paddle_h = 60*DPI_MUL;
+    int ball_x = fb_width/2, ball_y = fb_height/2;
+    int speed_x = 7*DPI_MUL, speed_y = 10*DPI_MUL;
+    uint64_t start = bench_time_us();
+
+    fb_set_background(BLACK);
+    fb_text *score_l = fb_add_text(0, fb_height/2 - 100*DPI_MUL, WHITE, SIZE_EXTRA, "0");
+    fb_text *score_r = fb_add_text(0, fb_height/2 + 50*DPI_MUL, WHITE, SIZE_EXTRA, "0");
+    fb_rect *mid = fb_add_rect(0, fb_height/2, fb_width, 1, WHITE);
+    fb_rect *paddles[2] = {
+        fb_add_rect(fb_width/2 - paddle_w/2, 20*DPI_MUL, paddle_w, paddle_h, WHITE),
+        fb_add_rect(fb_width/2 - paddle_w/2, fb_height - 20*DPI_MUL - paddle_h, paddle_w, paddle_h, WHITE),
+    };
+    fb_rect *ball = fb_add_rect(ball_x, ball_y, ball_w, ball_w, WHITE);
+
+    res->setup_us = bench_time_us() - start;
+
+    for(i = 0; i < frames; ++i)
+    {
+        fb_items_lock();
+        ball_x += speed_x;
+        ball_y += speed_y;
+        if(ball_x <= 0 || ball_x + ball_w >= (int)fb_width)
+            speed_x = -speed_x;
+        if(ball_y <= paddles[0]->y + paddle_h || ball_y + ball_w >= paddles[1]->y)
+            speed_y = -speed_y;
+        ball->x = imin(imax(ball_x, 0), fb_width - ball_w);
+        ball->y = ball_y;
+        paddles[0]->x = imin(imax(ball->x - paddle_w/2, 0), fb_width - paddle_w);
+        paddles[1]->x = fb_width - paddle_w - paddles[0]->x;
+        fb_items_unlock();
+
+        if(i % 30 == 0)
+        {
+            fb_text_set_content(score_l, i % 60 ? "1" : "2");
+            fb_text_set_content(score_r, i % 60 ? "3" : "4");
+        }
+
+        bench_frame(res);
+    }
+
+    fb_rm_text(score_l);
+    fb_rm_text(score_r);
+    fb_rm_rect(mid);
+    fb_rm_rect(paddles[0]);
+    fb_rm_rect(paddles[1]);
+    fb_rm_rect(ball);
+    fb_set_background(C_BACKGROUND);
+}
+
+static void scene_klog(struct bench_result *res, int frames)
+{
+    int i;
+    size_t len, klog_len;
+    char *klog;
+    fb_img *t;
+    termview *v;
+    uint64_t start;
+
+    // 16 MB of kernel log, the most multirom_get_klog() returns
+    klog_len = 16*1024*1024;
+    klog = malloc(klog_len + 1);
+    for(i = 0, len = 0; len < klog_len; ++i)
+    {
+        len += snprintf(klog + len, klog_len + 1 - len,
+                "<6>[%5d.%06d] multirom: Scanning partition mmcblk0p%d, fs ext4, line %d\n",
+                i/100, (i*7919) % 1000000, i % 40, i);
+    }
+    klog_len = imin(len, klog_len);
+
+    start = bench_time_us();
+
+    // same layout as multirom_emergency_reboot()
+    fb_set_background(BLACK);
+    t = fb_add_text(0, 120, WHITE, SIZE_NORMAL,
+                "An error occured.\nShutting down MultiROM to avoid data corruption.\n"
+                "Report this error to the developer!\nDebug info: /sdcard/multirom_log.txt\n\n"
+                "Press POWER button to reboot.");
+    t = fb_add_text(0, t->y + t->h + 100*DPI_MUL, GRAYISH, SIZE_SMALL, "Last lines from klog:");
+    fb_add_rect(0, t->y + t->h + 5*DPI_MUL, fb_width, 1, GRAYISH);
+
+    const int start_y = (t->y + t->h + 5*DPI_MUL + 2);
+    v = termview_create(0, start_y, fb_width, fb_height - start_y, 4*4, 2000);
+    if(v)
+    {
+        termview_append_tail(v, klog, klog_len);
+        termview_update(v);
+    }
+
+    res->setup_us = bench_time_us() - start;
+
+    // scroll back one row per frame, so every frame re-renders the view
+    for(i = 0; i < frames; ++i)
+    {
+        if(v)
+        {
+            termview_scroll_by(v, 1);
+            termview_update(v);
+        }
+        bench_frame(res);
+    }
+
+    if(v)
+        termview_destroy(v);
+    free(klog);
+
+    fb_clear();
+    fb_set_background(C_BACKGROUND);
+}
+
+static void scene_tabs_run(struct bench_result *res, int frames, int use_layers)
+{
+    int i, p, s, swipes, per_swipe;
+    touch_event ev;
+    char buf[64];
+    uint64_t start = bench_time_us();
+    const int header_h = fb_height/8;
+
+    fb_rect *header = fb_add_rect_lvl(100, 0, 0, fb_width, header_h, C_HIGHLIGHT_BG);
+    tabview *t = tabview_create(0, header_h, fb_width, fb_height - header_h);
+    t->use_layers = use_layers;
+
+    listview *view = mzalloc(sizeof(listview));
+    view->item_draw = &rom_item_draw;
+    view->item_hide = &rom_item_hide;
+    view->item_height = &rom_item_height;
+    view->item_destroy = &rom_item_destroy;
+    view->x = 0;
+    view->y = header_h;
+    view->w = fb_width;
+    view->h = fb_height - header_h;
+    listview_init_ui(view);
+    for(i = 0; i < 24; ++i)
+        listview_add_item(view, i, rom_item_create(rom_names[i % ARRAY_SIZE(rom_names)], NULL, NULL));
+    listview_update_ui(view);
+
+    tabview_add_page(t, -1);
+    tabview_add_item(t, 0, view);
+
+    for(p = 1; p < 3; ++p)
+    {
+        tabview_add_page(t, -1);
+        for(i = 0; i < 8; ++i)
+        {
+            const int y = header_h + 40*DPI_MUL + i*120*DPI_MUL;
+            snprintf(buf, sizeof(buf), "Page %d button %d", p, i);
+            tabview_add_item(t, p, fb_add_rect(40*DPI_MUL, y, fb_width - 80*DPI_MUL, 100*DPI_MUL, C_HIGHLIGHT_BG));
+            tabview_add_item(t, p, fb_add_text(60*DPI_MUL, y + 30*DPI_MUL, C_TEXT, SIZE_NORMAL, buf));
+        }
+    }
+    tabview_update_positions(t);
+
+    res->setup_us = bench_time_us() - start;
+
+    // swipe to the last page and back one page at a time, like a finger
+    // would. The frame drawn on touch-down isn't measured, the layers are
+    // copied there.
+    memset(&ev, 0, sizeof(ev));
+    ev.x = ev.orig_x = t->x + t->w/2;
+    ev.y = ev.orig_y = t->y + t->h/2;
+    swipes = 2*(t->count - 1);
+    per_swipe = imax(1, frames/swipes);
+    for(s = 0; s < swipes; ++s)
+    {
+        const int from = s < t->count - 1 ? s : swipes - s;
+        const int to = s < t->count - 1 ? s + 1 : swipes - s - 1;
+
+        ev.changed = TCHNG_ADDED;
+        gettimeofday(&ev.time, NULL);
+        tabview_touch_handler(&ev, t);
+        fb_force_draw();
+
+        for(i = 1; i <= per_swipe; ++i)
+        {
+            t->pos = from*t->w + (to - from)*t->w*i/per_swipe;
+            tabview_update_positions(t);
+            bench_frame(res);
+        }
+
+        ev.changed = TCHNG_REMOVED;
+        gettimeofday(&ev.time, NULL);
+        tabview_touch_handler(&ev, t);
+    }
+
+    t->pos = 0;
+    tabview_update_positions(t);
+
+    listview_destroy(view);
+    tabview_destroy(t);
+    fb_rm_rect(header);
+    fb_clear();
+}
+
+static void scene_tabs(struct bench_result *res, int frames)
+{
+    scene_tabs_run(res, frames, 1);
+}
+
+static void scene_tabs_direct(struct bench_result *res, int frames)
+{
+    scene_tabs_run(res, frames, 0);
+}
+
+static const struct bench_scene scenes[] = {
+    { "romlist", scene_romlist },
+    { "ncard", scene_ncard },
+    { "pong", scene_pong },
+    { "klog", scene_klog },
+    { "tabs", scene_tabs },
+    { "tabs_direct", scene_tabs_direct },
+};
+
+static void print_cache_stats(void)
+{
+    static const char *names[FB_CACHE_CNT] = { "glyphs", "strings", "png" };
+    struct fb_cache_stats st;
+    int i;
+
+    printf("%-10s %8s %8s %9s %8s %10s %10s\n",
+        "cache", "hits", "misses", "evictions", "entries", "bytes", "unused");
+    for(i = 0; i < FB_CACHE_CNT; ++i)
+    {
+        fb_cache_get_stats(i, &st);
+        printf("%-10s %8u %8u %9u %8u %10u %10u\n", names[i], st.hits, st.misses,
+            st.evictions, st.entries, (unsigned)st.bytes, (unsigned)st.unused_bytes);
+    }
+}
+
+static void print_usage(const char *name)
+{
+    printf("Usage: %s [-w WIDTH] [-h HEIGHT] [-r ROTATION] [-n FRAMES] [-c CACHE_BUDGET] [-d MULTIROM_DIR] [SCENE...]\n"
+           "Scenes:", name);
+    size_t i;
+    for(i = 0; i < ARRAY_SIZE(scenes); ++i)
+        printf(" %s", scenes[i].name);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int i, opt;
+    size_t s;
+    int w = DEFAULT_W, h = DEFAULT_H;
+    int rotation = 0;
+    int frames = DEFAULT_FRAMES;
+    const char *dir = "/data/media/0/multirom";
+
+    while((opt = getopt(argc, argv, "w:h:r:n:c:d:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'w': w = atoi(optarg); break;
+            case 'h': h = atoi(optarg); break;
+            case 'r': rotation = atoi(optarg); break;
+            case 'n': frames = atoi(optarg); break;
+            case 'c': fb_cache_set_budget(strtoul(optarg, NULL, 0)); break;
+            case 'd': dir = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(w <= 0 || h <= 0 || frames <= 0 || rotation % 90 != 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    mrom_set_dir(dir);
+    mrom_set_log_tag("fb_bench");
+
+    fb_force_memory_impl(w, h);
+    if(fb_open(rotation % 360) < 0)
+    {
+        fprintf(stderr, "Failed to open the memory framebuffer!\n");
+        return 1;
+    }
+
+    workers_start();
+    anim_init(1.0f);
+    fb_set_background(C_BACKGROUND);
+    fb_enable_frame_stats(1);
+
+    printf("fb_bench: %dx%d, rotation %d, %d bytes per pixel, %d frames per scene\n",
+        w, h, rotation % 360, PIXEL_SIZE, frames);
+    printf("%-10s %6s %9s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %9s %8s %8s\n",
+        "scene", "frames", "setup_us", "items", "culled", "fill", "rect", "img", "line", "list", "capture", "blit",
+        "update", "lock", "avg_us", "p95_us", "max_us");
+
+    for(s = 0; s < ARRAY_SIZE(scenes); ++s)
+    {
+        if(optind < argc)
+        {
+            for(i = optind; i < argc && strcmp(argv[i], scenes[s].name) != 0; ++i);
+            if(i == argc)
+                continue;
+        }
+
+        struct bench_result res;
+        memset(&res, 0, sizeof(res));
+        res.name = scenes[s].name;
+        res.frames = mzalloc(frames*sizeof(struct fb_frame_stats));
+
+        scenes[s].run(&res, frames);
+        bench_print(&res);
+        free(res.frames);
+    }
+
+    print_cache_stats();
+
+    anim_stop(0);
+    workers_stop();
+    fb_close();
+    return 0;
+}
@@ -17,15 +17,314 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "../lib/log.h"
 #include "../lib/util.h"
 
 #include <libbootimg.h>
 
-int kernel_inject(const char *img_path, const char *kernel_path)
+#define BOOT_MAGIC_STR "ANDROID!"
+
+// Layout of the v0 boot image header up to the id, which is all that is
+// needed to patch the kernel in place. The field after page_size is
+// dt_size on old Qualcomm images and header_version on newer ones, it has
+// to be 0 for the id to be just the three blobs.
+struct inject_hdr
+{
+    uint8_t magic[8];
+    uint32_t kernel_size;
+    uint32_t kernel_addr;
+    uint32_t ramdisk_size;
+    uint32_t ramdisk_addr;
+    uint32_t second_size;
+    uint32_t second_addr;
+    uint32_t tags_addr;
+    uint32_t page_size;
+    uint32_t dt_size;
+    uint32_t os_version;
+    uint8_t name[16];
+    uint8_t cmdline[512];
+    uint32_t id[8];
+};
+
+struct inject_kernel
+{
+    const char *path;
+    uint8_t *data;
+    uint32_t size;
+};
+
+struct sha1_ctx
+{
+    uint32_t h[5];
+    uint64_t len;
+    uint8_t buf[64];
+    uint32_t buf_len;
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(struct sha1_ctx *c, const uint8_t *p)
+{
+    uint32_t w[80], a, b, d, e, f, k, t, cc;
+    int i;
+
+    for(i = 0; i < 16; ++i)
+        w[i] = ((uint32_t)p[i*4] << 24) | (p[i*4+1] << 16) | (p[i*4+2] << 8) | p[i*4+3];
+    for(; i < 80; ++i)
+        w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+    a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3]; e = c->h[4];
+    for(i = 0; i < 80; ++i)
+    {
+        if(i < 20)
+        {
+            f = (b & cc) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if(i < 40)
+        {
+            f = b ^ cc ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if(i < 60)
+        {
+            f = (b & cc) | (b & d) | (cc & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ cc ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        t = ROL(a, 5) + f + e + k + w[i];
+        e = d; d = cc; cc = ROL(b, 30); b = a; a = t;
+    }
+
+    c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d; c->h[4] += e;
+}
+
+static void sha1_init(struct sha1_ctx *c)
+{
+    static const uint32_t init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    memset(c, 0, sizeof(*c));
+    memcpy(c->h, init, sizeof(init));
+}
+
+static void sha1_update(struct sha1_ctx *c, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t n;
+
+    c->len += len;
+    while(len)
+    {
+        if(c->buf_len == 0 && len >= 64)
+        {
+            sha1_block(c, p);
+            p += 64;
+            len -= 64;
+            continue;
+        }
+
+        n = 64 - c->buf_len;
+        if(n > len)
+            n = len;
+        memcpy(c->buf + c->buf_len, p, n);
+        c->buf_len += n;
+        p += n;
+        len -= n;
+
+        if(c->buf_len == 64)
+        {
+            sha1_block(c, c->buf);
+            c->buf_len = 0;
+        }
+    }
+}
+
+static void sha1_final(struct sha1_ctx *c, uint8_t out[20])
+{
+    const uint64_t bits = c->len * 8;
+    static const uint8_t pad = 0x80;
+    static const uint8_t zero = 0;
+    uint8_t len_be[8];
+    int i;
+
+    sha1_update(c, &pad, 1);
+    while(c->buf_len != 56)
+        sha1_update(c, &zero, 1);
+
+    for(i = 0; i < 8; ++i)
+        len_be[i] = bits >> (56 - i*8);
+    sha1_update(c, len_be, 8);
+
+    for(i = 0; i < 20; ++i)
+        out[i] = c->h[i/4] >> (24 - (i%4)*8);
+}
+
+static uint32_t inject_pages(uint32_t size, uint32_t page_size)
+{
+    return (size + page_size - 1) / page_size;
+}
+
+static int inject_load_kernel(struct inject_kernel *k, const char *path)
+{
+    struct stat info;
+    int fd, res = -1;
+
+    k->path = path;
+    k->data = NULL;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &info) < 0 || info.st_size <= 0 || info.st_size > UINT32_MAX)
+        goto exit;
+
+    k->size = info.st_size;
+    k->data = malloc(k->size);
+    if(read(fd, k->data, k->size) != (ssize_t)k->size)
+    {
+        free(k->data);
+        k->data = NULL;
+        goto exit;
+    }
+    res = 0;
+exit:
+    if(fd >= 0)
+        close(fd);
+    if(res < 0)
+        ERROR("Failed to load kernel from %s!\n", path);
+    return res;
+}
+
+// Replaces the kernel in a mapped boot image, if the new one takes up the
+// same number of pages, so that nothing else has to move. Returns -1 if
+// the image has to go through libbootimg instead.
+static int inject_patch_mapped(uint8_t *map, uint64_t size, struct inject_kernel *k)
+{
+    struct inject_hdr *hdr = (struct inject_hdr*)map;
+    struct sha1_ctx sha;
+    uint8_t digest[20];
+    uint64_t ramdisk_off, second_off;
+    uint32_t ps, sz;
+
+    if(size < sizeof(struct inject_hdr) || memcmp(hdr->magic, BOOT_MAGIC_STR, 8) != 0)
+        return -1;
+
+    ps = hdr->page_size;
+    if(ps < 2048 || (ps & (ps - 1)) != 0 || hdr->dt_size != 0)
+        return -1;
+
+    if(inject_pages(hdr->kernel_size, ps) != inject_pages(k->size, ps))
+        return -1;
+
+    ramdisk_off = (uint64_t)(1 + inject_pages(hdr->kernel_size, ps)) * ps;
+    second_off = ramdisk_off + (uint64_t)inject_pages(hdr->ramdisk_size, ps) * ps;
+    if(second_off + hdr->second_size > size)
+        return -1;
+
+    memcpy(map + ps, k->data, k->size);
+    memset(map + ps + k->size, 0, ramdisk_off - ps - k->size);
+    hdr->kernel_size = k->size;
+
+    sha1_init(&sha);
+    sz = hdr->kernel_size;
+    sha1_update(&sha, map + ps, sz);
+    sha1_update(&sha, &sz, sizeof(sz));
+    sz = hdr->ramdisk_size;
+    sha1_update(&sha, map + ramdisk_off, sz);
+    sha1_update(&sha, &sz, sizeof(sz));
+    sz = hdr->second_size;
+    sha1_update(&sha, map + second_off, sz);
+    sha1_update(&sha, &sz, sizeof(sz));
+    sha1_final(&sha, digest);
+
+    memset(hdr->id, 0, sizeof(hdr->id));
+    memcpy(hdr->id, digest, sizeof(digest));
+    return 0;
+}
+
+static int inject_write_all(int fd, const uint8_t *data, uint64_t size)
+{
+    ssize_t res;
+
+    while(size)
+    {
+        res = write(fd, data, size > (1 << 20) ? (1 << 20) : size);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res <= 0)
+            return -1;
+        data += res;
+        size -= res;
+    }
+    return 0;
+}
+
+// mmaps the image and patches it there, in place if out_path is NULL.
+// Returns 1 if the image is not suitable and has to use the slow path.
+static int kernel_inject_fast(const char *img_path, const char *out_path, struct inject_kernel *k)
+{
+    uint8_t *map;
+    off_t size;
+    int fd, out_fd, res = -1;
+
+    // block devices have no st_size, hence the lseek
+    fd = open(img_path, (out_path ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if(fd < 0 || (size = lseek(fd, 0, SEEK_END)) <= 0)
+    {
+        ERROR("Could not open boot image (%s)!\n", img_path);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    // a private mapping is just copy-on-write for the pages that change
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, out_path ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        ERROR("Failed to mmap %s: %s\n", img_path, strerror(errno));
+        return 1;
+    }
+
+    if(inject_patch_mapped(map, size, k) < 0)
+    {
+        munmap(map, size);
+        return 1;
+    }
+
+    if(!out_path)
+    {
+        if(msync(map, size, MS_SYNC) < 0)
+            ERROR("Failed to sync %s: %s\n", img_path, strerror(errno));
+        else
+            res = 0;
+    }
+    else
+    {
+        out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(out_fd < 0 || inject_write_all(out_fd, map, size) < 0 || fsync(out_fd) < 0)
+            ERROR("Failed to write %s: %s\n", out_path, strerror(errno));
+        else
+            res = 0;
+        if(out_fd >= 0)
+            close(out_fd);
+    }
+
+    munmap(map, size);
+    return res;
+}
+
+static int kernel_inject_slow(const char *img_path, const char *out_path, const char *kernel_path)
 {
     int res = -1;
     struct bootimg img;
@@ -42,6 +341,15 @@ int kernel_inject(const char *img_path, const char *kernel_path)
         goto exit;
     }
 
+    if (out_path)
+    {
+        if (libbootimg_write_img(&img, out_path) >= 0)
+            res = 0;
+        else
+            ERROR("Failed to libbootimg_write_img!\n");
+        goto exit;
+    }
+
     char tmp[256];
     strcpy(tmp, img_path);
     strcat(tmp, ".new");
@@ -64,12 +372,72 @@ exit:
     return res;
 }
 
+int kernel_inject(const char *img_path, const char *out_path, struct inject_kernel *k)
+{
+    int res;
+
+    if (out_path && strcmp(out_path, img_path) == 0)
+        out_path = NULL;
+
+    res = kernel_inject_fast(img_path, out_path, k);
+    if (res == 0)
+        INFO("Replaced kernel of %s without repacking\n", out_path ? out_path : img_path);
+    else if (res > 0)
+        res = kernel_inject_slow(img_path, out_path, k->path);
+    return res;
+}
+
+// Each line of the manifest is "<boot image> [<output>]", the image is
+// patched in place if there is no output. Lines are handled as they are
+// read, so the manifest can be streamed through a pipe.
+static int kernel_inject_batch(const char *manifest, struct inject_kernel *k)
+{
+    FILE *f;
+    char line[1024];
+    char *img, *out, *saveptr;
+    int failed = 0, cnt = 0;
+
+    if (strcmp(manifest, "-") == 0)
+        f = stdin;
+    else
+        f = fopen(manifest, "re");
+
+    if (!f)
+    {
+        ERROR("Failed to open manifest %s!\n", manifest);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        img = strtok_r(line, " \t\r\n", &saveptr);
+        if (!img || img[0] == '#')
+            continue;
+        out = strtok_r(NULL, " \t\r\n", &saveptr);
+
+        ++cnt;
+        if (kernel_inject(img, out, k) < 0)
+        {
+            ERROR("Failed to inject kernel into %s!\n", img);
+            ++failed;
+        }
+    }
+
+    if (f != stdin)
+        fclose(f);
+
+    INFO("Injected kernel into %d of %d boot images\n", cnt - failed, cnt);
+    return failed ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
     int i, res;
     static char *const cmd[] = { "/init", NULL };
     char *inject_path = NULL;
+    char *batch_path = NULL;
     char *kernel = NULL;
+    struct inject_kernel k;
 
     for (i = 1; i < argc; ++i)
     {
@@ -77,19 +445,34 @@ int main(int argc, char *argv[])
         {
             inject_path = argv[i] + strlen("--inject=");
         }
+        else if (strstartswith(argv[i], "--batch="))
+        {
+            batch_path = argv[i] + strlen("--batch=");
+        }
         else if (strstartswith(argv[i], "--kernel="))
         {
             kernel = argv[i] + strlen("--kernel=");
         }
     }
 
-    if (!inject_path || !kernel)
+    if ((!inject_path && !batch_path) || !kernel)
     {
-        printf("--inject=[path to bootimage to patch] --kernel=[path to the new kernel] needs to be specified!\n");
+        printf("--inject=[path to bootimage to patch] or --batch=[manifest of \"bootimage [output]\" lines, - for stdin] "
+            "and --kernel=[path to the new kernel] need to be specified!\n");
         fflush(stdout);
         return 1;
     }
 
     mrom_set_log_tag("kernel_inject");
-    return kernel_inject(inject_path, kernel);
+
+    if (inject_load_kernel(&k, kernel) < 0)
+        return 1;
+
+    if (inject_path)
+        res = kernel_inject(inject_path, NULL, &k);
+    else
+        res = kernel_inject_batch(batch_path, &k);
+
+    free(k.data);
+    return res < 0 ? 1 : 0;
 }
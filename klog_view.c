@@ -0,0 +1,163 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "lib/framebuffer.h"
+#include "lib/input.h"
+#include "lib/log.h"
+#include "lib/mem.h"
+#include "lib/termview.h"
+#include "lib/util.h"
+#include "klog_view.h"
+#include "multirom.h"
+
+#define KLOG_VIEW_ROWS 4000
+#define KLOG_VIEW_FONT (5*4)
+#define KMSG_RECORD_MAX 2048
+
+static int klog_view_open_kmsg(void)
+{
+    int fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd >= 0)
+        return fd;
+
+    static const char *name = "/dev/__kmsg_view__";
+    if(mknod(name, S_IFCHR | 0600, (1 << 8) | 11) == 0)
+    {
+        fd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        unlink(name);
+    }
+    return fd;
+}
+
+// Reads all records currently available in /dev/kmsg, formatted the same
+// way as dmesg does it. Returns 1 if anything was appended.
+static int klog_view_read_kmsg(int fd, termview *v)
+{
+    char rec[KMSG_RECORD_MAX];
+    char line[KMSG_RECORD_MAX + 32];
+    unsigned long long ts;
+    char *msg, *end;
+    int len, res = 0;
+
+    while(1)
+    {
+        len = read(fd, rec, sizeof(rec) - 1);
+        if(len < 0)
+        {
+            // the record was overwritten before we got to it, skip it
+            if(errno == EPIPE)
+                continue;
+            break;
+        }
+        else if(len == 0)
+            break;
+
+        rec[len] = 0;
+
+        // "<prio>,<seq>,<timestamp us>,<flags>;<message>\n[ KEY=value\n]..."
+        msg = strchr(rec, ';');
+        if(!msg || sscanf(rec, "%*u,%*u,%llu", &ts) != 1)
+            continue;
+
+        ++msg;
+        if((end = strchr(msg, '\n')))
+            *end = 0;
+
+        len = snprintf(line, sizeof(line), "[%5llu.%06llu] %s\n", ts/1000000, ts%1000000, msg);
+        termview_append(v, line, imin(len, sizeof(line) - 1));
+        res = 1;
+    }
+    return res;
+}
+
+void klog_view(void)
+{
+    int fd, y, run = 1;
+    char *klog;
+    termview *v;
+    fb_text *t;
+
+    fb_set_background(BLACK);
+
+    fb_text_proto *p = fb_text_create(5*DPI_MUL, 5*DPI_MUL, GRAYISH, SIZE_SMALL,
+            "Kernel log. Press power button to go back, volume keys to scroll.");
+    p->style = STYLE_ITALIC;
+    t = fb_text_finalize(p);
+
+    y = t->y + t->h + 5*DPI_MUL;
+    fb_add_rect(0, y, fb_width, 1, GRAYISH);
+    y += 1 + 2*DPI_MUL;
+
+    v = termview_create(0, y, fb_width, fb_height - y, KLOG_VIEW_FONT, KLOG_VIEW_ROWS);
+    if(!v)
+    {
+        fb_request_draw();
+        while(get_last_key() != KEY_POWER)
+            usleep(16000);
+        return;
+    }
+
+    fd = klog_view_open_kmsg();
+    if(fd < 0)
+    {
+        ERROR("klog_view: failed to open /dev/kmsg, showing a snapshot only\n");
+        klog = multirom_get_klog();
+        if(klog)
+        {
+            termview_append_tail(v, klog, strlen(klog));
+            mem_free(MEM_TAG_KLOG, klog);
+        }
+    }
+
+    add_touch_handler(&termview_touch_handler, v);
+
+    while(run)
+    {
+        switch(get_last_key())
+        {
+            case KEY_POWER:
+                run = 0;
+                break;
+            case KEY_VOLUMEUP:
+                termview_scroll_by(v, v->rows - 1);
+                break;
+            case KEY_VOLUMEDOWN:
+                termview_scroll_by(v, -(v->rows - 1));
+                break;
+        }
+
+        if(fd >= 0)
+            klog_view_read_kmsg(fd, v);
+
+        termview_update(v);
+        usleep(50000);
+    }
+
+    rm_touch_handler(&termview_touch_handler, v);
+
+    if(fd >= 0)
+        close(fd);
+    termview_destroy(v);
+}
@@ -6,9 +6,11 @@ common_SRC_FILES := \
     colors.c \
     containers.c \
     framebuffer.c \
+    framebuffer_cache.c \
     framebuffer_drm.c \
     framebuffer_fbdev.c \
     framebuffer_generic.c \
+    framebuffer_memory.c \
     framebuffer_png.c \
     framebuffer_truetype.c \
     fstab.c \
@@ -16,10 +18,12 @@ common_SRC_FILES := \
     input.c \
     listview.c \
     keyboard.c \
+    mem.c \
     mrom_data.c \
     notification_card.c \
     progressdots.c \
     tabview.c \
+    termview.c \
     touch_tracker.c \
     util.c \
     workers.c \
@@ -18,6 +18,8 @@
 #ifndef ANIMATION_H
 #define ANIMATION_H
 
+#include <stdint.h>
+
 enum
 {
     ANIM_TYPE_ITEM,
@@ -62,11 +62,11 @@ void list_add_at(ptrToList list_p, int idx, void *item)
     else if(idx >= size)
         idx = size - 1;
 
-    for(i = idx + 1; i < size; ++i)
+    (*list)[size] = NULL;
+    for(i = size - 1; i > idx; --i)
         (*list)[i] = (*list)[i-1];
 
     (*list)[idx] = item;
-    (*list)[i] = NULL;
 }
 
 int list_add_from_list(ptrToList list_p, listItself src_p)
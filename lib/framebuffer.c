@@ -29,10 +29,10 @@
 #include <assert.h>
 #include <linux/fb.h>
 #include <linux/kd.h>
-#include <cutils/memory.h>
 #include <pthread.h>
 #include <png.h>
 #include <math.h>
+#include <limits.h>
 
 #include "log.h"
 #include "framebuffer.h"
@@ -42,12 +42,24 @@
 #include "listview.h"
 #include "atomics.h"
 #include "mrom_data.h"
+#include "mem.h"
 
+#ifdef MR_HOST_BUILD
+// libcutils is not available on the host, len is in bytes like in android_memset*
+static void fb_memset(px_type *dst, px_type what, size_t len)
+{
+    px_type *end = dst + len/sizeof(px_type);
+    while(dst < end)
+        *dst++ = what;
+}
+#else
+#include <cutils/memory.h>
 #if PIXEL_SIZE == 4
 #define fb_memset(dst, what, len) android_memset32(dst, what, len)
 #else
 #define fb_memset(dst, what, len) android_memset16(dst, what, len)
 #endif
+#endif
 
 
 uint32_t fb_width = 0;
@@ -62,14 +74,63 @@ fb_item_pos DEFAULT_FB_PARENT = {
 static struct framebuffer fb;
 static int fb_frozen = 0;
 static int fb_force_generic = 0;
+static int fb_memory_xres = 0;
+static int fb_memory_yres = 0;
+static int fb_stats_enabled = 0;
+static struct fb_frame_stats fb_stats;
 
 static fb_context_t fb_ctx = {
-    .first_item = NULL,
+    .layers = NULL,
+    .buckets = NULL,
+    .buckets_cnt = 0,
+    .drawing = 0,
     .batch_started = 0,
     .background_color = BLACK,
     .mutex = PTHREAD_MUTEX_INITIALIZER
 };
 
+// The frame as it is rasterized, copied out of fb_ctx by fb_snapshot_take()
+struct fb_snap_item
+{
+    union
+    {
+        fb_item_header hdr;
+        fb_rect rect;
+        fb_img img;
+        fb_line line;
+    } it;
+    fb_item_pos parent;
+    fb_layer *layer;
+};
+
+struct fb_snap_layer
+{
+    fb_layer *layer;
+    int x, y;
+    int capture;
+    int draw_at; // index of the snapshot item the layer is blitted before
+};
+
+static struct
+{
+    uint32_t background_color;
+    struct fb_snap_item *items;
+    int items_cnt, items_alloc;
+    struct fb_snap_layer *layers;
+    int layers_cnt, layers_alloc;
+} fb_snap;
+
+// Pixels referenced by the snapshot must stay alive until it is drawn
+struct fb_deferred
+{
+    void (*call)(void*);
+    void *data;
+};
+
+static pthread_mutex_t fb_defer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fb_deferred **fb_deferred = NULL;
+static int fb_rasterizing = 0;
+
 static fb_context_t **inactive_ctx = NULL;
 static uint8_t **fb_rot_helpers = NULL;
 static pthread_t fb_draw_thread;
@@ -78,6 +139,7 @@ static pthread_mutex_t fb_draw_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t fb_draw_cond = PTHREAD_COND_INITIALIZER;
 static atomic_int fb_draw_requested = ATOMIC_VAR_INIT(0);
 static volatile int fb_draw_run = 0;
+static volatile uint64_t fb_draw_wakeup_us = 0; // last wake up of the draw thread
 static void *fb_draw_thread_work(void*);
 
 static void fb_destroy_item(void *item); // private!
@@ -88,31 +150,48 @@ static inline void fb_rotate_180deg(px_type *dst, px_type *src);
 
 int fb_open_impl(void)
 {
-    struct fb_impl **itr;
+    int i, first, last;
     struct fb_impl *impls[FB_IMPL_CNT];
 
 #define ADD_IMPL(ID, N) \
     extern struct fb_impl fb_impl_ ## N; \
     impls[ID] = &fb_impl_ ## N;
 
+#ifndef MR_HOST_BUILD
     ADD_IMPL(FB_IMPL_DRM, drm);
     ADD_IMPL(FB_IMPL_FBDEV, fbdev);
     ADD_IMPL(FB_IMPL_GENERIC, generic);
+#endif
+    ADD_IMPL(FB_IMPL_MEMORY, memory);
 #ifdef MR_USE_QCOM_OVERLAY
     ADD_IMPL(FB_IMPL_QCOM_OVERLAY, qcom_overlay);
 #endif
 
-    if(fb_force_generic)
-        itr = &impls[FB_IMPL_GENERIC];
+#ifdef MR_HOST_BUILD
+    // there are no display devices on the host
+    if(fb_memory_xres <= 0)
+    {
+        ERROR("Only the memory framebuffer is available in host builds\n");
+        return -1;
+    }
+#endif
+
+    if(fb_memory_xres > 0)
+        first = last = FB_IMPL_MEMORY;
+    else if(fb_force_generic)
+        first = last = FB_IMPL_GENERIC;
     else
-        itr = impls;
+    {
+        first = 0;
+        last = FB_IMPL_GENERIC;
+    }
 
-    for(; *itr; ++itr)
+    for(i = first; i <= last; ++i)
     {
-        if((*itr)->open(&fb) >= 0)
+        if(impls[i]->open(&fb) >= 0)
         {
-            INFO("Framebuffer implementation: %s\n", (*itr)->name);
-            fb.impl = *itr;
+            INFO("Framebuffer implementation: %s\n", impls[i]->name);
+            fb.impl = impls[i];
             return 0;
         }
     }
@@ -125,15 +204,25 @@ int fb_open(int rotation)
 {
     memset(&fb, 0, sizeof(struct framebuffer));
 
-    fb.fd = open("/dev/graphics/fb0", O_RDWR | O_CLOEXEC);
-    if (fb.fd < 0)
-        return -1;
+    if(fb_memory_xres > 0)
+    {
+        // headless, there is no device to get the screen info from
+        fb.fd = -1;
+        fb.vi.xres = fb_memory_xres;
+        fb.vi.yres = fb_memory_yres;
+    }
+    else
+    {
+        fb.fd = open("/dev/graphics/fb0", O_RDWR | O_CLOEXEC);
+        if (fb.fd < 0)
+            return -1;
 
-    if(ioctl(fb.fd, FBIOGET_VSCREENINFO, &fb.vi) < 0)
-        goto fail;
+        if(ioctl(fb.fd, FBIOGET_VSCREENINFO, &fb.vi) < 0)
+            goto fail;
 
-    if(ioctl(fb.fd, FBIOGET_FSCREENINFO, &fb.fi) < 0)
-        goto fail;
+        if(ioctl(fb.fd, FBIOGET_FSCREENINFO, &fb.fi) < 0)
+            goto fail;
+    }
 
     /*
      * No FBIOPUT_VSCREENINFO ioctl must be called here. Flo's display drivers
@@ -177,7 +266,7 @@ int fb_open(int rotation)
     fb.stride = (fb_rotation%180 == 0) ? fb.vi.xres_virtual : fb.vi.yres;
     fb.size = fb.vi.xres_virtual*fb.vi.yres*PIXEL_SIZE;
 
-    fb.buffer = malloc(fb.size);
+    fb.buffer = mem_alloc(MEM_TAG_FB, fb.size);
     fb_memset(fb.buffer, fb_convert_color(BLACK), fb.size);
 
 #if 0
@@ -196,7 +285,8 @@ int fb_open(int rotation)
     return 0;
 
 fail:
-    close(fb.fd);
+    if(fb.fd >= 0)
+        close(fb.fd);
     return -1;
 }
 
@@ -211,9 +301,15 @@ void fb_close(void)
     fb.impl->close(&fb);
     fb.impl = NULL;
 
-    close(fb.fd);
-    free(fb.buffer);
+    if(fb.fd >= 0)
+        close(fb.fd);
+    mem_free(MEM_TAG_FB, fb.buffer);
     fb.buffer = NULL;
+
+    fb_png_pool_stop();
+    fb_cache_dump_stats();
+    fb_png_drop_unused();
+    fb_text_drop_cache_unused();
 }
 
 void fb_dump_info(void)
@@ -288,6 +384,34 @@ void fb_force_generic_impl(int force)
     fb_force_generic = force;
 }
 
+void fb_force_memory_impl(int xres, int yres)
+{
+    fb_memory_xres = xres;
+    fb_memory_yres = yres;
+}
+
+void fb_enable_frame_stats(int enable)
+{
+    pthread_mutex_lock(&fb_draw_mutex);
+    fb_stats_enabled = enable;
+    memset(&fb_stats, 0, sizeof(fb_stats));
+    pthread_mutex_unlock(&fb_draw_mutex);
+}
+
+void fb_get_frame_stats(struct fb_frame_stats *stats)
+{
+    pthread_mutex_lock(&fb_draw_mutex);
+    memcpy(stats, &fb_stats, sizeof(fb_stats));
+    pthread_mutex_unlock(&fb_draw_mutex);
+}
+
+static inline uint64_t fb_stats_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
 void fb_update(void)
 {
     fb_cpy_fb_with_rotation(fb.impl->get_frame_dest(&fb), fb.buffer);
@@ -426,6 +550,49 @@ void fb_set_background(uint32_t color)
     fb_ctx.background_color = color;
 }
 
+// Runs call(data) now, or once the frame which is being rasterized is
+// done if that frame might still read what call releases.
+void fb_defer(void (*call)(void*), void *data)
+{
+    struct fb_deferred *d;
+
+    pthread_mutex_lock(&fb_defer_mutex);
+    if(fb_rasterizing)
+    {
+        d = mzalloc(sizeof(struct fb_deferred));
+        d->call = call;
+        d->data = data;
+        list_add(&fb_deferred, d);
+        pthread_mutex_unlock(&fb_defer_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&fb_defer_mutex);
+
+    call(data);
+}
+
+static void fb_defer_begin(void)
+{
+    pthread_mutex_lock(&fb_defer_mutex);
+    fb_rasterizing = 1;
+    pthread_mutex_unlock(&fb_defer_mutex);
+}
+
+static void fb_defer_end(void)
+{
+    struct fb_deferred **list, **itr;
+
+    pthread_mutex_lock(&fb_defer_mutex);
+    fb_rasterizing = 0;
+    list = fb_deferred;
+    fb_deferred = NULL;
+    pthread_mutex_unlock(&fb_defer_mutex);
+
+    for(itr = list; itr && *itr; ++itr)
+        (*itr)->call((*itr)->data);
+    list_clear(&list, &free);
+}
+
 void fb_batch_start(void)
 {
     pthread_mutex_lock(&fb_ctx.mutex);
@@ -451,80 +618,194 @@ void fb_items_unlock(void)
         pthread_mutex_unlock(&fb_ctx.mutex);
 }
 
-static void fb_ctx_put_it_before(fb_item_header *new_it, fb_item_header *next_it)
+static struct fb_item_bucket *fb_ctx_get_bucket(int level)
+{
+    int lo = 0, hi = fb_ctx.buckets_cnt, mid;
+    struct fb_item_bucket *b;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi)/2;
+        if(fb_ctx.buckets[mid]->level < level)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(lo < fb_ctx.buckets_cnt && fb_ctx.buckets[lo]->level == level)
+        return fb_ctx.buckets[lo];
+
+    b = mzalloc(sizeof(struct fb_item_bucket));
+    b->level = level;
+
+    fb_ctx.buckets = realloc(fb_ctx.buckets, (fb_ctx.buckets_cnt+1)*sizeof(struct fb_item_bucket*));
+    memmove(fb_ctx.buckets + lo + 1, fb_ctx.buckets + lo, (fb_ctx.buckets_cnt - lo)*sizeof(struct fb_item_bucket*));
+    fb_ctx.buckets[lo] = b;
+    ++fb_ctx.buckets_cnt;
+    return b;
+}
+
+// Must not be called while fb_draw() is going through the bucket
+static void fb_bucket_compact(struct fb_item_bucket *b)
 {
-    if(next_it->prev)
+    int i, n = 0;
+    for(i = 0; i < b->cnt; ++i)
     {
-        next_it->prev->next = new_it;
-        new_it->prev = next_it->prev;
+        if(!b->items[i])
+            continue;
+
+        b->items[n] = b->items[i];
+        b->items[n]->bucket_idx = n;
+        ++n;
     }
-    new_it->next = next_it;
-    next_it->prev = new_it;
+    b->cnt = n;
+    b->holes = 0;
 }
 
-static void fb_ctx_put_it_after(fb_item_header *new_it, fb_item_header *prev_it)
+static void fb_ctx_free_buckets(struct fb_item_bucket **buckets, int cnt, int destroy_items)
 {
-    if(prev_it->next)
+    int i, x;
+    for(i = 0; i < cnt; ++i)
     {
-        prev_it->next->prev = new_it;
-        new_it->next = prev_it->next;
+        for(x = 0; destroy_items && x < buckets[i]->cnt; ++x)
+            if(buckets[i]->items[x])
+                fb_destroy_item(buckets[i]->items[x]);
+        free(buckets[i]->items);
+        free(buckets[i]);
     }
-    new_it->prev = prev_it;
-    prev_it->next = new_it;
+    free(buckets);
 }
 
 void fb_ctx_add_item(void *item)
 {
     fb_item_header *h = item;
+    struct fb_item_bucket *b;
 
     fb_items_lock();
 
-    if(!fb_ctx.first_item)
-        fb_ctx.first_item = item;
-    else
+    b = fb_ctx_get_bucket(h->level);
+    if(b->cnt == b->alloc)
     {
-        fb_item_header *itr = fb_ctx.first_item;
-        while(1)
+        if(b->holes > b->cnt/4 && !fb_ctx.drawing)
+            fb_bucket_compact(b);
+        else
         {
-            if(itr->level > h->level)
-            {
-                if(itr == fb_ctx.first_item)
-                    fb_ctx.first_item = h;
-                fb_ctx_put_it_before(h, itr);
-                itr = NULL;
-                break;
-            }
-
-            if(itr->next)
-                itr = itr->next;
-            else
-                break;
+            b->alloc = imax(16, b->alloc*2);
+            b->items = realloc(b->items, b->alloc*sizeof(fb_item_header*));
         }
-
-        if(itr)
-            fb_ctx_put_it_after(h, itr);
     }
 
+    h->bucket = b;
+    h->bucket_idx = b->cnt;
+    b->items[b->cnt++] = h;
+
     fb_items_unlock();
 }
 
 void fb_ctx_rm_item(void *item)
 {
     fb_item_header *h = item;
+    struct fb_item_bucket *b = h->bucket;
+
+    if(!b)
+        return;
 
     fb_items_lock();
 
-    if(!h->prev)
-        fb_ctx.first_item = h->next;
+    b->items[h->bucket_idx] = NULL;
+    if(h->bucket_idx == b->cnt-1 && !fb_ctx.drawing)
+        --b->cnt;
     else
-        h->prev->next = h->next;
+        ++b->holes;
 
-    if(h->next)
-        h->next->prev = h->prev;
+    h->bucket = NULL;
+    h->bucket_idx = -1;
 
     fb_items_unlock();
 }
 
+static int compare_ptr(const void *a, const void *b)
+{
+    const uintptr_t x = (uintptr_t)*(void * const *)a;
+    const uintptr_t y = (uintptr_t)*(void * const *)b;
+    return (x > y) - (x < y);
+}
+
+static inline int fb_layer_has(fb_layer *l, const void *item)
+{
+    return bsearch(&item, l->items, l->items_cnt, sizeof(void*), compare_ptr) != NULL;
+}
+
+// fb_items_lock() must be held
+static fb_layer *fb_item_layer(fb_item_header *it)
+{
+    fb_layer **l;
+    for(l = fb_ctx.layers; l && *l; ++l)
+        if(fb_layer_has(*l, it) || fb_layer_has(*l, it->parent))
+            return *l;
+    return NULL;
+}
+
+fb_layer *fb_layer_create(int x, int y, int w, int h, void *items)
+{
+    fb_layer *l = mzalloc(sizeof(fb_layer));
+    l->x = l->src_x = x;
+    l->y = l->src_y = y;
+    l->w = w;
+    l->h = h;
+    l->data = mem_alloc(MEM_TAG_FB, w*h*PIXEL_SIZE);
+    l->items_cnt = list_item_count(items);
+    l->items = malloc(imax(1, l->items_cnt)*sizeof(void*));
+    memcpy(l->items, items, l->items_cnt*sizeof(void*));
+    qsort(l->items, l->items_cnt, sizeof(void*), compare_ptr);
+    l->dirty = 1;
+
+    fb_items_lock();
+    list_add(&fb_ctx.layers, l);
+    fb_items_unlock();
+    return l;
+}
+
+static void fb_layer_free(void *layer)
+{
+    fb_layer *l = layer;
+    mem_free(MEM_TAG_FB, l->data);
+    free(l->items);
+    free(l);
+}
+
+void fb_layer_destroy(fb_layer *l)
+{
+    if(!l)
+        return;
+
+    fb_items_lock();
+    list_rm(&fb_ctx.layers, l, NULL);
+    fb_items_unlock();
+
+    fb_defer(fb_layer_free, l);
+}
+
+void fb_layer_invalidate(fb_layer *l)
+{
+    l->dirty = 1;
+    fb_request_draw();
+}
+
+// For changes which don't show in the item's header, fb_items_lock()
+// must be held.
+void fb_layer_item_changed(void *item)
+{
+    fb_layer *l;
+
+    if(!fb_ctx.layers)
+        return;
+
+    l = fb_item_layer(item);
+    if(l)
+        l->dirty = 1;
+}
+
 void fb_remove_item(void *item)
 {
     switch(((fb_item_header*)item)->type)
@@ -544,10 +825,8 @@ void fb_remove_item(void *item)
     }
 }
 
-void fb_destroy_item(void *item)
+static void fb_destroy_item_now(void *item)
 {
-    anim_cancel_for(item, 0);
-
     switch(((fb_item_header*)item)->type)
     {
         case FB_IT_RECT:
@@ -559,7 +838,7 @@ void fb_destroy_item(void *item)
             switch(i->img_type)
             {
                 case FB_IMG_TYPE_PNG:
-                    fb_png_release(i->data);
+                    fb_png_release_img(i);
                     break;
                 case FB_IMG_TYPE_GENERIC:
                     free(i->data);
@@ -578,6 +857,12 @@ void fb_destroy_item(void *item)
     free(item);
 }
 
+void fb_destroy_item(void *item)
+{
+    anim_cancel_for(item, 0);
+    fb_defer(fb_destroy_item_now, item);
+}
+
 static inline void clamp_to_parent(void *it, int *min_x, int *max_x, int *min_y, int *max_y)
 {
     fb_item_header *h = it;
@@ -694,6 +979,10 @@ void fb_draw_img(fb_img *i)
     const uint8_t max_alpha = 31;
 #endif
 
+    // async PNG which wasn't decoded yet
+    if(!i->data)
+        return;
+
     int min_x, max_x, min_y, max_y;
     clamp_to_parent(i, &min_x, &max_x, &min_y, &max_y);
     const int rendered_w = max_x - min_x;
@@ -912,6 +1201,24 @@ fb_img* fb_add_png_img_lvl(int level, int x, int y, int w, int h, const char *pa
     return fb_add_img(level, x, y, w, h, FB_IMG_TYPE_PNG, data);
 }
 
+fb_img *fb_add_png_img_async_lvl(int level, int x, int y, int w, int h, const char *path)
+{
+    fb_img *result = mzalloc(sizeof(fb_img));
+    result->id = fb_generate_item_id();
+    result->type = FB_IT_IMG;
+    result->parent = &DEFAULT_FB_PARENT;
+    result->level = level;
+    result->x = x;
+    result->y = y;
+    result->img_type = FB_IMG_TYPE_PNG;
+    result->w = w;
+    result->h = h;
+
+    fb_png_load_async(path, w, h, result);
+    fb_ctx_add_item(result);
+    return result;
+}
+
 fb_circle *fb_add_circle_lvl(int level, int x, int y, int radius, uint32_t color)
 {
     const int diameter = radius*2 + 1;
@@ -983,52 +1290,452 @@ void fb_rm_line(fb_line *l)
     fb_destroy_item(l);
 }
 
+static void fb_fill_rect(int x, int y, int w, int h, uint32_t color)
+{
+    const px_type c = fb_convert_color(color);
+    px_type *bits;
+    int i;
+
+    x = imax(x, 0);
+    y = imax(y, 0);
+    w = imin(x + w, (int)fb_width) - x;
+    h = imin(y + h, (int)fb_height) - y;
+    if(w <= 0)
+        return;
+
+    bits = fb.buffer + fb.stride*y + x;
+    for(i = 0; i < h; ++i, bits += fb.stride)
+        fb_memset(bits, c, w*PIXEL_SIZE);
+}
+
 void fb_clear(void)
 {
     pthread_mutex_lock(&fb_ctx.mutex);
-    fb_item_header *it, *next;
-    for(it = fb_ctx.first_item; it; it = next)
+    fb_ctx_free_buckets(fb_ctx.buckets, fb_ctx.buckets_cnt, 1);
+    fb_ctx.buckets = NULL;
+    fb_ctx.buckets_cnt = 0;
+    pthread_mutex_unlock(&fb_ctx.mutex);
+
+    // keep what fits into the budget, the next screen likely uses
+    // the same fonts and images
+    fb_cache_trim(fb_cache_get_budget());
+}
+
+// Items which are scrolled away, on hidden pages or clipped away by
+// their parent don't have to go through the draw functions at all.
+static inline int fb_item_culled(fb_item_header *it)
+{
+    const fb_item_pos *p = it->parent;
+
+    if(it->type == FB_IT_LISTVIEW || it->type == FB_IT_LINE)
+        return 0;
+
+    return it->w <= 0 || it->h <= 0 ||
+        it->x + it->w <= imax(p->x, 0) || it->x >= imin(p->x + p->w, fb_width) ||
+        it->y + it->h <= imax(p->y, 0) || it->y >= imin(p->y + p->h, fb_height);
+}
+
+static void fb_draw_item(fb_item_header *it, struct fb_frame_stats *st, int stats)
+{
+    uint64_t t = 0, *bucket = NULL;
+
+    if(stats)
+        t = fb_stats_time_us();
+
+    switch(it->type)
     {
-        next = it->next;
-        fb_destroy_item(it);
+        case FB_IT_RECT:
+            fb_draw_rect((fb_rect*)it);
+            bucket = &st->rect_us;
+            break;
+        case FB_IT_IMG:
+            fb_draw_img((fb_img*)it);
+            bucket = &st->img_us;
+            break;
+        case FB_IT_LINE:
+            fb_draw_line((fb_line*)it);
+            bucket = &st->line_us;
+            break;
     }
-    fb_ctx.first_item = NULL;
-    pthread_mutex_unlock(&fb_ctx.mutex);
 
-    fb_png_drop_unused();
-    fb_text_drop_cache_unused();
+    if(stats && bucket)
+    {
+        *bucket += fb_stats_time_us() - t;
+        ++st->items;
+    }
 }
 
-static void fb_draw(void)
+static inline uint32_t sig_add(uint32_t sig, uint32_t val)
+{
+    return (sig ^ val) * 16777619;
+}
+
+// Everything which moves or changes what an item draws
+static uint32_t fb_item_sig(uint32_t sig, fb_item_header *it)
+{
+    sig = sig_add(sig, (uint32_t)(uintptr_t)it);
+    sig = sig_add(sig, it->x);
+    sig = sig_add(sig, it->y);
+    sig = sig_add(sig, it->w);
+    sig = sig_add(sig, it->h);
+
+    switch(it->type)
+    {
+        case FB_IT_RECT:
+            sig = sig_add(sig, ((fb_rect*)it)->color);
+            break;
+        case FB_IT_IMG:
+            sig = sig_add(sig, (uint32_t)(uintptr_t)((fb_img*)it)->data);
+            break;
+        case FB_IT_LINE:
+            sig = sig_add(sig, ((fb_line*)it)->x2);
+            sig = sig_add(sig, ((fb_line*)it)->y2);
+            sig = sig_add(sig, ((fb_line*)it)->color);
+            break;
+    }
+    return sig;
+}
+
+// Listviews add and remove items while they are laid out, so the buckets
+// can change under the loop. Index them again on every step and never go
+// back to a level which was already done.
+static void fb_update_listviews(struct fb_frame_stats *st, int stats)
 {
+    int b_idx, i, last_level = INT_MIN;
+    struct fb_item_bucket *b;
     fb_item_header *it;
+    uint64_t t = 0;
 
-    fb_fill(fb_ctx.background_color);
+    fb_ctx.drawing = 1;
+    for(b_idx = 0; b_idx < fb_ctx.buckets_cnt; ++b_idx)
+    {
+        b = fb_ctx.buckets[b_idx];
+        if(b->level <= last_level)
+            continue;
+        last_level = b->level;
 
-    fb_batch_start();
-    for(it = fb_ctx.first_item; it; it = it->next)
+        for(i = 0; i < b->cnt; ++i)
+        {
+            it = b->items[i];
+            if(!it || it->type != FB_IT_LISTVIEW)
+                continue;
+
+            if(stats)
+                t = fb_stats_time_us();
+            listview_update_ui_args((listview*)it, 1, 1);
+            if(stats)
+                st->listview_us += fb_stats_time_us() - t;
+        }
+    }
+    fb_ctx.drawing = 0;
+}
+
+// Layers which changed since they were copied are marked for capture
+static void fb_layers_update(void)
+{
+    int b_idx, i;
+    struct fb_item_bucket *b;
+    fb_item_header *it;
+    fb_layer **l;
+
+    for(l = fb_ctx.layers; *l; ++l)
+        (*l)->next_sig = 2166136261u;
+
+    // the items are not drawn, so changes have to be spotted by comparing
+    // a signature of what they look like
+    for(b_idx = 0; b_idx < fb_ctx.buckets_cnt; ++b_idx)
     {
-        switch(it->type)
+        b = fb_ctx.buckets[b_idx];
+        for(i = 0; i < b->cnt; ++i)
         {
-            case FB_IT_RECT:
-                fb_draw_rect((fb_rect*)it);
-                break;
-            case FB_IT_IMG:
-                fb_draw_img((fb_img*)it);
-                break;
-            case FB_IT_LISTVIEW:
-                listview_update_ui_args((listview*)it, 1, 1);
-                break;
-            case FB_IT_LINE:
-                fb_draw_line((fb_line*)it);
-                break;
+            fb_layer *owner;
+            it = b->items[i];
+            if(it && (owner = fb_item_layer(it)))
+                owner->next_sig = fb_item_sig(owner->next_sig, it);
+        }
+    }
+}
+
+static void fb_snapshot_add(fb_item_header *it, fb_layer *layer)
+{
+    struct fb_snap_item *s;
+    size_t size = 0;
+
+    switch(it->type)
+    {
+        case FB_IT_RECT: size = sizeof(fb_rect); break;
+        case FB_IT_IMG:  size = sizeof(fb_img); break;
+        case FB_IT_LINE: size = sizeof(fb_line); break;
+        default: return;
+    }
+
+    if(fb_snap.items_cnt == fb_snap.items_alloc)
+    {
+        fb_snap.items_alloc = imax(64, fb_snap.items_alloc*2);
+        fb_snap.items = realloc(fb_snap.items, fb_snap.items_alloc*sizeof(struct fb_snap_item));
+    }
+
+    s = &fb_snap.items[fb_snap.items_cnt++];
+    memcpy(&s->it, it, size);
+    memcpy(&s->parent, it->parent, sizeof(fb_item_pos));
+    s->it.hdr.parent = &s->parent;
+    s->layer = layer;
+}
+
+static struct fb_snap_layer *fb_snapshot_layer(fb_layer *l)
+{
+    int i;
+    for(i = 0; i < fb_snap.layers_cnt; ++i)
+        if(fb_snap.layers[i].layer == l)
+            return &fb_snap.layers[i];
+    return NULL;
+}
+
+// Copies everything the frame needs out of the scene, so that it can be
+// rasterized without fb_ctx.mutex. Called with the mutex held.
+static void fb_snapshot_take(struct fb_frame_stats *st, int stats)
+{
+    int b_idx, i;
+    struct fb_item_bucket *b;
+    fb_item_header *it;
+    fb_layer **l, *owner;
+    struct fb_snap_layer *sl;
+
+    fb_snap.background_color = fb_ctx.background_color;
+    fb_snap.items_cnt = 0;
+    fb_snap.layers_cnt = 0;
+
+    for(l = fb_ctx.layers; l && *l; ++l)
+    {
+        if(fb_snap.layers_cnt == fb_snap.layers_alloc)
+        {
+            fb_snap.layers_alloc = imax(4, fb_snap.layers_alloc*2);
+            fb_snap.layers = realloc(fb_snap.layers, fb_snap.layers_alloc*sizeof(struct fb_snap_layer));
+        }
+
+        sl = &fb_snap.layers[fb_snap.layers_cnt++];
+        sl->layer = *l;
+        sl->x = (*l)->x;
+        sl->y = (*l)->y;
+        sl->capture = (*l)->dirty || (*l)->next_sig != (*l)->sig;
+        sl->draw_at = -1;
+
+        (*l)->sig = (*l)->next_sig;
+        (*l)->dirty = 0;
+    }
+
+    for(b_idx = 0; b_idx < fb_ctx.buckets_cnt; ++b_idx)
+    {
+        b = fb_ctx.buckets[b_idx];
+        for(i = 0; i < b->cnt; ++i)
+        {
+            it = b->items[i];
+            if(!it || it->type == FB_IT_LISTVIEW)
+                continue;
+
+            // the layer takes the place of its lowest item in the z-order
+            owner = fb_ctx.layers ? fb_item_layer(it) : NULL;
+            if(owner && (sl = fb_snapshot_layer(owner)) && sl->draw_at == -1)
+                sl->draw_at = fb_snap.items_cnt;
+
+            if(fb_item_culled(it))
+            {
+                if(stats)
+                    ++st->culled;
+                continue;
+            }
+
+            fb_snapshot_add(it, owner);
         }
     }
+}
+
+// Draws the snapshot items of layer l, or the ones in no layer if l is NULL
+static void fb_snapshot_draw(fb_layer *l, struct fb_frame_stats *st, int stats)
+{
+    int i;
+    for(i = 0; i < fb_snap.items_cnt; ++i)
+        if(fb_snap.items[i].layer == l)
+            fb_draw_item(&fb_snap.items[i].it.hdr, st, stats);
+}
+
+static void fb_layer_capture(fb_layer *l, struct fb_frame_stats *st, int stats)
+{
+    int y;
+    const int x0 = imax(l->src_x, 0);
+    const int x1 = imin(l->src_x + l->w, (int)fb_width);
+    const int y0 = imax(l->src_y, 0);
+    const int y1 = imin(l->src_y + l->h, (int)fb_height);
+
+    // the back buffer is drawn over right after this, use it as scratch
+    fb_fill_rect(l->src_x, l->src_y, l->w, l->h, fb_snap.background_color);
+    fb_snapshot_draw(l, st, stats);
+
+    for(y = y0; x1 > x0 && y < y1; ++y)
+    {
+        memcpy(l->data + (y - l->src_y)*l->w + (x0 - l->src_x),
+            fb.buffer + fb.stride*y + x0, (x1 - x0)*PIXEL_SIZE);
+    }
+}
+
+static void fb_layer_blit(struct fb_snap_layer *sl)
+{
+    int y;
+    fb_layer *l = sl->layer;
+    const int x0 = imax(sl->x, 0);
+    const int x1 = imin(sl->x + l->w, (int)fb_width);
+    const int y0 = imax(sl->y, 0);
+    const int y1 = imin(sl->y + l->h, (int)fb_height);
+
+    for(y = y0; x1 > x0 && y < y1; ++y)
+    {
+        memcpy(fb.buffer + fb.stride*y + x0,
+            l->data + (y - sl->y)*l->w + (x0 - sl->x), (x1 - x0)*PIXEL_SIZE);
+    }
+}
+
+// Draws the items which are in no layer and blits the layers in between,
+// in the same order as if the layers' items were drawn directly
+static void fb_snapshot_draw_layered(struct fb_frame_stats *st, int stats)
+{
+    int i, k;
+    uint64_t t = 0;
+
+    for(i = 0; i <= fb_snap.items_cnt; ++i)
+    {
+        for(k = 0; k < fb_snap.layers_cnt; ++k)
+        {
+            if(fb_snap.layers[k].draw_at != i && (i != 0 || fb_snap.layers[k].draw_at != -1))
+                continue;
+
+            if(stats)
+                t = fb_stats_time_us();
+            fb_layer_blit(&fb_snap.layers[k]);
+            if(stats)
+                st->blit_us += fb_stats_time_us() - t;
+        }
+
+        if(i < fb_snap.items_cnt && !fb_snap.items[i].layer)
+            fb_draw_item(&fb_snap.items[i].it.hdr, st, stats);
+    }
+}
+
+// Layers are opaque, so only the background around them needs filling
+static void fb_fill_around_layers(uint32_t color)
+{
+    int i, x, y, next;
+    struct fb_snap_layer *sl;
+    const px_type c = fb_convert_color(color);
+    px_type *bits = fb.buffer;
+
+    for(y = 0; y < (int)fb_height; ++y, bits += fb.stride)
+    {
+        for(x = 0; x < (int)fb_width; )
+        {
+            next = fb_width;
+            for(i = 0; i < fb_snap.layers_cnt; ++i)
+            {
+                sl = &fb_snap.layers[i];
+                if(y < sl->y || y >= sl->y + sl->layer->h || x >= sl->x + sl->layer->w)
+                    continue;
+
+                if(sl->x <= x)
+                {
+                    next = -1;
+                    x = sl->x + sl->layer->w;
+                    break;
+                }
+                next = imin(next, sl->x);
+            }
+
+            if(next == -1)
+                continue;
+
+            fb_memset(bits + x, c, (next - x)*PIXEL_SIZE);
+            x = next;
+        }
+    }
+}
+
+static void fb_draw(void)
+{
+    int i;
+    struct fb_frame_stats st;
+    uint64_t start = 0, t = 0;
+    const int stats = fb_stats_enabled;
+
+    if(stats)
+    {
+        memset(&st, 0, sizeof(st));
+        start = t = fb_stats_time_us();
+    }
+
+    // Only the snapshot is taken with the items locked, input handlers and
+    // animations can go on while it is being rasterized.
+    fb_batch_start();
+
+    for(i = 0; i < fb_ctx.buckets_cnt; ++i)
+        if(fb_ctx.buckets[i]->holes)
+            fb_bucket_compact(fb_ctx.buckets[i]);
+
+    fb_update_listviews(&st, stats);
+
+    if(fb_ctx.layers)
+        fb_layers_update();
+
+    fb_snapshot_take(&st, stats);
+    fb_defer_begin();
+
     fb_batch_end();
 
+    if(stats)
+    {
+        t = fb_stats_time_us();
+        st.lock_us = t - start;
+    }
+
+    for(i = 0; i < fb_snap.layers_cnt; ++i)
+        if(fb_snap.layers[i].capture)
+            fb_layer_capture(fb_snap.layers[i].layer, &st, stats);
+
+    if(stats)
+    {
+        const uint64_t now = fb_stats_time_us();
+        st.capture_us = now - t;
+        t = now;
+    }
+
+    if(fb_snap.layers_cnt)
+        fb_fill_around_layers(fb_snap.background_color);
+    else
+        fb_fill(fb_snap.background_color);
+
+    if(stats)
+        st.fill_us = fb_stats_time_us() - t;
+
+    if(fb_snap.layers_cnt)
+        fb_snapshot_draw_layered(&st, stats);
+    else
+        fb_snapshot_draw(NULL, &st, stats);
+
+    // whatever was removed while rasterizing can go now
+    fb_defer_end();
+
+    if(stats)
+        t = fb_stats_time_us();
+
     pthread_mutex_lock(&fb_update_mutex);
     fb_update();
     pthread_mutex_unlock(&fb_update_mutex);
+
+    if(stats)
+    {
+        const uint64_t end = fb_stats_time_us();
+        st.update_us = end - t;
+        st.total_us = end - start;
+        st.frame = fb_stats.frame + 1;
+        fb_stats = st;
+    }
 }
 
 void fb_freeze(int freeze)
@@ -1053,9 +1760,13 @@ void fb_push_context(void)
     fb_context_t *ctx = mzalloc(sizeof(fb_context_t));
 
     pthread_mutex_lock(&fb_ctx.mutex);
-    ctx->first_item = fb_ctx.first_item;
+    ctx->buckets = fb_ctx.buckets;
+    ctx->buckets_cnt = fb_ctx.buckets_cnt;
+    ctx->layers = fb_ctx.layers;
     ctx->background_color = fb_ctx.background_color;
-    fb_ctx.first_item = NULL;
+    fb_ctx.buckets = NULL;
+    fb_ctx.buckets_cnt = 0;
+    fb_ctx.layers = NULL;
     pthread_mutex_unlock(&fb_ctx.mutex);
 
     list_add(&inactive_ctx, ctx);
@@ -1072,7 +1783,10 @@ void fb_pop_context(void)
     fb_context_t *ctx = inactive_ctx[idx];
 
     pthread_mutex_lock(&fb_ctx.mutex);
-    fb_ctx.first_item = ctx->first_item;
+    fb_ctx.buckets = ctx->buckets;
+    fb_ctx.buckets_cnt = ctx->buckets_cnt;
+    list_clear(&fb_ctx.layers, NULL);
+    fb_ctx.layers = ctx->layers;
     fb_ctx.background_color = ctx->background_color;
     pthread_mutex_unlock(&fb_ctx.mutex);
 
@@ -1082,6 +1796,24 @@ void fb_pop_context(void)
 }
 
 #define SLEEP_CONST 16
+
+// Input is resampled to this time, so that a frame gets the finger
+// position from when it is drawn rather than from whenever the last
+// event came in.
+uint64_t fb_next_frame_us(void)
+{
+    const uint64_t now = fb_stats_time_us();
+    uint64_t next = fb_draw_wakeup_us;
+
+    if(next == 0)
+        return now;
+
+    next += SLEEP_CONST*1000;
+    while(next < now)
+        next += SLEEP_CONST*1000;
+    return next;
+}
+
 void *fb_draw_thread_work(UNUSED void *cookie)
 {
     struct timespec last, curr;
@@ -1094,6 +1826,7 @@ void *fb_draw_thread_work(UNUSED void *cookie)
     {
         clock_gettime(CLOCK_MONOTONIC, &curr);
         diff = timespec_diff(&last, &curr);
+        fb_draw_wakeup_us = ((uint64_t)curr.tv_sec)*1000000 + curr.tv_nsec/1000;
 
 #if (PLATFORM_SDK_VERSION >= 25)
         expected = 1; // might be reseted by atomic_compare_exchange_strong
@@ -20,6 +20,7 @@
 
 #include <linux/fb.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #if defined(RECOVERY_BGRA) || defined(RECOVERY_RGBX) || defined(RECOVERY_RGBA) || defined(RECOVERY_ABGR)
@@ -104,10 +105,28 @@ enum
 #endif
     FB_IMPL_DRM,
     FB_IMPL_FBDEV,
-    FB_IMPL_GENERIC, // must be last
+    FB_IMPL_GENERIC, // must be last of the display implementations
+    FB_IMPL_MEMORY, // headless, only used when forced
     FB_IMPL_CNT
 };
 
+// Timings of the last drawn frame, in microseconds
+struct fb_frame_stats {
+    uint32_t frame;
+    uint32_t items;
+    uint32_t culled;
+    uint64_t fill_us;
+    uint64_t rect_us;
+    uint64_t img_us;
+    uint64_t line_us;
+    uint64_t listview_us;
+    uint64_t update_us;
+    uint64_t total_us;
+    uint64_t lock_us; // fb_ctx.mutex held to take the snapshot
+    uint64_t capture_us; // copying changed layers, including their items' draws
+    uint64_t blit_us; // layers blitted into the frame
+};
+
 // Colors, 0xAARRGGBB
 #define BLACK     0xFF000000
 #define WHITE     0xFFFFFFFF
@@ -138,6 +157,9 @@ void fb_dump_info(void);
 int fb_get_vi_xres(void);
 int fb_get_vi_yres(void);
 void fb_force_generic_impl(int force);
+void fb_force_memory_impl(int xres, int yres); // 0, 0 to disable
+void fb_enable_frame_stats(int enable);
+void fb_get_frame_stats(struct fb_frame_stats *stats);
 
 enum
 {
@@ -185,6 +207,7 @@ enum
 };
 
 struct fb_item_header;
+struct fb_item_bucket;
 
 #define FB_ITEM_POS \
     int x, y; \
@@ -203,8 +226,8 @@ extern fb_item_pos DEFAULT_FB_PARENT;
     int type; \
     int level; \
     fb_item_pos *parent; \
-    struct fb_item_header *prev; \
-    struct fb_item_header *next;
+    struct fb_item_bucket *bucket; \
+    int bucket_idx;
 
 struct fb_item_header
 {
@@ -253,10 +276,44 @@ typedef struct
     uint32_t color;
 } fb_line;
 
+/*
+ * Items of one level in the order they were added. Removed items leave
+ * a NULL hole behind, the holes are compacted away later.
+ */
+struct fb_item_bucket
+{
+    int level;
+    int cnt; // including holes
+    int holes;
+    int alloc;
+    fb_item_header **items;
+};
+
+/*
+ * Layer is an offscreen copy of a group of items (and of their children),
+ * taken with the items at src_x/src_y. While the layer exists, the items
+ * aren't drawn, the copy is blitted at x/y instead. That is much cheaper
+ * when the whole group only moves, e.g. tabview pages during a swipe.
+ * The copy is taken again when the items change.
+ */
+typedef struct
+{
+    FB_ITEM_POS
+    int src_x, src_y;
+    px_type *data;
+    void **items; // sorted
+    int items_cnt;
+    uint32_t sig, next_sig; // of the items when copied, and now
+    int dirty;
+} fb_layer;
+
 typedef struct
 {
     uint32_t background_color;
-    fb_item_header *first_item;
+    fb_layer **layers;
+    struct fb_item_bucket **buckets; // sorted by level
+    int buckets_cnt;
+    int drawing;
     pthread_mutex_t mutex;
     volatile int batch_started;
     volatile pthread_t batch_thread;
@@ -291,6 +348,38 @@ char *fb_text_get_content(fb_img *img);
 void fb_text_drop_cache_unused(void);
 void fb_text_destroy(fb_img *i);
 
+// Size of the text as fb_text_finalize() would render it, without rendering it
+typedef struct
+{
+    int w, h;
+    int baseline;
+} fb_text_metrics;
+
+int fb_text_measure(const fb_text_proto *p, fb_text_metrics *m);
+// Biggest size in <min_size; p->size> for which the text is narrower than max_w
+int fb_text_fit_size(const fb_text_proto *p, int max_w, int min_size);
+
+/*
+ * Fixed-cell glyph cache for fixed-width text (see termview.h). Printable
+ * ASCII glyphs are rasterized once into cell_w*cell_h coverage maps, so
+ * drawing a character is just a copy through a color lookup table.
+ */
+#define FB_CELL_FIRST 0x20
+#define FB_CELL_LAST  0x7E
+#define FB_CELL_GLYPHS (FB_CELL_LAST - FB_CELL_FIRST + 1)
+
+typedef struct
+{
+    int size;
+    int cell_w, cell_h;
+    int baseline;
+    uint8_t *coverage; // FB_CELL_GLYPHS maps of cell_w*cell_h
+    uint8_t empty[FB_CELL_GLYPHS];
+} fb_cell_font;
+
+fb_cell_font *fb_cell_font_create(int style, int size);
+void fb_cell_font_destroy(fb_cell_font *f);
+
 fb_rect *fb_add_rect_lvl(int level, int x, int y, int w, int h, uint32_t color);
 #define fb_add_rect(x, y, w, h, color) fb_add_rect_lvl(LEVEL_RECT, x, y, w, h, color)
 void fb_add_rect_notfilled(int level, int x, int y, int w, int h, uint32_t color, int thickness, fb_rect ***list);
@@ -298,6 +387,10 @@ void fb_add_rect_notfilled(int level, int x, int y, int w, int h, uint32_t color
 fb_img *fb_add_img(int level, int x, int y, int w, int h, int img_type, px_type *data);
 fb_img *fb_add_png_img_lvl(int level, int x, int y, int w, int h, const char *path);
 #define fb_add_png_img(x, y, w, h, path) fb_add_png_img_lvl(LEVEL_PNG, x, y, w, h, path)
+// Returns an empty img right away, the pixels are filled in once a
+// background thread decodes the file. Meant for user-provided icons.
+fb_img *fb_add_png_img_async_lvl(int level, int x, int y, int w, int h, const char *path);
+#define fb_add_png_img_async(x, y, w, h, path) fb_add_png_img_async_lvl(LEVEL_PNG, x, y, w, h, path)
 
 fb_circle *fb_add_circle_lvl(int level, int x, int y, int radius, uint32_t color);
 #define fb_add_circle(x, y, radius, color) fb_add_circle_lvl(LEVEL_CIRCLE, x, y, radius, color)
@@ -316,6 +409,7 @@ void fb_draw_img(fb_img *i);
 void fb_draw_line(fb_line *l);
 void fb_fill(uint32_t color);
 void fb_request_draw(void);
+uint64_t fb_next_frame_us(void); // CLOCK_MONOTONIC
 void fb_force_draw(void);
 void fb_clear(void);
 void fb_freeze(int freeze);
@@ -333,11 +427,69 @@ void fb_ctx_add_item(void *item);
 void fb_ctx_rm_item(void *item);
 void fb_items_lock(void);
 void fb_items_unlock(void);
+void fb_defer(void (*call)(void*), void *data);
 void fb_set_background(uint32_t color);
 
+fb_layer *fb_layer_create(int x, int y, int w, int h, void *items);
+void fb_layer_destroy(fb_layer *l);
+void fb_layer_invalidate(fb_layer *l);
+void fb_layer_item_changed(void *item);
+
+/*
+ * Glyphs, rendered strings and PNG images are kept in caches after they
+ * are no longer used, so that they don't have to be loaded again. Unused
+ * entries are evicted in least-recently-used order once all the caches
+ * together take more than the budget.
+ */
+enum
+{
+    FB_CACHE_GLYPHS,
+    FB_CACHE_STRINGS,
+    FB_CACHE_PNG,
+
+    FB_CACHE_CNT
+};
+
+struct fb_cache_entry
+{
+    struct fb_cache_entry *lru_prev;
+    struct fb_cache_entry *lru_next;
+    size_t bytes;
+    int type;
+    int refcnt;
+};
+
+struct fb_cache_stats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t entries;
+    size_t bytes;
+    size_t unused_bytes;
+};
+
+void fb_cache_lock(void);
+void fb_cache_unlock(void);
+void fb_cache_set_budget(size_t bytes);
+size_t fb_cache_get_budget(void);
+void fb_cache_add(struct fb_cache_entry *e, int type, size_t bytes);
+void fb_cache_ref(struct fb_cache_entry *e);
+// e must not be used after this, it is evicted right away if the cache
+// is over budget
+void fb_cache_unref(struct fb_cache_entry *e);
+void fb_cache_resize(struct fb_cache_entry *e, size_t bytes);
+void fb_cache_trim(size_t max_bytes);
+void fb_cache_drop_unused(int type);
+void fb_cache_get_stats(int type, struct fb_cache_stats *st);
+void fb_cache_dump_stats(void);
+
 px_type *fb_png_get(const char *path, int w, int h);
 void fb_png_release(px_type *data);
 void fb_png_drop_unused(void);
+void fb_png_load_async(const char *path, int w, int h, fb_img *img);
+void fb_png_release_img(fb_img *img);
+void fb_png_pool_stop(void);
 int fb_png_save_img(const char *path, int w, int h, int stride, px_type *data);
 
 void center_text(fb_img *text, int targetX, int targetY, int targetW, int targetH);
@@ -0,0 +1,251 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "framebuffer.h"
+
+#ifndef MR_FB_CACHE_BUDGET
+#define MR_FB_CACHE_BUDGET (8*1024*1024)
+#endif
+
+#if 0
+#define CACHE_LOG(x...) INFO(x)
+#else
+#define CACHE_LOG(x...) ;
+#endif
+
+// The owners of the entries, these remove the entry from their own
+// structures and free it. They must not call back into fb_cache_*.
+extern void fb_text_evict_glyphs(struct fb_cache_entry *e);
+extern void fb_text_evict_string(struct fb_cache_entry *e);
+extern void fb_png_evict(struct fb_cache_entry *e);
+
+static void (* const evict_callbacks[FB_CACHE_CNT])(struct fb_cache_entry *) = {
+    [FB_CACHE_GLYPHS] = fb_text_evict_glyphs,
+    [FB_CACHE_STRINGS] = fb_text_evict_string,
+    [FB_CACHE_PNG] = fb_png_evict,
+};
+
+static const char *cache_names[FB_CACHE_CNT] = {
+    [FB_CACHE_GLYPHS] = "glyphs",
+    [FB_CACHE_STRINGS] = "strings",
+    [FB_CACHE_PNG] = "png",
+};
+
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_once_t once;
+    size_t budget;
+    size_t bytes;
+
+    // unused entries, least recently used first
+    struct fb_cache_entry *lru_first;
+    struct fb_cache_entry *lru_last;
+
+    struct fb_cache_stats stats[FB_CACHE_CNT];
+} fb_cache = {
+    .once = PTHREAD_ONCE_INIT,
+    .budget = MR_FB_CACHE_BUDGET,
+};
+
+static void fb_cache_init(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fb_cache.mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void fb_cache_lock(void)
+{
+    pthread_once(&fb_cache.once, fb_cache_init);
+    pthread_mutex_lock(&fb_cache.mutex);
+}
+
+void fb_cache_unlock(void)
+{
+    pthread_mutex_unlock(&fb_cache.mutex);
+}
+
+static void lru_unlink(struct fb_cache_entry *e)
+{
+    if(e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        fb_cache.lru_first = e->lru_next;
+
+    if(e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        fb_cache.lru_last = e->lru_prev;
+
+    e->lru_prev = e->lru_next = NULL;
+    fb_cache.stats[e->type].unused_bytes -= e->bytes;
+}
+
+static void lru_append(struct fb_cache_entry *e)
+{
+    e->lru_next = NULL;
+    e->lru_prev = fb_cache.lru_last;
+    if(fb_cache.lru_last)
+        fb_cache.lru_last->lru_next = e;
+    else
+        fb_cache.lru_first = e;
+    fb_cache.lru_last = e;
+    fb_cache.stats[e->type].unused_bytes += e->bytes;
+}
+
+static void fb_cache_evict(struct fb_cache_entry *e)
+{
+    struct fb_cache_stats *st = &fb_cache.stats[e->type];
+
+    CACHE_LOG("fb_cache: evicting %s entry %p, %u bytes\n", cache_names[e->type], e, (unsigned)e->bytes);
+
+    lru_unlink(e);
+    fb_cache.bytes -= e->bytes;
+    st->bytes -= e->bytes;
+    --st->entries;
+    ++st->evictions;
+
+    evict_callbacks[e->type](e);
+}
+
+void fb_cache_trim(size_t max_bytes)
+{
+    fb_cache_lock();
+    while(fb_cache.bytes > max_bytes && fb_cache.lru_first)
+        fb_cache_evict(fb_cache.lru_first);
+    fb_cache_unlock();
+}
+
+void fb_cache_drop_unused(int type)
+{
+    struct fb_cache_entry *e, *next;
+
+    fb_cache_lock();
+    for(e = fb_cache.lru_first; e; e = next)
+    {
+        next = e->lru_next;
+        if(e->type == type)
+            fb_cache_evict(e);
+    }
+    fb_cache_unlock();
+}
+
+void fb_cache_set_budget(size_t bytes)
+{
+    fb_cache_lock();
+    fb_cache.budget = bytes;
+    fb_cache_trim(bytes);
+    fb_cache_unlock();
+}
+
+size_t fb_cache_get_budget(void)
+{
+    size_t res;
+
+    fb_cache_lock();
+    res = fb_cache.budget;
+    fb_cache_unlock();
+    return res;
+}
+
+// New entries start with one reference, which the caller owns
+void fb_cache_add(struct fb_cache_entry *e, int type, size_t bytes)
+{
+    struct fb_cache_stats *st = &fb_cache.stats[type];
+
+    fb_cache_lock();
+    e->type = type;
+    e->bytes = bytes;
+    e->refcnt = 1;
+    e->lru_prev = e->lru_next = NULL;
+
+    fb_cache.bytes += bytes;
+    st->bytes += bytes;
+    ++st->entries;
+    ++st->misses;
+
+    fb_cache_trim(fb_cache.budget);
+    fb_cache_unlock();
+}
+
+void fb_cache_ref(struct fb_cache_entry *e)
+{
+    fb_cache_lock();
+    if(e->refcnt++ == 0)
+        lru_unlink(e);
+    ++fb_cache.stats[e->type].hits;
+    fb_cache_unlock();
+}
+
+void fb_cache_unref(struct fb_cache_entry *e)
+{
+    fb_cache_lock();
+    if(e->refcnt > 0 && --e->refcnt == 0)
+        lru_append(e);
+
+    // e may be evicted right away if the cache is over budget
+    fb_cache_trim(fb_cache.budget);
+    fb_cache_unlock();
+}
+
+void fb_cache_resize(struct fb_cache_entry *e, size_t bytes)
+{
+    struct fb_cache_stats *st = &fb_cache.stats[e->type];
+
+    fb_cache_lock();
+    fb_cache.bytes += bytes - e->bytes;
+    st->bytes += bytes - e->bytes;
+    if(e->refcnt == 0)
+        st->unused_bytes += bytes - e->bytes;
+    e->bytes = bytes;
+
+    fb_cache_trim(fb_cache.budget);
+    fb_cache_unlock();
+}
+
+void fb_cache_get_stats(int type, struct fb_cache_stats *st)
+{
+    fb_cache_lock();
+    memcpy(st, &fb_cache.stats[type], sizeof(struct fb_cache_stats));
+    fb_cache_unlock();
+}
+
+void fb_cache_dump_stats(void)
+{
+    int i;
+    struct fb_cache_stats *st;
+
+    fb_cache_lock();
+    INFO("fb_cache: %u of %u bytes used\n", (unsigned)fb_cache.bytes, (unsigned)fb_cache.budget);
+    for(i = 0; i < FB_CACHE_CNT; ++i)
+    {
+        st = &fb_cache.stats[i];
+        INFO("fb_cache: %-8s %4u entries, %8u bytes (%u unused), %u hits, %u misses, %u evictions\n",
+            cache_names[i], st->entries, (unsigned)st->bytes, (unsigned)st->unused_bytes,
+            st->hits, st->misses, st->evictions);
+    }
+    fb_cache_unlock();
+}
@@ -0,0 +1,93 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fb.h>
+
+#include "framebuffer.h"
+#include "log.h"
+#include "util.h"
+
+// Headless implementation, frames are only copied into a buffer in memory.
+// Used to measure rendering performance without a display, resolution is
+// set by fb_force_memory_impl(), pixel format is the compile-time one.
+
+struct fb_memory_data {
+    px_type *frame;
+    uint32_t frames;
+};
+
+static int impl_open(struct framebuffer *fb)
+{
+    if(fb->vi.xres == 0 || fb->vi.yres == 0)
+        return -1;
+
+    fb->vi.xres_virtual = fb->vi.xres;
+    fb->vi.yres_virtual = fb->vi.yres;
+    fb->vi.bits_per_pixel = PIXEL_SIZE * 8;
+    fb->fi.line_length = fb->vi.xres_virtual * PIXEL_SIZE;
+    fb->fi.smem_len = fb->fi.line_length * fb->vi.yres;
+
+    struct fb_memory_data *data = mzalloc(sizeof(struct fb_memory_data));
+    data->frame = malloc(fb->fi.smem_len);
+    if(!data->frame)
+    {
+        free(data);
+        return -1;
+    }
+
+    fb->impl_data = data;
+
+    INFO("Pixel format: %dx%d @ %dbpp\n", fb->vi.xres, fb->vi.yres, fb->vi.bits_per_pixel);
+    return 0;
+}
+
+static void impl_close(struct framebuffer *fb)
+{
+    struct fb_memory_data *data = fb->impl_data;
+    if(data)
+    {
+        free(data->frame);
+        free(data);
+        fb->impl_data = NULL;
+    }
+}
+
+static int impl_update(struct framebuffer *fb)
+{
+    struct fb_memory_data *data = fb->impl_data;
+    ++data->frames;
+    return 0;
+}
+
+static void *impl_get_frame_dest(struct framebuffer *fb)
+{
+    struct fb_memory_data *data = fb->impl_data;
+    return data->frame;
+}
+
+const struct fb_impl fb_impl_memory = {
+    .name = "Memory",
+    .impl_id = FB_IMPL_MEMORY,
+
+    .open = impl_open,
+    .close = impl_close,
+    .update = impl_update,
+    .get_frame_dest = impl_get_frame_dest,
+};
@@ -24,12 +24,16 @@
 #include <string.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <png.h>
 
 #include "log.h"
 #include "framebuffer.h"
 #include "util.h"
 #include "containers.h"
+#include "mrom_data.h"
+#include "mem.h"
 
 #if 0
 #define PNG_LOG(x...) INFO(x)
@@ -37,17 +41,68 @@
 #define PNG_LOG(x...) ;
 #endif
 
+#define PNG_POOL_THREADS 2
+#define PNG_DISK_CACHE_DIR "cache/icons"
+#define PNG_DISK_MAGIC 0x494D524D // "MRMI"
+#define PNG_DISK_VERSION 1
+
 struct png_cache_entry
 {
+    struct fb_cache_entry cache; // must be first
     char *path;
     px_type *data;
     int width;
     int height;
-    int refcnt;
+    void *map;        // set if data points into a mmaped disk cache file
+    size_t map_size;
 };
 
 static struct png_cache_entry **png_cache = NULL;
 
+// A decode requested by fb_add_png_img_async_lvl. Requests for the same
+// file and size share one job, imgs are the placeholders waiting for it.
+struct png_job
+{
+    char *path;
+    int width;
+    int height;
+    int running;
+    fb_img **imgs;
+};
+
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t threads[PNG_POOL_THREADS];
+    int threads_cnt;
+    volatile int run;
+    struct png_job **jobs;
+} png_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .threads_cnt = 0,
+    .run = 0,
+    .jobs = NULL,
+};
+
+// Header of the files in the disk cache, followed by the source path and
+// the pixels, which are in the fb_img format for this build and can be
+// used straight from the mapping.
+struct png_disk_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t px_size;
+    uint32_t px_fingerprint;
+    uint32_t width;
+    uint32_t height;
+    uint32_t path_len;
+    uint32_t data_offset;
+    int64_t src_mtime;
+    int64_t src_size;
+};
+
 // http://willperone.net/Code/codescaling.php
 static px_type *scale_png_img(px_type *fi_data, int orig_w, int orig_h, int new_w, int new_h)
 {
@@ -57,9 +112,9 @@ static px_type *scale_png_img(px_type *fi_data, int orig_w, int orig_h, int new_
     uint32_t *in = (uint32_t*)fi_data;
 #if PIXEL_SIZE == 2
     // need another byte for alpha. Make it 4 to make it simpler
-    uint32_t *out = malloc(4 * new_w * new_h);
+    uint32_t *out = mem_alloc(MEM_TAG_PNG, 4 * new_w * new_h);
 #else
-    uint32_t *out = malloc(PIXEL_SIZE * new_w * new_h);
+    uint32_t *out = mem_alloc(MEM_TAG_PNG, PIXEL_SIZE * new_w * new_h);
 #endif
 
     const int YD = (orig_h / new_h) * orig_w - orig_w;
@@ -91,7 +146,7 @@ static px_type *scale_png_img(px_type *fi_data, int orig_w, int orig_h, int new_
         }
     }
 
-    free(fi_data);
+    mem_free(MEM_TAG_PNG, fi_data);
     return (px_type*)out;
 }
 
@@ -106,6 +161,9 @@ static px_type *load_png(const char *path, int destW, int destH)
     size_t i, y;
     int si;
     uint32_t src_pix;
+#if PIXEL_SIZE == 2
+    uint8_t alpha;
+#endif
     png_bytep *rows = NULL;
 
     fp = fopen(path, "rbe");
@@ -166,16 +224,17 @@ static px_type *load_png(const char *path, int destW, int destH)
 
 #if PIXEL_SIZE == 2
     // need another byte for alpha. Make it 4 to make it simpler
-    data_dest = malloc(4 * width * height);
+    data_dest = mem_alloc(MEM_TAG_PNG, 4 * width * height);
 #else
-    data_dest = malloc(PIXEL_SIZE * width * height);
+    data_dest = mem_alloc(MEM_TAG_PNG, PIXEL_SIZE * width * height);
 #endif
     data_itr = data_dest;
 
     bytes_per_row = png_get_rowbytes(png_ptr, info_ptr);
     rows = malloc(sizeof(png_bytep)*height);
-    for(y = 0; y < height; ++y)
-        rows[y] = malloc(bytes_per_row);
+    rows[0] = malloc(bytes_per_row*height);
+    for(y = 1; y < height; ++y)
+        rows[y] = rows[y-1] + bytes_per_row;
     png_read_image(png_ptr, rows);
 
     for(y = 0; y < height; ++y)
@@ -205,8 +264,8 @@ static px_type *load_png(const char *path, int destW, int destH)
             ++data_itr;
 #endif
         }
-        free(rows[y]);
     }
+    free(rows[0]);
     free(rows);
 
     data_dest = scale_png_img(data_dest, width, height, destW, destH);
@@ -221,26 +280,68 @@ static void destroy_png_cache_entry(void *entry)
 {
     struct png_cache_entry *e = (struct png_cache_entry*)entry;
     free(e->path);
-    free(e->data);
+    if(e->map)
+    {
+        munmap(e->map, e->map_size);
+        mem_untrack(MEM_TAG_PNG, e->map_size);
+    }
+    else
+        mem_free(MEM_TAG_PNG, e->data);
     free(e);
 }
 
-px_type *fb_png_get(const char *path, int w, int h)
+// called by fb_cache with its lock held
+void fb_png_evict(struct fb_cache_entry *entry)
+{
+    struct png_cache_entry *e = (struct png_cache_entry*)entry;
+    PNG_LOG("PNG %s (%dx%d) %p evicted from cache\n", e->path, e->width, e->height, e->data);
+    list_rm(&png_cache, e, &destroy_png_cache_entry);
+}
+
+static struct png_cache_entry *find_png_cache_entry(const char *path, int w, int h)
 {
-    // Try to find it in cache
     struct png_cache_entry **itr;
     for(itr = png_cache; itr && *itr; ++itr)
-    {
         if((*itr)->width == w && (*itr)->height == h && strcmp(path, (*itr)->path) == 0)
-        {
-            ++(*itr)->refcnt;
-            PNG_LOG("PNG %s (%dx%d) %p found in cache, refcnt increased to %d\n", path, w, h, (*itr)->data, (*itr)->refcnt);
-            return (*itr)->data;
-        }
+            return *itr;
+    return NULL;
+}
+
+// fb_cache_lock() must be held, the entry starts with one reference
+static struct png_cache_entry *add_png_cache_entry(const char *path, int w, int h, px_type *data, void *map, size_t map_size)
+{
+    struct png_cache_entry *e = mzalloc(sizeof(struct png_cache_entry));
+    e->path = strdup(path);
+    e->data = data;
+    e->width = w;
+    e->height = h;
+    e->map = map;
+    e->map_size = map_size;
+
+    list_add(&png_cache, e);
+    fb_cache_add(&e->cache, FB_CACHE_PNG, sizeof(struct png_cache_entry) + 4*w*h);
+    return e;
+}
+
+px_type *fb_png_get(const char *path, int w, int h)
+{
+    struct png_cache_entry *e;
+    px_type *data;
+
+    // Try to find it in cache
+    fb_cache_lock();
+    e = find_png_cache_entry(path, w, h);
+    if(e)
+    {
+        fb_cache_ref(&e->cache);
+        PNG_LOG("PNG %s (%dx%d) %p found in cache, refcnt increased to %d\n", path, w, h, e->data, e->cache.refcnt);
+        fb_cache_unlock();
+        return e->data;
     }
+    fb_cache_unlock();
 
     // not in cache yet, load and create cache entry
-    px_type *data = load_png(path, w, h);
+    data = load_png(path, w, h);
     if(!data)
     {
         PNG_LOG("PNG %s (%dx%d) failed to load\n", path, w, h);
@@ -248,14 +349,21 @@ px_type *fb_png_get(const char *path, int w, int h)
     }
     PNG_LOG("PNG %s (%dx%d) loaded\n", path, w, h);
 
-    struct png_cache_entry *e = mzalloc(sizeof(struct png_cache_entry));
-    e->path = strdup(path);
-    e->data = data;
-    e->width = w;
-    e->height = h;
-    e->refcnt = 1;
+    fb_cache_lock();
+
+    // someone else might have loaded it in the meantime
+    e = find_png_cache_entry(path, w, h);
+    if(e)
+    {
+        fb_cache_ref(&e->cache);
+        fb_cache_unlock();
+        mem_free(MEM_TAG_PNG, data);
+        return e->data;
+    }
+
+    e = add_png_cache_entry(path, w, h, data, NULL, 0);
+    fb_cache_unlock();
 
-    list_add(&png_cache, e);
     PNG_LOG("PNG %s (%dx%d) %p added into cache\n", path, w, h, data);
     return data;
 }
@@ -263,34 +371,348 @@ px_type *fb_png_get(const char *path, int w, int h)
 void fb_png_release(px_type *data)
 {
     struct png_cache_entry **itr;
+
+    fb_cache_lock();
     for(itr = png_cache; itr && *itr; ++itr)
     {
         if((*itr)->data == data)
         {
-            --(*itr)->refcnt;
-            PNG_LOG("PNG %s (%dx%d) %p released, refcnt is %d\n", (*itr)->path, (*itr)->width, (*itr)->height, data, (*itr)->refcnt);
+            // the entry may be evicted by the unref
+            PNG_LOG("PNG %s (%dx%d) %p released, refcnt is %d\n", (*itr)->path, (*itr)->width, (*itr)->height, data, (*itr)->cache.refcnt - 1);
+            fb_cache_unref(&(*itr)->cache);
+            fb_cache_unlock();
             return;
         }
     }
+    fb_cache_unlock();
     PNG_LOG("PNG %p not found in cache!\n", data);
 }
 
 void fb_png_drop_unused(void)
 {
-    struct png_cache_entry **itr;
-    for(itr = png_cache; itr && *itr;)
+    fb_cache_drop_unused(FB_CACHE_PNG);
+}
+
+static uint32_t png_disk_fingerprint(void)
+{
+    // changes with the pixel format the build converts to
+    return fb_convert_color(0xFF102030) | (fb_convert_color(0x80FFFFFF) << 16);
+}
+
+static int png_disk_path(char *buf, size_t size, const char *path, int w, int h)
+{
+    uint32_t hash = 2166136261u;
+    const char *itr;
+
+    for(itr = path; *itr; ++itr)
+        hash = (hash ^ (uint8_t)*itr) * 16777619;
+
+    return snprintf(buf, size, "%s/%s/%08x_%dx%d.bin", mrom_dir(), PNG_DISK_CACHE_DIR, hash, w, h) < (int)size ? 0 : -1;
+}
+
+// Returns the pixels from the mmaped cache file, if it is still valid
+static px_type *png_disk_load(const char *path, int w, int h, struct stat *src, void **map, size_t *map_size)
+{
+    char cache_path[256];
+    struct stat info;
+    struct png_disk_header *hdr;
+    const size_t path_len = strlen(path);
+    void *addr;
+    int fd;
+
+    if(png_disk_path(cache_path, sizeof(cache_path), path, w, h) < 0)
+        return NULL;
+
+    fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(struct png_disk_header))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED)
+        return NULL;
+
+    hdr = addr;
+    if(hdr->magic != PNG_DISK_MAGIC || hdr->version != PNG_DISK_VERSION ||
+        hdr->px_size != PIXEL_SIZE || hdr->px_fingerprint != png_disk_fingerprint() ||
+        hdr->width != (uint32_t)w || hdr->height != (uint32_t)h ||
+        hdr->src_mtime != (int64_t)src->st_mtime || hdr->src_size != (int64_t)src->st_size ||
+        hdr->path_len != path_len || hdr->data_offset % 16 != 0 ||
+        (uint64_t)info.st_size < (uint64_t)hdr->data_offset + 4*w*h ||
+        memcmp((char*)addr + sizeof(struct png_disk_header), path, path_len) != 0)
     {
-        if((*itr)->refcnt <= 0)
+        PNG_LOG("PNG %s (%dx%d) has stale disk cache %s\n", path, w, h, cache_path);
+        munmap(addr, info.st_size);
+        return NULL;
+    }
+
+    *map = addr;
+    *map_size = info.st_size;
+    mem_track(MEM_TAG_PNG, info.st_size);
+    return (px_type*)((char*)addr + hdr->data_offset);
+}
+
+static void png_disk_store(const char *path, int w, int h, struct stat *src, px_type *data)
+{
+    char cache_path[256];
+    char tmp_path[256 + 4];
+    struct png_disk_header hdr;
+    static const uint8_t zeros[16] = { 0 };
+    const size_t path_len = strlen(path);
+    FILE *f;
+    int ok;
+
+    if(png_disk_path(cache_path, sizeof(cache_path), path, w, h) < 0)
+        return;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s", mrom_dir(), PNG_DISK_CACHE_DIR);
+    if(mkdir_recursive(tmp_path, 0755) < 0)
+        return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PNG_DISK_MAGIC;
+    hdr.version = PNG_DISK_VERSION;
+    hdr.px_size = PIXEL_SIZE;
+    hdr.px_fingerprint = png_disk_fingerprint();
+    hdr.width = w;
+    hdr.height = h;
+    hdr.path_len = path_len;
+    hdr.data_offset = (sizeof(hdr) + path_len + 15) & ~15;
+    hdr.src_mtime = src->st_mtime;
+    hdr.src_size = src->st_size;
+
+    // write and rename, so that a half-written file is never mapped
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    f = fopen(tmp_path, "we");
+    if(!f)
+        return;
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+        fwrite(path, 1, path_len, f) == path_len &&
+        fwrite(zeros, 1, hdr.data_offset - sizeof(hdr) - path_len, f) == hdr.data_offset - sizeof(hdr) - path_len &&
+        fwrite(data, 4, w*h, f) == (size_t)(w*h);
+
+    if(fclose(f) != 0 || !ok || rename(tmp_path, cache_path) < 0)
+    {
+        PNG_LOG("PNG %s (%dx%d) failed to write disk cache %s\n", path, w, h, cache_path);
+        unlink(tmp_path);
+    }
+}
+
+static void png_job_destroy(void *job)
+{
+    struct png_job *j = job;
+    free(j->path);
+    list_clear(&j->imgs, NULL);
+    free(j);
+}
+
+static void png_job_finish(struct png_job *j, px_type *data, void *map, size_t map_size)
+{
+    struct png_cache_entry *e = NULL;
+    fb_img **itr;
+
+    // items lock before the pool lock, fb_destroy_item() takes the pool
+    // lock with the items lock held when clearing the context
+    fb_items_lock();
+    pthread_mutex_lock(&png_pool.mutex);
+    fb_cache_lock();
+
+    if(data)
+    {
+        e = find_png_cache_entry(j->path, j->width, j->height);
+        if(e)
         {
-            PNG_LOG("PNG %s (%dx%d) %p removed from cache\n", (*itr)->path, (*itr)->width, (*itr)->height, data);
-            list_rm(&png_cache, *itr, &destroy_png_cache_entry);
-            itr = png_cache;
+            // loaded by fb_png_get in the meantime
+            if(map)
+            {
+                munmap(map, map_size);
+                mem_untrack(MEM_TAG_PNG, map_size);
+            }
+            else
+                mem_free(MEM_TAG_PNG, data);
+            fb_cache_ref(&e->cache);
         }
         else
+            e = add_png_cache_entry(j->path, j->width, j->height, data, map, map_size);
+
+        for(itr = j->imgs; itr && *itr; ++itr)
         {
-            ++itr;
+            if(itr != j->imgs)
+                fb_cache_ref(&e->cache);
+            (*itr)->data = e->data;
+            fb_layer_item_changed(*itr);
+        }
+
+        if(!j->imgs)
+            fb_cache_unref(&e->cache);
+    }
+
+    fb_cache_unlock();
+    list_rm(&png_pool.jobs, j, &png_job_destroy);
+    pthread_mutex_unlock(&png_pool.mutex);
+    fb_items_unlock();
+
+    if(data)
+        fb_request_draw();
+}
+
+static void *png_pool_work(UNUSED void *arg)
+{
+    struct png_job **itr, *j;
+    struct stat src;
+    px_type *data;
+    void *map;
+    size_t map_size;
+
+    pthread_mutex_lock(&png_pool.mutex);
+    while(png_pool.run)
+    {
+        j = NULL;
+        for(itr = png_pool.jobs; itr && *itr; ++itr)
+        {
+            if(!(*itr)->running)
+            {
+                j = *itr;
+                break;
+            }
+        }
+
+        if(!j)
+        {
+            pthread_cond_wait(&png_pool.cond, &png_pool.mutex);
+            continue;
+        }
+
+        j->running = 1;
+        pthread_mutex_unlock(&png_pool.mutex);
+
+        data = NULL;
+        map = NULL;
+        map_size = 0;
+        if(stat(j->path, &src) >= 0)
+        {
+            data = png_disk_load(j->path, j->width, j->height, &src, &map, &map_size);
+            if(!data)
+            {
+                data = load_png(j->path, j->width, j->height);
+                if(data)
+                    png_disk_store(j->path, j->width, j->height, &src, data);
+            }
+        }
+
+        if(!data)
+            ERROR("Failed to load PNG %s\n", j->path);
+
+        png_job_finish(j, data, map, map_size);
+        pthread_mutex_lock(&png_pool.mutex);
+    }
+    pthread_mutex_unlock(&png_pool.mutex);
+    return NULL;
+}
+
+// png_pool.mutex must be held
+static void png_pool_start(void)
+{
+    if(png_pool.run)
+        return;
+
+    png_pool.run = 1;
+    for(png_pool.threads_cnt = 0; png_pool.threads_cnt < PNG_POOL_THREADS; ++png_pool.threads_cnt)
+        if(pthread_create(&png_pool.threads[png_pool.threads_cnt], NULL, png_pool_work, NULL) != 0)
+            break;
+}
+
+void fb_png_pool_stop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&png_pool.mutex);
+    if(!png_pool.run)
+    {
+        pthread_mutex_unlock(&png_pool.mutex);
+        return;
+    }
+    png_pool.run = 0;
+    pthread_cond_broadcast(&png_pool.cond);
+    pthread_mutex_unlock(&png_pool.mutex);
+
+    for(i = 0; i < png_pool.threads_cnt; ++i)
+        pthread_join(png_pool.threads[i], NULL);
+    png_pool.threads_cnt = 0;
+
+    pthread_mutex_lock(&png_pool.mutex);
+    list_clear(&png_pool.jobs, &png_job_destroy);
+    pthread_mutex_unlock(&png_pool.mutex);
+}
+
+// Sets img->data right away if the pixels are already in memory, otherwise
+// queues img to be filled in by the decode pool, under fb_items_lock().
+void fb_png_load_async(const char *path, int w, int h, fb_img *img)
+{
+    struct png_cache_entry *e;
+    struct png_job **itr, *j = NULL;
+
+    fb_cache_lock();
+    e = find_png_cache_entry(path, w, h);
+    if(e)
+    {
+        fb_cache_ref(&e->cache);
+        img->data = e->data;
+        fb_cache_unlock();
+        return;
+    }
+    fb_cache_unlock();
+
+    pthread_mutex_lock(&png_pool.mutex);
+    png_pool_start();
+
+    for(itr = png_pool.jobs; itr && *itr; ++itr)
+    {
+        if((*itr)->width == w && (*itr)->height == h && strcmp((*itr)->path, path) == 0)
+        {
+            j = *itr;
+            break;
         }
     }
+
+    if(!j)
+    {
+        j = mzalloc(sizeof(struct png_job));
+        j->path = strdup(path);
+        j->width = w;
+        j->height = h;
+        list_add(&png_pool.jobs, j);
+        pthread_cond_signal(&png_pool.cond);
+    }
+
+    list_add(&j->imgs, img);
+    pthread_mutex_unlock(&png_pool.mutex);
+}
+
+// For FB_IMG_TYPE_PNG items which might still be waiting for the pool
+void fb_png_release_img(fb_img *img)
+{
+    struct png_job **itr;
+    px_type *data;
+
+    pthread_mutex_lock(&png_pool.mutex);
+    data = img->data;
+    if(!data)
+    {
+        for(itr = png_pool.jobs; itr && *itr; ++itr)
+            list_rm(&(*itr)->imgs, img, NULL);
+    }
+    pthread_mutex_unlock(&png_pool.mutex);
+
+    if(data)
+        fb_png_release(data);
 }
 
 static inline void convert_fb_px_to_rgb888(px_type src, uint8_t *dest)
@@ -32,6 +32,7 @@
 #include "util.h"
 #include "containers.h"
 #include "mrom_data.h"
+#include "mem.h"
 
 #define LINE_SPACING 1.15
 
@@ -51,18 +52,27 @@ static const char *FONT_FILES[STYLE_COUNT] = {
     "OxygenMono-Regular.ttf", // STYLE_MONOSPACE
 };
 
+// Rough memory cost of a loaded face and of one outline glyph, used to
+// account glyph caches against the fb_cache budget.
+#define GLYPHS_FACE_BYTES (48*1024)
+#define GLYPH_BYTES 512
+
 struct glyphs_entry
 {
+    struct fb_cache_entry cache; // must be first
     FT_Face face;
     imap *glyphs;
+    int style;
+    int size;
 };
 
 struct strings_entry
 {
+    struct fb_cache_entry cache; // must be first
     px_type *data;
     int w, h;
     int baseline;
-    int refcnt;
+    int size;
     px_type color;
 };
 
@@ -160,7 +170,9 @@ static struct glyphs_entry *get_cache_for_size(int style, const int size)
 
 retry_load:
     res = imap_get_val(cache.glyphs[style], size);
-    if(!res)
+    if(res)
+        fb_cache_ref(&res->cache);
+    else
     {
         char buff[128];
         res = mzalloc(sizeof(struct glyphs_entry));
@@ -191,12 +203,38 @@ retry_load:
         }
 
         res->glyphs = imap_create();
+        res->style = style;
+        res->size = size;
         imap_add_not_exist(cache.glyphs[style], size, res);
+        fb_cache_add(&res->cache, FB_CACHE_GLYPHS, GLYPHS_FACE_BYTES);
     }
 
     return res;
 }
 
+static void put_cache_for_size(struct glyphs_entry *en)
+{
+    // glyphs are loaded lazily, so the size is only known once it's released
+    fb_cache_resize(&en->cache, GLYPHS_FACE_BYTES + en->glyphs->size*GLYPH_BYTES);
+    fb_cache_unref(&en->cache);
+}
+
+static void destroy_glyphs_entry(struct glyphs_entry *en)
+{
+    imap_destroy(en->glyphs, (void*)&FT_Done_Glyph);
+    FT_Done_Face(en->face);
+    free(en);
+}
+
+void fb_text_evict_glyphs(struct fb_cache_entry *e)
+{
+    struct glyphs_entry *en = (struct glyphs_entry*)e;
+
+    TT_LOG("CACHE: evict glyphs style %d size %d\n", en->style, en->size);
+    imap_rm(cache.glyphs[en->style], en->size, NULL);
+    destroy_glyphs_entry(en);
+}
+
 static struct strings_entry *get_cache_for_string(text_extra *ex)
 {
     if(!cache.strings)
@@ -212,6 +250,42 @@ static struct strings_entry *get_cache_for_string(text_extra *ex)
     return NULL;
 }
 
+// Only returns the entry if the img really uses its data, the string
+// might have been cached by another img after this one was rendered.
+static struct strings_entry *get_img_string_entry(fb_img *img)
+{
+    struct strings_entry *sen = get_cache_for_string(img->extra);
+    if(sen && sen->data == img->data)
+        return sen;
+    return NULL;
+}
+
+void fb_text_evict_string(struct fb_cache_entry *e)
+{
+    struct strings_entry *sen = (struct strings_entry*)e;
+    map *c = imap_get_val(cache.strings, sen->size);
+    size_t i;
+
+    TT_LOG("CACHE: evict %02d 0x%08X\n", sen->size, (uint32_t)sen->data);
+
+    for(i = 0; c && i < c->size; ++i)
+    {
+        if(c->values[i] != sen)
+            continue;
+
+        map_rm(c, c->keys[i], NULL);
+        if(c->size == 0)
+        {
+            map_destroy(c, NULL);
+            imap_rm(cache.strings, sen->size, NULL);
+        }
+        break;
+    }
+
+    mem_free(MEM_TAG_STRINGS, sen->data);
+    free(sen);
+}
+
 static void add_to_strings(fb_img *img)
 {
     text_extra *ex = img->extra;
@@ -232,28 +306,66 @@ static void add_to_strings(fb_img *img)
 
     struct strings_entry *sen = mzalloc(sizeof(struct strings_entry));
     sen->data = img->data;
-    sen->refcnt = 1;
     sen->w = img->w;
     sen->h = img->h;
+    sen->size = ex->size;
     sen->color = ex->color;
     sen->baseline = ex->baseline;
     map_add_not_exist(c, ex->text, sen);
+    fb_cache_add(&sen->cache, FB_CACHE_STRINGS, sizeof(struct strings_entry) + img->w*img->h*4);
 
     TT_LOG("CACHE: add %02d 0x%08X\n", ex->size, (uint32_t)img->data);
 }
 
-static int unlink_from_caches(text_extra *ex)
+static int unlink_from_caches(fb_img *img)
 {
     struct strings_entry *sen;
+    int res = 0;
 
-    sen = get_cache_for_string(ex);
+    fb_cache_lock();
+    sen = get_img_string_entry(img);
     if(sen)
     {
-        --sen->refcnt;
-        TT_LOG("CACHE: drop %02d 0x%08X\n", ex->size, (uint32_t)sen->data);
-        return 1;
+        TT_LOG("CACHE: drop %02d 0x%08X\n", sen->size, (uint32_t)sen->data);
+        fb_cache_unref(&sen->cache);
+        res = 1;
+    }
+    fb_cache_unlock();
+    return res;
+}
+
+static void free_string_data(void *data)
+{
+    mem_free(MEM_TAG_STRINGS, data);
+}
+
+static void unref_string_entry(void *entry)
+{
+    struct strings_entry *sen = entry;
+    fb_cache_unref(&sen->cache);
+}
+
+// The old pixels may still be read by the frame being rasterized, so they
+// are released through fb_defer()
+static void release_img_data(fb_img *img)
+{
+    struct strings_entry *sen;
+
+    fb_cache_lock();
+    sen = get_img_string_entry(img);
+    fb_cache_unlock();
+
+    if(sen)
+    {
+        TT_LOG("CACHE: drop %02d 0x%08X\n", sen->size, (uint32_t)sen->data);
+        fb_defer(unref_string_entry, sen);
+    }
+    else
+    {
+        img->w = img->h = 0;
+        fb_defer(free_string_data, img->data);
+        img->data = NULL;
     }
-    return 0;
 }
 
 static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_t *style_map, text_extra *ex)
@@ -432,39 +544,47 @@ fail:
     return NULL;
 }
 
-static void fb_text_render(fb_img *img)
+struct text_layout
 {
-    int maxW, maxH, totalH, i, lineH, lines_cnt;
-    struct glyphs_entry *gen[STYLE_COUNT] = { 0 };
-    struct strings_entry *sen;
-    struct text_line **lines = NULL;
-    char *start, *end;
-    text_extra *ex = img->extra;
-    int8_t *style_map = NULL;
+    struct glyphs_entry *gen[STYLE_COUNT];
+    int8_t *style_map;
+    struct text_line **lines;
+    int lines_cnt;
+    int w, h;
+    int baseline;
+};
 
-    sen = get_cache_for_string(ex);
-    if(sen)
+static void destroy_layout(struct text_layout *l)
+{
+    int i;
+    for(i = 0; i < STYLE_COUNT; ++i)
     {
-        img->w = sen->w;
-        img->h = sen->h;
-        img->data = sen->data;
-        ex->baseline = sen->baseline;
-        ++sen->refcnt;
-
-        TT_LOG("CACHE: use %02d 0x%08X\n", ex->size, (uint32_t)sen->data);
-        TT_LOG("Getting string %dx%d %s from cache\n", img->w, img->h, ex->text);
-        return;
+        if(l->gen[i])
+            put_cache_for_size(l->gen[i]);
+        l->gen[i] = NULL;
     }
 
-    if(!build_style_map(ex, &style_map, gen))
+    list_clear(&l->lines, &destroy_line);
+    free(l->style_map);
+    l->style_map = NULL;
+}
+
+// Positions all glyphs of the text, but doesn't render anything
+static int layout_text(text_extra *ex, struct text_layout *l)
+{
+    int maxW, maxH, totalH, i, lineH;
+    char *start, *end;
+
+    memset(l, 0, sizeof(struct text_layout));
+
+    if(!build_style_map(ex, &l->style_map, l->gen))
     {
         TT_LOG("Failed to build style map for string %s\n", ex->text);
-        return;
+        destroy_layout(l);
+        return -1;
     }
 
-    TT_LOG("Rendering string %s\n", ex->text);
-
-    maxW = maxH = lines_cnt = 0;
+    maxW = maxH = 0;
     start = ex->text;
     while(start && *start)
     {
@@ -485,54 +605,173 @@ static void fb_text_render(fb_img *img)
 
         line->pos = mzalloc(sizeof(FT_Vector)*line->len);
 
-        if(measure_line(line, gen, style_map + (line->text - ex->text), ex))
+        if(measure_line(line, l->gen, l->style_map + (line->text - ex->text), ex))
             start = line->text + line->len;
 
         maxW = imax(maxW, line->w);
         maxH = imax(maxH, line->h);
 
-        list_add(&lines, line);
-        ++lines_cnt;
+        list_add(&l->lines, line);
+        ++l->lines_cnt;
     }
 
     lineH = maxH * LINE_SPACING;
     totalH = 0;
-    for(i = 0; i < lines_cnt; ++i)
+    for(i = 0; i < l->lines_cnt; ++i)
     {
         switch(ex->justify)
         {
             case JUSTIFY_LEFT:
                 break;
             case JUSTIFY_CENTER:
-                lines[i]->offX = maxW/2 - lines[i]->w/2;
+                l->lines[i]->offX = maxW/2 - l->lines[i]->w/2;
                 break;
             case JUSTIFY_RIGHT:
-                lines[i]->offX = maxW - lines[i]->w;
+                l->lines[i]->offX = maxW - l->lines[i]->w;
                 break;
         }
-        lines[i]->offY = totalH;
+        l->lines[i]->offY = totalH;
         totalH += lineH;
-        ex->baseline = lines[i]->offY + lines[i]->base;
+        l->baseline = l->lines[i]->offY + l->lines[i]->base;
     }
 
-    if(lines_cnt > 1)
-        ex->baseline /= 2;
+    if(l->lines_cnt > 1)
+        l->baseline /= 2;
+
+    l->w = maxW;
+    l->h = totalH;
+    return 0;
+}
 
+static void fb_text_render(fb_img *img)
+{
+    int i;
+    struct strings_entry *sen;
+    struct text_layout l;
+    text_extra *ex = img->extra;
+
+    fb_cache_lock();
+
+    sen = get_cache_for_string(ex);
+    if(sen)
+    {
+        img->w = sen->w;
+        img->h = sen->h;
+        img->data = sen->data;
+        ex->baseline = sen->baseline;
+        fb_cache_ref(&sen->cache);
+
+        TT_LOG("CACHE: use %02d 0x%08X\n", ex->size, (uint32_t)sen->data);
+        TT_LOG("Getting string %dx%d %s from cache\n", img->w, img->h, ex->text);
+        fb_cache_unlock();
+        return;
+    }
+
+    if(layout_text(ex, &l) < 0)
+    {
+        fb_cache_unlock();
+        return;
+    }
+
+    TT_LOG("Rendering string %s\n", ex->text);
+
+    ex->baseline = l.baseline;
     img->w = img->h = 0;
 
     // always 4 bytes per pixel cause of fb_img data structure
-    img->data = mzalloc(maxW*totalH*4);
+    img->data = mem_zalloc(MEM_TAG_STRINGS, l.w*l.h*4);
 
-    for(i = 0; i < lines_cnt; ++i)
-        render_line(lines[i], gen, style_map + (lines[i]->text - ex->text), img->data, maxW, ex->color);
+    for(i = 0; i < l.lines_cnt; ++i)
+        render_line(l.lines[i], l.gen, l.style_map + (l.lines[i]->text - ex->text), img->data, l.w, ex->color);
 
-    img->w = maxW;
-    img->h = totalH;
+    img->w = l.w;
+    img->h = l.h;
 
     add_to_strings(img);
 
-    list_clear(&lines, &destroy_line);
-    free(style_map);
+    destroy_layout(&l);
+    fb_cache_unlock();
+}
+
+static void proto_to_extra(const fb_text_proto *p, int size, text_extra *ex)
+{
+    memset(ex, 0, sizeof(text_extra));
+    ex->text = p->text;
+    ex->size = size;
+    ex->justify = p->justify;
+    ex->style = p->style;
+    ex->wrap_w = p->wrap_w;
+}
+
+int fb_text_measure(const fb_text_proto *p, fb_text_metrics *m)
+{
+    text_extra ex;
+    struct text_layout l;
+
+    memset(m, 0, sizeof(fb_text_metrics));
+    if(!p->text)
+        return 0;
+
+    // already rendered strings don't have to be laid out again
+    proto_to_extra(p, p->size, &ex);
+    ex.color = fb_convert_color(p->color & ~(0xFF << 24));
+
+    fb_cache_lock();
+    struct strings_entry *sen = get_cache_for_string(&ex);
+    if(sen)
+    {
+        m->w = sen->w;
+        m->h = sen->h;
+        m->baseline = sen->baseline;
+        fb_cache_unlock();
+        return 0;
+    }
+
+    if(layout_text(&ex, &l) < 0)
+    {
+        fb_cache_unlock();
+        return -1;
+    }
+
+    m->w = l.w;
+    m->h = l.h;
+    m->baseline = l.baseline;
+    destroy_layout(&l);
+    fb_cache_unlock();
+    return 0;
+}
+
+int fb_text_fit_size(const fb_text_proto *p, int max_w, int min_size)
+{
+    text_extra ex;
+    struct text_layout l;
+    int lo = min_size, hi = p->size, mid;
+
+    if(!p->text || hi <= lo)
+        return imax(hi, 0);
+
+    fb_cache_lock();
+
+    // text width grows with size, look for the biggest size which fits
+    while(lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        proto_to_extra(p, mid, &ex);
+        if(layout_text(&ex, &l) < 0)
+        {
+            lo = p->size;
+            break;
+        }
+
+        if(l.w < max_w)
+            lo = mid;
+        else
+            hi = mid - 1;
+        destroy_layout(&l);
+    }
+
+    fb_cache_unlock();
+    return lo;
 }
 
 fb_img *fb_add_text(int x, int y, uint32_t color, int size, const char *fmt, ...)
@@ -611,35 +850,39 @@ fb_img *fb_text_finalize(fb_text_proto *p)
 void fb_text_set_color(fb_img *img, uint32_t color)
 {
     text_extra *extras = img->extra;
-    int copy = 0;
+    px_type *copy = NULL;
     const px_type converted_color = fb_convert_color(color & ~(0xFF << 24));
 
     if(extras->color == converted_color)
         return;
 
-    struct strings_entry *sen = get_cache_for_string(extras);
+    // Cached data is shared with other texts, so it has to be copied
+    // unless this is the only user. Don't take fb_items_lock while
+    // holding the cache lock, fb_text_render nests them the other way.
+    fb_cache_lock();
+    struct strings_entry *sen = get_img_string_entry(img);
     if(sen)
     {
-        if(sen->refcnt == 1)
+        if(sen->cache.refcnt == 1)
+        {
             sen->color = converted_color;
+            sen = NULL;
+        }
         else
         {
-            copy = 1;
-            --sen->refcnt;
+            copy = mem_alloc(MEM_TAG_STRINGS, img->w*img->h*4);
+            memcpy(copy, img->data, img->w*img->h*4);
         }
     }
+    fb_cache_unlock();
 
     extras->color = converted_color;
 
     fb_items_lock();
 
-    px_type *itr = img->data;
     if(copy)
-    {
-        img->data = malloc(img->w*img->h*4);
-        memcpy(img->data, itr, img->w*img->h*4);
-        itr = img->data;
-    }
+        img->data = copy;
+    px_type *itr = img->data;
 
     const px_type *end = (px_type*)(((uint32_t*)itr) + img->w * img->h);
     int alpha;
@@ -658,7 +901,11 @@ void fb_text_set_color(fb_img *img, uint32_t color)
 #endif
     }
 
+    fb_layer_item_changed(img);
     fb_items_unlock();
+
+    if(sen)
+        fb_defer(unref_string_entry, sen);
 }
 
 void fb_text_set_size(fb_img *img, int size)
@@ -669,12 +916,7 @@ void fb_text_set_size(fb_img *img, int size)
         return;
 
     fb_items_lock();
-    if(unlink_from_caches(ex) == 0)
-    {
-        img->w = img->h = 0;
-        free(img->data);
-        img->data = NULL;
-    }
+    release_img_data(img);
 
     ex->size = size;
     fb_text_render(img);
@@ -689,12 +931,7 @@ void fb_text_set_content(fb_img *img, const char *text)
         return;
 
     fb_items_lock();
-    if(unlink_from_caches(ex) == 0)
-    {
-        img->w = img->h = 0;
-        free(img->data);
-        img->data = NULL;
-    }
+    release_img_data(img);
 
     ex->text = realloc(ex->text, strlen(text)+1);
     strcpy(ex->text, text);
@@ -723,16 +960,10 @@ void fb_text_destroy(fb_img *i)
 {
     text_extra *ex = i->extra;
 
-    struct strings_entry *sen = get_cache_for_string(ex);
-    if(sen)
-    {
-        TT_LOG("CACHE: drop %02d 0x%08X\n", ex->size, (uint32_t)sen->data);
-        --sen->refcnt;
-    }
-    else
+    if(unlink_from_caches(i) == 0)
     {
         TT_LOG("CACHE: free %02d 0x%08X\n", ex->size, (uint32_t)i->data);
-        free(i->data);
+        mem_free(MEM_TAG_STRINGS, i->data);
     }
 
     free(ex->text);
@@ -740,54 +971,86 @@ void fb_text_destroy(fb_img *i)
     // fb_img is freed in fb_destroy_item
 }
 
-static int drop_glyphs_cache(imap *g_cache)
+fb_cell_font *fb_cell_font_create(int style, int size)
 {
-    size_t i;
-    for(i = 0; i < g_cache->size;)
+    int c, x, y, dst_x, dst_y;
+    struct glyphs_entry *en;
+    FT_Face face;
+    FT_GlyphSlot slot;
+    fb_cell_font *f;
+    uint8_t *cell;
+    const uint8_t *src;
+
+    fb_cache_lock();
+    en = get_cache_for_size(style, size);
+    if(!en)
     {
-        const int key = g_cache->keys[i];
-        struct glyphs_entry *en = g_cache->values[i];
-        imap_destroy(en->glyphs, (void*)&FT_Done_Glyph);
-        FT_Done_Face(en->face);
-        imap_rm(g_cache, key, &free);
+        fb_cache_unlock();
+        return NULL;
     }
-    return g_cache->size == 0;
-}
 
-static int drop_strings_cache(imap *s_cache)
-{
-    size_t i, x;
-    for(i = 0; i < s_cache->size; )
+    face = en->face;
+
+    f = mzalloc(sizeof(fb_cell_font));
+    f->size = size;
+
+    // max_advance is often inflated by odd glyphs, use the width of a real one
+    if(FT_Load_Char(face, 'M', FT_LOAD_DEFAULT) == 0)
+        f->cell_w = (face->glyph->advance.x + 63) >> 6;
+    else
+        f->cell_w = (face->size->metrics.max_advance + 63) >> 6;
+    f->cell_w = imax(1, f->cell_w);
+    f->baseline = (face->size->metrics.ascender + 63) >> 6;
+    f->cell_h = imax((face->size->metrics.height + 63) >> 6,
+                     f->baseline - (face->size->metrics.descender >> 6));
+    f->cell_h = imax(1, f->cell_h);
+    f->coverage = mzalloc(FB_CELL_GLYPHS * f->cell_w * f->cell_h);
+
+    for(c = FB_CELL_FIRST; c <= FB_CELL_LAST; ++c)
     {
-        const int key = s_cache->keys[i];
-        map *size_c = s_cache->values[i];
-        TT_LOG("Dropping unused string caches for size %d\n", key);
+        f->empty[c - FB_CELL_FIRST] = 1;
 
-        for(x = 0; x < size_c->size; )
+        if(FT_Load_Char(face, c, FT_LOAD_RENDER) != 0)
+            continue;
+
+        slot = face->glyph;
+        if(slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+            continue;
+
+        cell = f->coverage + (c - FB_CELL_FIRST) * f->cell_w * f->cell_h;
+        src = slot->bitmap.buffer;
+
+        for(y = 0; y < (int)slot->bitmap.rows; ++y, src += slot->bitmap.pitch)
         {
-            char *s_key = size_c->keys[x];
-            struct strings_entry *sen = size_c->values[x];
+            dst_y = f->baseline - slot->bitmap_top + y;
+            if(dst_y < 0 || dst_y >= f->cell_h)
+                continue;
 
-            TT_LOG("strings_entry size %d str \"%s\" has refcnt %d\n", key, s_key, sen->refcnt);
-            if(sen->refcnt == 0)
+            for(x = 0; x < (int)slot->bitmap.width; ++x)
             {
-                free(sen->data);
-                map_rm(size_c, s_key, &free);
-            }
-            else
-                ++x;
-        }
+                dst_x = slot->bitmap_left + x;
+                if(dst_x < 0 || dst_x >= f->cell_w || src[x] == 0)
+                    continue;
 
-        if(size_c->size == 0)
-        {
-            TT_LOG("Removing string cache for size %d\n", key);
-            map_destroy(size_c, &free);
-            imap_rm(s_cache, key, NULL);
+                cell[dst_y * f->cell_w + dst_x] = src[x];
+                f->empty[c - FB_CELL_FIRST] = 0;
+            }
         }
-        else
-            ++i;
     }
-    return s_cache->size == 0;
+
+    put_cache_for_size(en);
+    fb_cache_unlock();
+
+    TT_LOG("Cell font size %d: %dx%d cells, baseline %d\n", size, f->cell_w, f->cell_h, f->baseline);
+    return f;
+}
+
+void fb_cell_font_destroy(fb_cell_font *f)
+{
+    if(!f)
+        return;
+    free(f->coverage);
+    free(f);
 }
 
 void fb_text_drop_cache_unused(void)
@@ -795,29 +1058,30 @@ void fb_text_drop_cache_unused(void)
     size_t s;
     int free_ft_lib = 1;
 
+    fb_cache_lock();
+    fb_cache_drop_unused(FB_CACHE_STRINGS);
+    fb_cache_drop_unused(FB_CACHE_GLYPHS);
+
     for(s = 0; s < STYLE_COUNT; ++s)
     {
-        if(cache.glyphs[s])
+        if(!cache.glyphs[s])
+            continue;
+
+        if(cache.glyphs[s]->size == 0)
         {
-            if(drop_glyphs_cache(cache.glyphs[s]))
-            {
-                TT_LOG("Whole glyph cache was freed.\n");
-                imap_destroy(cache.glyphs[s], NULL);
-                cache.glyphs[s] = NULL;
-            }
-            else
-                free_ft_lib = 0;
+            TT_LOG("Whole glyph cache was freed.\n");
+            imap_destroy(cache.glyphs[s], NULL);
+            cache.glyphs[s] = NULL;
         }
+        else
+            free_ft_lib = 0;
     }
 
-    if(cache.strings)
+    if(cache.strings && cache.strings->size == 0)
     {
-        if(drop_strings_cache(cache.strings))
-        {
-            TT_LOG("Whole string cache was freed.\n");
-            imap_destroy(cache.strings, NULL);
-            cache.strings = NULL;
-        }
+        TT_LOG("Whole string cache was freed.\n");
+        imap_destroy(cache.strings, NULL);
+        cache.strings = NULL;
     }
 
     if(free_ft_lib && cache.ft_lib)
@@ -826,4 +1090,5 @@ void fb_text_drop_cache_unused(void)
         FT_Done_FreeType(cache.ft_lib);
         cache.ft_lib = NULL;
     }
+    fb_cache_unlock();
 }
@@ -19,9 +19,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/mount.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "fstab.h"
 #include "util.h"
@@ -207,6 +212,7 @@ int fstab_save(struct fstab *f, const char *path)
 void fstab_destroy(struct fstab *f)
 {
     list_clear(&f->parts, fstab_destroy_part);
+    free(f->path_index);
     free(f->path);
     free(f);
 }
@@ -241,30 +247,67 @@ void fstab_dump(struct fstab *f)
     }
 }
 
-struct fstab_part *fstab_find_first_by_path(struct fstab *f, const char *path)
+static void fstab_build_path_index(struct fstab *f)
 {
-    int i;
+    int i, k;
+
+    if(f->path_index_count == f->count)
+        return;
+
+    f->path_index = realloc(f->path_index, imax(1, f->count) * sizeof(int));
+
+    // insertion sort keeps parts with the same path in fstab order
     for(i = 0; i < f->count; ++i)
-        if(strcmp(f->parts[i]->path, path) == 0)
-            return f->parts[i];
+    {
+        for(k = i; k > 0 && strcmp(f->parts[f->path_index[k-1]]->path, f->parts[i]->path) > 0; --k)
+            f->path_index[k] = f->path_index[k-1];
+        f->path_index[k] = i;
+    }
+    f->path_index_count = f->count;
+}
 
-    return NULL;
+// Returns position of the first part with this path in path_index, or -1
+static int fstab_path_index_find(struct fstab *f, const char *path)
+{
+    int lo = 0, hi, mid;
+
+    fstab_build_path_index(f);
+
+    hi = f->count;
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(strcmp(f->parts[f->path_index[mid]]->path, path) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(lo < f->count && strcmp(f->parts[f->path_index[lo]]->path, path) == 0)
+        return lo;
+    return -1;
+}
+
+struct fstab_part *fstab_find_first_by_path(struct fstab *f, const char *path)
+{
+    int i = fstab_path_index_find(f, path);
+    return i != -1 ? f->parts[f->path_index[i]] : NULL;
 }
 
 struct fstab_part *fstab_find_next_by_path(struct fstab *f, const char *path, struct fstab_part *prev)
 {
-    int i, found_prev = 0;
-    for(i = 0; i < f->count; ++i)
+    int i = fstab_path_index_find(f, path);
+    if(i == -1)
+        return NULL;
+
+    for(; i < f->count && strcmp(f->parts[f->path_index[i]]->path, path) == 0; ++i)
     {
-        if(!found_prev)
-        {
-            if(f->parts[i] == prev)
-                found_prev = 1;
-        }
-        else if(strcmp(f->parts[i]->path, path) == 0)
-        {
-            return f->parts[i];
-        }
+        if(f->parts[f->path_index[i]] != prev)
+            continue;
+
+        if(i+1 < f->count && strcmp(f->parts[f->path_index[i+1]]->path, path) == 0)
+            return f->parts[f->path_index[i+1]];
+        return NULL;
     }
     return NULL;
 }
@@ -336,8 +379,16 @@ void fstab_parse_options(char *opt, struct fstab_part *part)
 struct fstab *fstab_auto_load(void)
 {
     char path[64];
+    struct fstab *t;
     path[0] = 0;
 
+    t = fstab_snapshot_load(FSTAB_SNAPSHOT_PATH);
+    if(t)
+    {
+        INFO("Using fstab \"%s\" from snapshot\n", t->path);
+        return t;
+    }
+
     if(access("/mrom.fstab", F_OK) >= 0)
         strcpy(path, "/mrom.fstab");
     else
@@ -436,3 +487,259 @@ void fstab_update_device(struct fstab *f, const char *oldDev, const char *newDev
 
     free(tmp);
 }
+
+#define FSTAB_SNAPSHOT_MAGIC  0x5346524D // "MRFS"
+#define FSTAB_SNAPSHOT_FORMAT 1
+#define FSTAB_SNAPSHOT_NULL   UINT32_MAX
+
+/*
+ * Snapshot layout:
+ *   struct fstab_snapshot_hdr
+ *   struct fstab_snapshot_part[count]
+ *   uint32_t path_index[count]
+ *   strings, all string fields are offsets into this block
+ */
+struct fstab_snapshot_hdr
+{
+    uint32_t magic;
+    uint32_t format;
+    uint32_t size;
+    uint32_t checksum; // of everything after the header
+    int32_t version;
+    uint32_t count;
+    uint32_t path;
+    uint32_t strings_off;
+};
+
+struct fstab_snapshot_part
+{
+    uint32_t path;
+    uint32_t device;
+    uint32_t type;
+    uint32_t options_raw;
+    uint32_t options;
+    uint32_t options2;
+    uint32_t mountflags;
+    uint32_t disabled;
+};
+
+static uint32_t fstab_snapshot_checksum(const uint8_t *data, size_t len)
+{
+    uint32_t h = 2166136261u;
+    while(len--)
+    {
+        h ^= *data++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t fstab_snapshot_put_str(char *strings, uint32_t *used, const char *str)
+{
+    uint32_t off = *used;
+    if(!str)
+        return FSTAB_SNAPSHOT_NULL;
+
+    strcpy(strings + off, str);
+    *used += strlen(str) + 1;
+    return off;
+}
+
+static size_t fstab_snapshot_str_len(const char *str)
+{
+    return str ? strlen(str) + 1 : 0;
+}
+
+int fstab_snapshot_save(struct fstab *f, const char *path)
+{
+    int i, fd, res = -1;
+    size_t size, strings_len = 0;
+    uint32_t used = 0;
+    uint8_t *buff;
+    char *strings;
+    char tmp_path[128];
+    struct fstab_snapshot_hdr *hdr;
+    struct fstab_snapshot_part *sp;
+    uint32_t *index;
+
+    fstab_build_path_index(f);
+
+    strings_len += fstab_snapshot_str_len(f->path);
+    for(i = 0; i < f->count; ++i)
+    {
+        strings_len += fstab_snapshot_str_len(f->parts[i]->path);
+        strings_len += fstab_snapshot_str_len(f->parts[i]->device);
+        strings_len += fstab_snapshot_str_len(f->parts[i]->type);
+        strings_len += fstab_snapshot_str_len(f->parts[i]->options_raw);
+        strings_len += fstab_snapshot_str_len(f->parts[i]->options);
+        strings_len += fstab_snapshot_str_len(f->parts[i]->options2);
+    }
+
+    size = sizeof(*hdr) + f->count*(sizeof(*sp) + sizeof(uint32_t)) + strings_len;
+    buff = mzalloc(size);
+    hdr = (struct fstab_snapshot_hdr*)buff;
+    sp = (struct fstab_snapshot_part*)(hdr + 1);
+    index = (uint32_t*)(sp + f->count);
+    strings = (char*)(index + f->count);
+
+    hdr->magic = FSTAB_SNAPSHOT_MAGIC;
+    hdr->format = FSTAB_SNAPSHOT_FORMAT;
+    hdr->size = size;
+    hdr->version = f->version;
+    hdr->count = f->count;
+    hdr->strings_off = (uint8_t*)strings - buff;
+    hdr->path = fstab_snapshot_put_str(strings, &used, f->path);
+
+    for(i = 0; i < f->count; ++i)
+    {
+        sp[i].path = fstab_snapshot_put_str(strings, &used, f->parts[i]->path);
+        sp[i].device = fstab_snapshot_put_str(strings, &used, f->parts[i]->device);
+        sp[i].type = fstab_snapshot_put_str(strings, &used, f->parts[i]->type);
+        sp[i].options_raw = fstab_snapshot_put_str(strings, &used, f->parts[i]->options_raw);
+        sp[i].options = fstab_snapshot_put_str(strings, &used, f->parts[i]->options);
+        sp[i].options2 = fstab_snapshot_put_str(strings, &used, f->parts[i]->options2);
+        sp[i].mountflags = f->parts[i]->mountflags;
+        sp[i].disabled = f->parts[i]->disabled;
+        index[i] = f->path_index[i];
+    }
+
+    hdr->checksum = fstab_snapshot_checksum(buff + sizeof(*hdr), size - sizeof(*hdr));
+
+    // write it under temporary name first so readers never see half of it
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0)
+    {
+        ERROR("fstab_snapshot_save: failed to open %s: %s\n", tmp_path, strerror(errno));
+        goto exit;
+    }
+
+    if(write(fd, buff, size) != (ssize_t)size)
+    {
+        ERROR("fstab_snapshot_save: failed to write %s: %s\n", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        goto exit;
+    }
+    close(fd);
+
+    if(rename(tmp_path, path) < 0)
+    {
+        ERROR("fstab_snapshot_save: failed to rename %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        goto exit;
+    }
+
+    res = 0;
+exit:
+    free(buff);
+    return res;
+}
+
+static int fstab_snapshot_get_str(const char *strings, uint32_t strings_len, uint32_t off, char **dest)
+{
+    if(off == FSTAB_SNAPSHOT_NULL)
+    {
+        *dest = NULL;
+        return 0;
+    }
+
+    if(off >= strings_len || !memchr(strings + off, 0, strings_len - off))
+        return -1;
+
+    *dest = strdup(strings + off);
+    return 0;
+}
+
+struct fstab *fstab_snapshot_load(const char *path)
+{
+    int fd;
+    uint32_t i, strings_len;
+    struct stat info;
+    uint8_t *map = MAP_FAILED;
+    const struct fstab_snapshot_hdr *hdr;
+    const struct fstab_snapshot_part *sp;
+    const uint32_t *index;
+    const char *strings;
+    struct fstab *t = NULL;
+    struct fstab_part *part;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(*hdr))
+        goto fail;
+
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+        goto fail;
+
+    hdr = (const struct fstab_snapshot_hdr*)map;
+    if(hdr->magic != FSTAB_SNAPSHOT_MAGIC || hdr->format != FSTAB_SNAPSHOT_FORMAT ||
+        hdr->size != info.st_size || hdr->count > (hdr->size - sizeof(*hdr))/(sizeof(*sp) + sizeof(uint32_t)) ||
+        hdr->strings_off != sizeof(*hdr) + hdr->count*(sizeof(*sp) + sizeof(uint32_t)))
+    {
+        ERROR("fstab_snapshot_load: %s has invalid header\n", path);
+        goto fail;
+    }
+
+    if(hdr->checksum != fstab_snapshot_checksum(map + sizeof(*hdr), hdr->size - sizeof(*hdr)))
+    {
+        ERROR("fstab_snapshot_load: %s has invalid checksum\n", path);
+        goto fail;
+    }
+
+    sp = (const struct fstab_snapshot_part*)(hdr + 1);
+    index = (const uint32_t*)(sp + hdr->count);
+    strings = (const char*)map + hdr->strings_off;
+    strings_len = hdr->size - hdr->strings_off;
+
+    t = fstab_create_empty(hdr->version);
+    if(fstab_snapshot_get_str(strings, strings_len, hdr->path, &t->path) < 0)
+        goto fail_corrupted;
+
+    for(i = 0; i < hdr->count; ++i)
+    {
+        part = mzalloc(sizeof(struct fstab_part));
+        list_add(&t->parts, part);
+        ++t->count;
+
+        if(fstab_snapshot_get_str(strings, strings_len, sp[i].path, &part->path) < 0 ||
+            fstab_snapshot_get_str(strings, strings_len, sp[i].device, &part->device) < 0 ||
+            fstab_snapshot_get_str(strings, strings_len, sp[i].type, &part->type) < 0 ||
+            fstab_snapshot_get_str(strings, strings_len, sp[i].options_raw, &part->options_raw) < 0 ||
+            fstab_snapshot_get_str(strings, strings_len, sp[i].options, &part->options) < 0 ||
+            fstab_snapshot_get_str(strings, strings_len, sp[i].options2, &part->options2) < 0 ||
+            !part->path || !part->device)
+        {
+            goto fail_corrupted;
+        }
+
+        part->mountflags = sp[i].mountflags;
+        part->disabled = sp[i].disabled;
+    }
+
+    t->path_index = malloc(imax(1, t->count) * sizeof(int));
+    for(i = 0; i < hdr->count; ++i)
+    {
+        if(index[i] >= hdr->count)
+            goto fail_corrupted;
+        t->path_index[i] = index[i];
+    }
+    t->path_index_count = t->count;
+
+    munmap(map, info.st_size);
+    close(fd);
+    return t;
+
+fail_corrupted:
+    ERROR("fstab_snapshot_load: %s is corrupted\n", path);
+fail:
+    if(t)
+        fstab_destroy(t);
+    if(map != MAP_FAILED)
+        munmap(map, info.st_size);
+    close(fd);
+    return NULL;
+}
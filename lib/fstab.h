@@ -36,8 +36,16 @@ struct fstab
     int count;
     char *path;
     struct fstab_part **parts;
+
+    // indexes to parts sorted by path, rebuilt when count changes
+    int *path_index;
+    int path_index_count;
 };
 
+// Parsed fstab which trampoline leaves for multirom on the /dev tmpfs,
+// so that it doesn't have to find, parse and resolve it again.
+#define FSTAB_SNAPSHOT_PATH "/dev/.mrom_fstab"
+
 struct fstab *fstab_create_empty(int version);
 struct fstab *fstab_load(const char *path, int resolve_symlinks);
 struct fstab *fstab_auto_load(void);
@@ -53,6 +61,8 @@ void fstab_add_part(struct fstab *f, const char *dev, const char *path, const ch
 void fstab_add_part_struct(struct fstab *f, struct fstab_part *p);
 struct fstab_part *fstab_clone_part(struct fstab_part *p);
 void fstab_update_device(struct fstab *f, const char *oldDev, const char *newDev);
+int fstab_snapshot_save(struct fstab *f, const char *path);
+struct fstab *fstab_snapshot_load(const char *path);
 
 
 #endif
@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <time.h>
 #include <linux/input.h>
 #include <linux/kd.h>
 #include <pthread.h>
@@ -46,10 +47,16 @@ int mt_switch_xy = 0;
 int mt_range_x[2] = { 0 };
 int mt_range_y[2] = { 0 };
 
+#define EV_BATCH 64
+
 static struct pollfd ev_fds[MAX_DEVICES];
 static unsigned ev_count = 0;
 static volatile int input_run = 0;
 
+// events read by the last ev_read_batch()
+static struct input_event ev_ring[EV_BATCH];
+static unsigned ev_ring_len = 0;
+
 static int key_queue[10];
 static int8_t key_itr = 10;
 static pthread_mutex_t key_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -60,6 +67,34 @@ static pthread_mutex_t input_start_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t input_start_cond = PTHREAD_COND_INITIALIZER;
 
 static handler_list_it *mt_handlers = NULL;
+
+#define INPUT_POLL_US 10000
+
+// Moves are delivered once per frame, at the position the finger had
+// RESAMPLE_LATENCY_US before the frame. Needs CLOCK_MONOTONIC event times.
+#define RESAMPLE_LEAD_US 2000
+#define RESAMPLE_LATENCY_US 5000
+#define RESAMPLE_MAX_PREDICTION_US 8000
+#define RESAMPLE_MIN_DELTA_US 2000
+#define RESAMPLE_MAX_DELTA_US 20000
+
+struct touch_sample
+{
+    int x, y;
+    int64_t t;
+};
+
+struct touch_history
+{
+    struct touch_sample s[2]; // older, newer
+    int cnt;
+    int pending;
+    int64_t delivered_t;
+};
+
+static struct touch_history mt_history[MAX_FINGERS];
+static int mt_resample = 0;
+static int mt_resample_pending = 0;
 static handlers_ctx **inactive_ctx = NULL;
 
 #define DIV_ROUND_UP(n,d)  (((n) + (d) - 1) / (d))
@@ -104,6 +139,7 @@ static int ev_init(void)
     long absbit[BITS_TO_LONGS(ABS_CNT)];
 
     ev_count = 0;
+    mt_resample = 0;
     mt_screen_res[0] = fb_get_vi_xres();
     mt_screen_res[1] = fb_get_vi_yres();
 
@@ -131,6 +167,11 @@ static int ev_init(void)
                 (absbit[BIT_WORD(ABS_MT_POSITION_Y)] & BIT_MASK(ABS_MT_POSITION_Y)))
              {
                  get_abs_min_max(fd);
+#if !defined(MR_NO_TOUCH_RESAMPLING) && defined(EVIOCSCLOCKID)
+                 // event times have to be comparable with the frame times
+                 int clk = CLOCK_MONOTONIC;
+                 mt_resample = (ioctl(fd, EVIOCSCLOCKID, &clk) >= 0);
+#endif
              }
         }
 
@@ -151,25 +192,27 @@ static void ev_exit(void)
     }
 }
 
-static int ev_get(struct input_event *ev, unsigned dont_wait)
+// Reads everything the devices have queued, up to EV_BATCH events. Each
+// device is drained with multi-event reads, so its events stay in order.
+static unsigned ev_read_batch(void)
 {
     int r;
     unsigned n;
 
-    do {
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
+    ev_ring_len = 0;
+    if(poll(ev_fds, ev_count, 0) <= 0)
+        return 0;
 
-        if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) return 0;
-                }
-            }
-        }
-    } while(dont_wait == 0);
+    for(n = 0; n < ev_count && ev_ring_len < EV_BATCH; n++)
+    {
+        if(!(ev_fds[n].revents & POLLIN))
+            continue;
 
-    return -1;
+        r = read(ev_fds[n].fd, ev_ring + ev_ring_len, (EV_BATCH - ev_ring_len)*sizeof(struct input_event));
+        if(r > 0)
+            ev_ring_len += r / sizeof(struct input_event);
+    }
+    return ev_ring_len;
 }
 
 #define IS_KEY_HANDLED(key) (key >= KEY_VOLUMEDOWN && key <= KEY_POWER)
@@ -263,6 +306,137 @@ static void mt_recalc_pos_rotation(touch_event *ev)
     }
 }
 
+static void touch_dispatch(touch_event *ev)
+{
+    int res;
+    touch_handler *h;
+    handler_list_it *it;
+
+    keyaction_clear_active();
+
+    if(ev->changed & TCHNG_POS)
+        mt_recalc_pos_rotation(ev);
+
+    pthread_mutex_lock(&touch_mutex);
+    it = mt_handlers;
+    while(it)
+    {
+        h = it->handler;
+
+        res = (*h->callback)(ev, h->data);
+        if(res == 0)
+            ev->consumed = 1;
+        else if(res == 1)
+            break;
+
+        it = it->next;
+    }
+    pthread_mutex_unlock(&touch_mutex);
+
+    ev->consumed = 0;
+    ev->changed = 0;
+}
+
+static inline int64_t timeval_to_us(struct timeval tv)
+{
+    return ((int64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static inline struct timeval us_to_timeval(int64_t us)
+{
+    struct timeval tv = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+    return tv;
+}
+
+static void touch_sample_add(int i, int64_t t)
+{
+    struct touch_history *h = &mt_history[i];
+
+    if(h->cnt > 0 && h->s[1].t == t)
+        --h->cnt;
+    h->s[0] = h->s[1];
+    h->s[1].x = mt_events[i].orig_x;
+    h->s[1].y = mt_events[i].orig_y;
+    h->s[1].t = t;
+    h->cnt = imin(h->cnt + 1, 2);
+}
+
+// Position of finger i at time t, interpolated between the last two
+// samples or extrapolated a bit past the newest one
+static void touch_sample_at(int i, int64_t t, int *x, int *y)
+{
+    struct touch_history *h = &mt_history[i];
+    const struct touch_sample *a = &h->s[0], *b = &h->s[1];
+    const int64_t dt = b->t - a->t;
+    int64_t max_t;
+
+    *x = b->x;
+    *y = b->y;
+
+    if(h->cnt < 2 || dt < RESAMPLE_MIN_DELTA_US || dt > RESAMPLE_MAX_DELTA_US)
+        return;
+
+    max_t = b->t + (dt/2 < RESAMPLE_MAX_PREDICTION_US ? dt/2 : RESAMPLE_MAX_PREDICTION_US);
+    if(t > max_t)
+        t = max_t;
+    if(t < a->t)
+        t = a->t;
+
+    *x = a->x + (int)(((int64_t)(b->x - a->x))*(t - a->t)/dt);
+    *y = a->y + (int)(((int64_t)(b->y - a->y))*(t - a->t)/dt);
+}
+
+// Delivers the moves buffered by touch_commit_events() once the next frame
+// is close. Returns how many us until it should be called again.
+static int64_t touch_resample_deliver(void)
+{
+    uint32_t i;
+    int64_t now, frame, t, ev_t;
+    struct timespec ts;
+    struct touch_history *h;
+    touch_event *ev;
+
+    if(!mt_resample_pending)
+        return INPUT_POLL_US;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+    frame = (int64_t)fb_next_frame_us();
+    if(now < frame - RESAMPLE_LEAD_US)
+    {
+        t = frame - RESAMPLE_LEAD_US - now;
+        return t < INPUT_POLL_US ? t : INPUT_POLL_US;
+    }
+
+    t = frame - RESAMPLE_LATENCY_US;
+    mt_resample_pending = 0;
+
+    for(i = 0; i < ARRAY_SIZE(mt_events); ++i)
+    {
+        h = &mt_history[i];
+        if(!h->pending)
+            continue;
+
+        h->pending = 0;
+        ev = &mt_events[i];
+
+        // never go back behind what was delivered already
+        ev_t = t > h->delivered_t ? t : h->delivered_t;
+        h->delivered_t = ev_t;
+
+        touch_sample_at(i, ev_t, &ev->orig_x, &ev->orig_y);
+        ev->us_diff = ev_t - timeval_to_us(ev->time);
+        ev->time = us_to_timeval(ev_t);
+        ev->changed = TCHNG_POS;
+        touch_dispatch(ev);
+
+        // handle_abs_event() updates x and y separately, keep them raw
+        ev->orig_x = h->s[1].x;
+        ev->orig_y = h->s[1].y;
+    }
+    return INPUT_POLL_US;
+}
+
 void touch_commit_events(struct timeval ev_time)
 {
     pthread_mutex_lock(&touch_mutex);
@@ -273,50 +447,65 @@ void touch_commit_events(struct timeval ev_time)
         return;
 
     uint32_t i;
-    int res;
-    touch_handler *h;
-    handler_list_it *it;
+    struct touch_history *h;
+    const int64_t t = timeval_to_us(ev_time);
 
     for(i = 0; i < ARRAY_SIZE(mt_events); ++i)
     {
-        mt_events[i].us_diff = timeval_us_diff(ev_time, mt_events[i].time);
-        mt_events[i].time = ev_time;
+        h = &mt_history[i];
 
-        if(!mt_events[i].changed)
+        if(mt_resample && mt_events[i].changed == TCHNG_POS)
+        {
+            // coalesced into one move per frame by touch_resample_deliver()
+            touch_sample_add(i, t);
+            h->pending = 1;
+            mt_resample_pending = 1;
+            mt_events[i].changed = 0;
             continue;
+        }
 
-        keyaction_clear_active();
-
-        if(mt_events[i].changed & TCHNG_POS)
-            mt_recalc_pos_rotation(&mt_events[i]);
+        if(!mt_events[i].changed)
+        {
+            if(!h->pending)
+            {
+                mt_events[i].us_diff = timeval_us_diff(ev_time, mt_events[i].time);
+                mt_events[i].time = ev_time;
+            }
+            continue;
+        }
 
-        pthread_mutex_lock(&touch_mutex);
-        it = mt_handlers;
-        while(it)
+        // a pending move is superseded by this raw event
+        if(h->pending)
         {
-            h = it->handler;
+            mt_events[i].changed |= TCHNG_POS;
+            h->pending = 0;
+        }
 
-            res = (*h->callback)(&mt_events[i], h->data);
-            if(res == 0)
-                mt_events[i].consumed = 1;
-            else if(res == 1)
-                break;
+        mt_events[i].us_diff = timeval_us_diff(ev_time, mt_events[i].time);
+        mt_events[i].time = ev_time;
 
-            it = it->next;
-        }
-        pthread_mutex_unlock(&touch_mutex);
+        if(mt_events[i].changed & TCHNG_ADDED)
+            h->cnt = 0;
+        touch_sample_add(i, t);
+        h->delivered_t = t;
 
-        mt_events[i].consumed = 0;
-        mt_events[i].changed = 0;
+        touch_dispatch(&mt_events[i]);
     }
 }
 
+static void touch_handler_apply_queued(void);
+
 static void *input_thread_work(UNUSED void *cookie)
 {
+    unsigned i;
+    int64_t sleep_us;
+    struct input_event *ev;
+
     ev_init();
-    struct input_event ev;
 
     memset(mt_events, 0, sizeof(mt_events));
+    memset(mt_history, 0, sizeof(mt_history));
+    mt_resample_pending = 0;
 
     key_itr = 10;
     mt_slot = 0;
@@ -327,22 +516,32 @@ static void *input_thread_work(UNUSED void *cookie)
 
     while(input_run)
     {
-        while(ev_get(&ev, 1) == 0)
+        while(ev_read_batch() > 0)
         {
-            switch(ev.type)
+            for(i = 0; i < ev_ring_len; ++i)
             {
-                case EV_KEY:
-                    handle_key_event(&ev);
-                    break;
-                case EV_ABS:
-                    handle_abs_event(&ev);
-                    break;
-                case EV_SYN:
-                    handle_syn_event(&ev);
-                    break;
+                ev = &ev_ring[i];
+                switch(ev->type)
+                {
+                    case EV_KEY:
+                        handle_key_event(ev);
+                        break;
+                    case EV_ABS:
+                        handle_abs_event(ev);
+                        break;
+                    case EV_SYN:
+                        handle_syn_event(ev);
+                        break;
+                }
             }
+
+            touch_handler_apply_queued();
         }
-        usleep(10000);
+
+        sleep_us = touch_resample_deliver();
+        touch_handler_apply_queued();
+        if(sleep_us > 0)
+            usleep(sleep_us);
     }
     ev_exit();
     return NULL;
@@ -416,6 +615,8 @@ void stop_input_thread(void)
     input_run = 0;
     pthread_join(input_thread, NULL);
     pthread_mutex_unlock(&input_start_mutex);
+
+    touch_handler_apply_queued();
 }
 
 
@@ -469,61 +670,94 @@ static void rm_touch_handler_priv(touch_callback callback, void *data)
 }
 
 typedef void (*handler_call)(touch_callback, void*);
-struct handler_thread_data
+
+// Handler changes which can't be done right away, because the input
+// thread might be going through the handlers. Lock-free LIFO, newest first.
+struct handler_request
 {
     handler_call handler;
     touch_callback callback;
     void *data;
+    struct handler_request *next;
 };
 
-static void *touch_handler_thread_work(void *data)
+static struct handler_request * volatile handler_requests = NULL;
+// Held while a swapped-out chunk is applied, so that the input thread and
+// input_push_context/input_pop_context can't apply two chunks at once and
+// reorder them.
+static pthread_mutex_t handler_requests_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void touch_handler_queue(handler_call h_c, touch_callback callback, void *data)
 {
-    struct handler_thread_data *d = data;
-    d->handler(d->callback, d->data);
-    free(d);
-    return NULL;
+    struct handler_request *r = mzalloc(sizeof(struct handler_request));
+    r->handler = h_c;
+    r->callback = callback;
+    r->data = data;
+
+    do
+        r->next = handler_requests;
+    while(!__sync_bool_compare_and_swap(&handler_requests, r->next, r));
 }
 
-static void touch_handler_thread_dispatcher(int force_async, handler_call h_c, touch_callback callback, void *data)
+// Must not be called with touch_mutex held
+static void touch_handler_apply_queued(void)
 {
-    if(force_async || pthread_self() == input_thread)
+    struct handler_request *r, *next, *fifo = NULL;
+
+    pthread_mutex_lock(&handler_requests_mutex);
+
+    r = __sync_lock_test_and_set(&handler_requests, NULL);
+    for(; r; r = next)
     {
-        struct handler_thread_data *d = mzalloc(sizeof(struct handler_thread_data));
-        d->handler = h_c;
-        d->callback = callback;
-        d->data = data;
+        next = r->next;
+        r->next = fifo;
+        fifo = r;
+    }
 
-        pthread_t handler_thread;
-        pthread_create(&handler_thread, NULL, touch_handler_thread_work, d);
+    for(r = fifo; r; r = next)
+    {
+        next = r->next;
+        r->handler(r->callback, r->data);
+        free(r);
     }
+
+    pthread_mutex_unlock(&handler_requests_mutex);
+}
+
+static void touch_handler_dispatch(int force_async, handler_call h_c, touch_callback callback, void *data)
+{
+    if(pthread_self() == input_thread || (force_async && input_run))
+        touch_handler_queue(h_c, callback, data);
     else
         h_c(callback, data);
 }
 
 void add_touch_handler(touch_callback callback, void *data)
 {
-   touch_handler_thread_dispatcher(0, add_touch_handler_priv, callback, data);
+   touch_handler_dispatch(0, add_touch_handler_priv, callback, data);
 }
 
 void rm_touch_handler(touch_callback callback, void *data)
 {
-    touch_handler_thread_dispatcher(0, rm_touch_handler_priv, callback, data);
+    touch_handler_dispatch(0, rm_touch_handler_priv, callback, data);
 }
 
 void add_touch_handler_async(touch_callback callback, void *data)
 {
-   touch_handler_thread_dispatcher(1, add_touch_handler_priv, callback, data);
+   touch_handler_dispatch(1, add_touch_handler_priv, callback, data);
 }
 
 void rm_touch_handler_async(touch_callback callback, void *data)
 {
-    touch_handler_thread_dispatcher(1, rm_touch_handler_priv, callback, data);
+    touch_handler_dispatch(1, rm_touch_handler_priv, callback, data);
 }
 
 void input_push_context(void)
 {
     handlers_ctx *ctx = mzalloc(sizeof(handlers_ctx));
 
+    touch_handler_apply_queued();
+
     pthread_mutex_lock(&touch_mutex);
     ctx->handlers = mt_handlers;
     mt_handlers = NULL;
@@ -540,6 +774,8 @@ void input_pop_context(void)
     int idx = list_item_count(inactive_ctx)-1;
     handlers_ctx *ctx = inactive_ctx[idx];
 
+    touch_handler_apply_queued();
+
     pthread_mutex_lock(&touch_mutex);
     mt_handlers = ctx->handlers;
     pthread_mutex_unlock(&touch_mutex);
@@ -552,6 +788,8 @@ struct keyaction
     fb_item_pos *parent;
     void *data;
     keyaction_call call;
+    // position of the parent when it was added, actions are sorted by it
+    int key_y, key_x;
 };
 
 struct keyaction_ctx
@@ -577,39 +815,60 @@ static struct keyaction_ctx keyaction_ctx = {
 #define REPEAT_TIME_FIRST 500
 #define REPEAT_TIME 150
 
-static int compare_keyactions(const void* k1, const void* k2)
+static int compare_keyaction_pos(const struct keyaction *a, int y, int x)
 {
-    const struct keyaction *a1 = *((const struct keyaction **)k1);
-    const struct keyaction *a2 = *((const struct keyaction **)k2);
+    if(a->key_y != y)
+        return a->key_y < y ? -1 : 1;
+    if(a->key_x != x)
+        return a->key_x < x ? -1 : 1;
+    return 0;
+}
 
-    if(a1->parent->y < a2->parent->y)
-        return -1;
-    else if(a1->parent->y > a2->parent->y)
-        return 1;
-    else
+// index of the first action which isn't before [x, y], expects locked mutex
+static int keyaction_lower_bound(struct keyaction_ctx *c, int y, int x)
+{
+    int lo = 0, hi = c->actions_len, mid;
+    while(lo < hi)
     {
-        if(a1->parent->x < a2->parent->x)
-            return -1;
-        else if(a1->parent->x > a2->parent->x)
-            return 1;
+        mid = (lo + hi)/2;
+        if(compare_keyaction_pos(c->actions[mid], y, x) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    return 0;
+    return lo;
+}
+
+// expects locked mutex
+static int keyaction_index_of(struct keyaction_ctx *c, struct keyaction *a)
+{
+    int i = keyaction_lower_bound(c, a->key_y, a->key_x);
+    for(; i < c->actions_len && c->actions[i]->key_y == a->key_y && c->actions[i]->key_x == a->key_x; ++i)
+        if(c->actions[i] == a)
+            return i;
+    return -1;
 }
 
 void keyaction_add(void *parent, keyaction_call call, void *data)
 {
     struct keyaction *k = mzalloc(sizeof(struct keyaction));
+    int idx;
+
     k->parent = parent;
     k->data = data;
     k->call = call;
+    k->key_y = k->parent->y;
+    k->key_x = k->parent->x;
 
     pthread_mutex_lock(&keyaction_ctx.lock);
 
-    list_add(&keyaction_ctx.actions, k);
-    ++keyaction_ctx.actions_len;
+    // actions at the same position keep the order they were added in
+    idx = keyaction_lower_bound(&keyaction_ctx, k->key_y, k->key_x);
+    while(idx < keyaction_ctx.actions_len && compare_keyaction_pos(keyaction_ctx.actions[idx], k->key_y, k->key_x) == 0)
+        ++idx;
 
-    qsort(keyaction_ctx.actions, keyaction_ctx.actions_len,
-          sizeof(struct keyaction *), &compare_keyactions);
+    list_add_at(&keyaction_ctx.actions, idx, k);
+    ++keyaction_ctx.actions_len;
 
     pthread_mutex_unlock(&keyaction_ctx.lock);
 }
@@ -677,50 +936,48 @@ static void keyaction_call_cur_act(struct keyaction_ctx *c, int action)
     if (res != 1 || (action != KEYACT_UP && action != KEYACT_DOWN))
         return;
 
-    struct keyaction **a = c->actions;
-    for(; *a; ++a)
-    {
-        if(*a == c->cur_act)
-        {
-            do
-            {
-                if(action == KEYACT_UP)
-                    c->cur_act = (a != c->actions) ? *(--a) : NULL;
-                else
-                    c->cur_act = *(++a);
+    // the action might have been removed while the mutex was unlocked
+    if(!c->cur_act)
+        return;
 
-                if(c->cur_act)
-                    ERROR("act %d %d %d %d\n", c->cur_act->parent->x, c->cur_act->parent->y, c->cur_act->parent->w, c->cur_act->parent->h);
-            }
-            while(c->cur_act && !keyaction_is_visible(c->cur_act));
+    int i = keyaction_index_of(c, c->cur_act);
+    if(i == -1)
+    {
+        // should never be reached
+        ERROR("keyaction_call_cur_act: current action not found in actions!\n");
+        return;
+    }
 
-            if(c->cur_act)
-                c->cur_act->call(c->cur_act->data, action);
-            return;
-        }
+    do
+    {
+        i += (action == KEYACT_UP) ? -1 : 1;
+        c->cur_act = (i >= 0 && i < c->actions_len) ? c->actions[i] : NULL;
     }
-    // should never be reached
-    ERROR("keyaction_call_cur_act: current action not found in actions!\n");
+    while(c->cur_act && !keyaction_is_visible(c->cur_act));
+
+    if(c->cur_act)
+        c->cur_act->call(c->cur_act->data, action);
 }
 
+// Only registered while a direction key is held down
 static int keyaction_repeat_worker(uint32_t diff, void *data)
 {
     struct keyaction_ctx *c = data;
+    int res = 0;
 
     pthread_mutex_lock(&c->lock);
-    if(c->repeat != KEYACT_NONE)
+    if(c->repeat == KEYACT_NONE)
+        res = 1;
+    else if(c->repeat_timer <= diff)
     {
-        if(c->repeat_timer <= diff)
-        {
-            keyaction_call_cur_act(c, c->repeat);
-            c->repeat_timer = REPEAT_TIME;
-        }
-        else
-            c->repeat_timer -= diff;
+        keyaction_call_cur_act(c, c->repeat);
+        c->repeat_timer = REPEAT_TIME;
     }
+    else
+        c->repeat_timer -= diff;
     pthread_mutex_unlock(&c->lock);
 
-    return 0;
+    return res;
 }
 
 void keyaction_clear_active(void)
@@ -738,6 +995,7 @@ void keyaction_clear_active(void)
 int keyaction_handle_keyevent(int key, int press)
 {
     int res = -1;
+    int start_repeat = 0;
     int act = KEYACT_NONE;
     switch(key)
     {
@@ -781,11 +1039,21 @@ int keyaction_handle_keyevent(int key, int press)
         {
             keyaction_ctx.repeat = act;
             keyaction_ctx.repeat_timer = REPEAT_TIME_FIRST;
+            start_repeat = 1;
         }
     }
 
 exit:
     pthread_mutex_unlock(&keyaction_ctx.lock);
+
+    // The worker locks keyaction_ctx.lock under the workers' mutex, so this
+    // can't be done with the lock held. Removing it first makes sure it is
+    // there only once, the previous one might not have noticed the release yet.
+    if(start_repeat)
+    {
+        workers_remove(&keyaction_repeat_worker, &keyaction_ctx);
+        workers_add(&keyaction_repeat_worker, &keyaction_ctx);
+    }
     return res;
 }
 
@@ -795,11 +1063,10 @@ void keyaction_enable(int enable)
     if(enable != keyaction_ctx.enable)
     {
         keyaction_ctx.enable = enable;
+        keyaction_ctx.repeat = KEYACT_NONE;
         pthread_mutex_unlock(&keyaction_ctx.lock);
 
-        if(enable)
-            workers_add(&keyaction_repeat_worker, &keyaction_ctx);
-        else
+        if(!enable)
             workers_remove(&keyaction_repeat_worker, &keyaction_ctx);
     }
     else
@@ -17,6 +17,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "listview.h"
 #include "framebuffer.h"
@@ -37,13 +38,64 @@
 #define OVERSCROLL_H (130*DPI_MUL)
 #define OVERSCROLL_MARK_H (4*DPI_MUL)
 #define OVERSCROLL_RETURN_SPD (10*DPI_MUL)
+#define FLING_MIN_V (400*DPI_MUL) // px/s
+#define FLING_FRICTION (2000*DPI_MUL) // px/s^2
 
-static int listview_bounceback(UNUSED uint32_t diff, void *data)
+static void listview_fling_set(listview *v, float velocity)
+{
+    pthread_mutex_lock(&v->fling_mutex);
+    v->fling_v = velocity;
+    v->fling_acc = 0.f;
+    pthread_mutex_unlock(&v->fling_mutex);
+}
+
+// returns 0 if the list is not flinging
+static int listview_fling_step(listview *v, uint32_t diff)
+{
+    const int max = v->fullH - v->h;
+    const float dv = (FLING_FRICTION*diff)/1000.f;
+    int step;
+
+    pthread_mutex_lock(&v->fling_mutex);
+    if(v->fling_v == 0.f || v->touch.id != -1)
+    {
+        pthread_mutex_unlock(&v->fling_mutex);
+        return 0;
+    }
+
+    v->fling_acc += (v->fling_v*diff)/1000.f;
+    step = (int)v->fling_acc;
+    v->fling_acc -= step;
+
+    if(fabs(v->fling_v) <= dv)
+        v->fling_v = 0.f;
+    else
+        v->fling_v += v->fling_v > 0.f ? -dv : dv;
+
+    // stop at the end of the list, bounceback takes it from there
+    if((step < 0 && v->pos + step < 0) || (step > 0 && v->pos + step > max))
+    {
+        v->fling_v = 0.f;
+        v->fling_acc = 0.f;
+    }
+
+    if(v->fling_v == 0.f)
+        v->fling_acc = 0.f;
+    pthread_mutex_unlock(&v->fling_mutex);
+
+    listview_scroll_by(v, step);
+    return 1;
+}
+
+static int listview_bounceback(uint32_t diff, void *data)
 {
     listview *v = (listview*)data;
     const int max = v->fullH - v->h;
 
     int step;
+    if(listview_fling_step(v, diff))
+        return 0;
+
     if(v->pos < 0)
     {
         step = imin(-v->pos, OVERSCROLL_RETURN_SPD);
@@ -79,6 +131,8 @@ void listview_init_ui(listview *view)
     view->keyact_item_selected = -1;
     view->touch.id = -1;
     view->tracker = touch_tracker_create();
+    pthread_mutex_init(&view->fling_mutex, NULL);
+    view->shown_first = view->shown_last = -1;
 
     view->last_rendered_pos.x = view->x;
     view->last_rendered_pos.y = view->y;
@@ -108,6 +162,8 @@ void listview_destroy(listview *view)
 
     fb_ctx_rm_item(view);
 
+    pthread_mutex_destroy(&view->fling_mutex);
+    free(view->offsets);
     free(view);
 }
 
@@ -123,6 +179,7 @@ listview_item *listview_add_item(listview *view, int id, void *data)
         keyaction_add(view, listview_keyaction_call, view);
 
     list_add(&view->items, it);
+    view->offsets_valid = 0;
     return it;
 }
 
@@ -132,14 +189,70 @@ void listview_clear(listview *view)
         listview_update_ui(view);
 
     list_clear(&view->items, view->item_destroy);
+    view->offsets_valid = 0;
+    view->shown_first = view->shown_last = -1;
+    listview_fling_set(view, 0.f);
 
     keyaction_remove(listview_keyaction_call, view);
 }
 
+void listview_invalidate_heights(listview *view)
+{
+    view->offsets_valid = 0;
+}
+
+static void listview_update_offsets(listview *view)
+{
+    int i, y = 0;
+
+    if(view->offsets_valid)
+        return;
+
+    view->items_cnt = list_item_count(view->items);
+    view->offsets = realloc(view->offsets, (view->items_cnt+1)*sizeof(int));
+    for(i = 0; i < view->items_cnt; ++i)
+    {
+        view->offsets[i] = y;
+        y += (*view->item_height)(view->items[i]);
+    }
+    view->offsets[i] = y;
+    view->fullH = y;
+    view->offsets_valid = 1;
+}
+
+// index of the last item which starts at or above y, list must not be empty
+static int listview_index_at(listview *view, int y)
+{
+    int lo = 0, hi = view->items_cnt - 1, mid;
+    while(lo < hi)
+    {
+        mid = (lo + hi + 1)/2;
+        if(view->offsets[mid] <= y)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+static void listview_draw_item(listview *view, int idx)
+{
+    listview_item *it = view->items[idx];
+    const int y = view->offsets[idx];
+    const int it_h = view->offsets[idx+1] - y;
+    const int visible = (int)(view->pos <= y+it_h && y-view->pos <= view->h);
+
+    (*view->item_draw)(view->x, view->y+y-view->pos, view->w - PADDING, it);
+
+    if(visible)
+        it->flags |= IT_VISIBLE;
+    else
+        it->flags &= ~(IT_VISIBLE);
+}
+
 void listview_update_ui_args(listview *view, int only_if_moved, int mutex_locked)
 {
-    int y = 0;
-    int i, it_h, visible;
+    int i, first, last, top, bottom;
     listview_item *it;
 
     if(only_if_moved)
@@ -171,28 +284,42 @@ void listview_update_ui_args(listview *view, int only_if_moved, int mutex_locked
     if(!mutex_locked)
         fb_batch_start();
 
-    for(i = 0; view->items && view->items[i]; ++i)
-    {
-        it = view->items[i];
-        it_h = (*view->item_height)(it);
+    listview_update_offsets(view);
 
-        visible = (int)(view->pos <= y+it_h && y-view->pos <= view->h);
+    // Only the items around the visible area have their UI items,
+    // the rest is hidden and gets created again when scrolled to.
+    first = last = -1;
+    top = view->pos - view->h/2;
+    bottom = view->pos + view->h + view->h/2;
+    if(view->items_cnt > 0 && bottom > 0 && top < view->fullH)
+    {
+        first = listview_index_at(view, top);
+        last = listview_index_at(view, bottom);
+    }
 
-        if(visible || (it->flags & IT_VISIBLE))
-            (*view->item_draw)(view->x, view->y+y-view->pos, view->w - PADDING, it);
+    for(i = view->shown_first; i != -1 && i <= view->shown_last && i < view->items_cnt; ++i)
+    {
+        if(i >= first && i <= last)
+            continue;
 
-        if(visible)
-            it->flags |= IT_VISIBLE;
+        it = view->items[i];
+        if(!view->item_hide || (it->flags & IT_SELECTED))
+            listview_draw_item(view, i);
         else
+        {
+            (*view->item_hide)(it->data);
             it->flags &= ~(IT_VISIBLE);
-
-        y += it_h;
+        }
     }
 
-    view->fullH = y;
+    for(i = first; i != -1 && i <= last; ++i)
+        listview_draw_item(view, i);
+
+    view->shown_first = first;
+    view->shown_last = last;
 
-    listview_enable_scroll(view, (int)(y > view->h));
-    if(y > view->h)
+    listview_enable_scroll(view, (int)(view->fullH > view->h));
+    if(view->fullH > view->h)
         listview_update_scroll_mark(view);
 
     if(!mutex_locked)
@@ -282,6 +409,7 @@ int listview_touch_handler(touch_event *ev, void *data)
         if(ev->consumed)
             return -1;
 
+        listview_fling_set(view, 0.f);
         touch_tracker_start(view->tracker, ev);
         view->touch.id = ev->id;
         view->touch.hover = listview_item_at(view, ev->y);
@@ -305,11 +433,20 @@ int listview_touch_handler(touch_event *ev, void *data)
 
     if(ev->changed & TCHNG_REMOVED)
     {
+        touch_tracker_finish(view->tracker, ev);
+
         if(ev->x == -1 && ev->y == -1)
         {
             if(listview_select_item(view, NULL))
                 listview_update_ui(view);
         }
+        else if(!view->touch.hover && !view->touch.fast_scroll && view->tracker->period > 0)
+        {
+            // a finger which stopped before it was lifted doesn't fling
+            float velocity = -touch_tracker_get_release_velocity(view->tracker, TRACKER_Y)*DPI_MUL;
+            if(fabs(velocity) >= FLING_MIN_V)
+                listview_fling_set(view, velocity);
+        }
         else if(view->touch.hover)
         {
             if(view->selected == view->touch.hover)
@@ -322,7 +459,6 @@ int listview_touch_handler(touch_event *ev, void *data)
             view->touch.hover->flags &= ~(IT_HOVER);
             view->touch.hover = NULL;
         }
-        touch_tracker_finish(view->tracker, ev);
         view->touch.id = -1;
         listview_update_ui(view);
         return 0;
@@ -400,31 +536,38 @@ void listview_scroll_to(listview *view, int pct)
     listview_update_ui(view);
 }
 
-int listview_ensure_visible(listview *view, listview_item *it)
+static int listview_ensure_visible_idx(listview *view, int idx)
 {
-    if(!view->scroll_mark)
+    int top, bottom;
+
+    if(!view->scroll_mark || idx < 0)
         return 0;
 
-    int i;
-    int y = 0;
-    for(i = 0; view->items[i]; ++i)
-    {
-        if(it == view->items[i])
-            break;
-        y += view->item_height(view->items[i]);
-    }
+    listview_update_offsets(view);
+    if(idx >= view->items_cnt)
+        return 0;
 
-    int last_h = view->items[i] ? view->item_height(view->items[i]) : 0;
+    top = view->offsets[idx];
+    bottom = view->offsets[idx+1];
 
-    if((y + last_h) - view->pos > view->h)
-        view->pos = (y + last_h) - view->h;
-    else if(y - view->pos < 0)
-        view->pos = y;
+    if(bottom - view->pos > view->h)
+        view->pos = bottom - view->h;
+    else if(top - view->pos < 0)
+        view->pos = top;
     else
         return 0;
+
+    listview_fling_set(view, 0.f);
     return 1;
 }
 
+int listview_ensure_visible(listview *view, listview_item *it)
+{
+    int i;
+    for(i = 0; view->items && view->items[i] && view->items[i] != it; ++i);
+    return listview_ensure_visible_idx(view, i);
+}
+
 int listview_ensure_selected_visible(listview *view)
 {
     if(view->selected)
@@ -435,32 +578,30 @@ int listview_ensure_selected_visible(listview *view)
 
 listview_item *listview_item_at(listview *view, int y_pos)
 {
-    int y = -view->pos + view->y;
-    int i, it_h;
-    listview_item *it;
+    int i, y;
 
-    for(i = 0; view->items && view->items[i]; ++i)
-    {
-        it = view->items[i];
-        it_h = (*view->item_height)(it);
-
-        if(y < y_pos && y+it_h > y_pos)
-            return it;
+    listview_update_offsets(view);
+    if(view->items_cnt == 0)
+        return NULL;
 
-        y += it_h;
-    }
+    y = y_pos - view->y + view->pos;
+    i = listview_index_at(view, y);
+    if(y > view->offsets[i] && y < view->offsets[i+1])
+        return view->items[i];
     return NULL;
 }
 
 int listview_keyaction_call(void *data, int act)
 {
     listview *v = data;
+
+    listview_update_offsets(v);
     switch(act)
     {
         case KEYACT_DOWN:
         {
             ++v->keyact_item_selected;
-            if(v->keyact_item_selected >= list_item_count(v->items))
+            if(v->keyact_item_selected >= v->items_cnt)
                 v->keyact_item_selected = -1;
             listview_update_keyact_frame(v);
             return (v->keyact_item_selected == -1) ? 1 :0;
@@ -468,7 +609,7 @@ int listview_keyaction_call(void *data, int act)
         case KEYACT_UP:
         {
             if(v->keyact_item_selected == -1)
-                v->keyact_item_selected = list_item_count(v->items)-1;
+                v->keyact_item_selected = v->items_cnt-1;
             else
                 --v->keyact_item_selected;
             listview_update_keyact_frame(v);
@@ -509,14 +650,7 @@ void listview_update_keyact_frame(listview *view)
     }
 
     listview_item *it = view->items[view->keyact_item_selected];
-    listview_ensure_visible(view, it);
-
-    int i;
-    int y = view->y;
-    for(i = 0; i < view->keyact_item_selected && view->items[i]; ++i)
-        y += view->item_height(view->items[i]);
-
-    y -= view->pos;
+    listview_ensure_visible_idx(view, view->keyact_item_selected);
 
     listview_select_item(view, it);
     listview_update_ui(view);
@@ -542,6 +676,7 @@ typedef struct
     fb_img *icon;
     int deselect_anim_started;
     int rom_name_size;
+    int rom_name_w; // width rom_name_size was fitted to
     int last_y;
     int last_x;
 } rom_item_data;
@@ -656,15 +791,18 @@ void rom_item_draw(int x, int y, int w, listview_item *it)
 
         fb_text_proto *p = fb_text_create(x+ROM_TEXT_PADDING_L, 0, C_TEXT, d->rom_name_size, d->text);
         p->style = STYLE_CONDENSED;
+        if(d->rom_name_w != w)
+        {
+            d->rom_name_size = fb_text_fit_size(p, w - ROM_TEXT_PADDING_R - ROM_TEXT_PADDING_L, 3);
+            d->rom_name_w = w;
+        }
+        p->size = d->rom_name_size;
         d->text_it = fb_text_finalize(p);
         d->text_it->parent = it->parent_rect;
 
-        while((d->text_it->w + ROM_TEXT_PADDING_L) >= (w - ROM_TEXT_PADDING_R) && d->rom_name_size > 3)
-            fb_text_set_size(d->text_it, --d->rom_name_size);
-
         if(d->icon_path)
         {
-            d->icon = fb_add_png_img(x+ROM_ICON_PADDING, 0, ROM_ICON_H, ROM_ICON_H, d->icon_path);
+            d->icon = fb_add_png_img_async(x+ROM_ICON_PADDING, 0, ROM_ICON_H, ROM_ICON_H, d->icon_path);
             d->icon->parent = it->parent_rect;
         }
 
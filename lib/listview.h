@@ -73,6 +73,21 @@ typedef struct
 
     listview_touch_data touch;
     touch_tracker *tracker;
+
+    // offsets[i] is the top of item i, offsets[items_cnt] is fullH.
+    // item_height() is only called when the items change.
+    int *offsets;
+    int items_cnt;
+    int offsets_valid;
+
+    // items in [shown_first, shown_last] have their UI items created
+    int shown_first, shown_last;
+
+    // fling_v and fling_acc are set from the input thread and advanced by
+    // the workers thread, both under fling_mutex
+    pthread_mutex_t fling_mutex;
+    float fling_v; // px/s, > 0 scrolls towards the end of the list
+    float fling_acc;
 } listview;
 
 int listview_touch_handler(touch_event *ev, void *data);
@@ -83,6 +98,7 @@ listview_item *listview_add_item(listview *view, int id, void *data);
 void listview_clear(listview *view);
 void listview_update_ui(listview *view);
 void listview_update_ui_args(listview *view, int only_if_moved, int mutex_locked);
+void listview_invalidate_heights(listview *view);
 void listview_enable_scroll(listview *view, int enable);
 void listview_update_scroll_mark(listview *view);
 void listview_update_overscroll_mark(listview *v, int side, float overscroll);
@@ -0,0 +1,128 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "mem.h"
+
+static const char *tag_names[MEM_TAG_CNT] = {
+    [MEM_TAG_MISC] = "misc",
+    [MEM_TAG_PNG] = "png",
+    [MEM_TAG_STRINGS] = "strings",
+    [MEM_TAG_FB] = "fb",
+    [MEM_TAG_KLOG] = "klog",
+    [MEM_TAG_ROMS] = "roms",
+};
+
+static struct
+{
+    pthread_mutex_t mutex;
+    struct mem_stats stats[MEM_TAG_CNT];
+} mem = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void mem_track(int tag, size_t size)
+{
+    struct mem_stats *st = &mem.stats[tag];
+
+    pthread_mutex_lock(&mem.mutex);
+    st->bytes += size;
+    ++st->count;
+    ++st->allocs;
+    if(st->bytes > st->peak_bytes)
+        st->peak_bytes = st->bytes;
+    pthread_mutex_unlock(&mem.mutex);
+}
+
+void mem_untrack(int tag, size_t size)
+{
+    struct mem_stats *st = &mem.stats[tag];
+
+    pthread_mutex_lock(&mem.mutex);
+    st->bytes -= size;
+    --st->count;
+    pthread_mutex_unlock(&mem.mutex);
+}
+
+void *mem_alloc(int tag, size_t size)
+{
+    void *res = malloc(size);
+    if(res)
+        mem_track(tag, malloc_usable_size(res));
+    return res;
+}
+
+void *mem_zalloc(int tag, size_t size)
+{
+    void *res = calloc(1, size);
+    if(res)
+        mem_track(tag, malloc_usable_size(res));
+    return res;
+}
+
+void *mem_realloc(int tag, void *ptr, size_t size)
+{
+    const size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    void *res = realloc(ptr, size);
+
+    if(!res)
+        return NULL;
+
+    if(ptr)
+        mem_untrack(tag, old_size);
+    mem_track(tag, malloc_usable_size(res));
+    return res;
+}
+
+void mem_free(int tag, void *ptr)
+{
+    if(!ptr)
+        return;
+
+    mem_untrack(tag, malloc_usable_size(ptr));
+    free(ptr);
+}
+
+void mem_get_stats(int tag, struct mem_stats *st)
+{
+    pthread_mutex_lock(&mem.mutex);
+    memcpy(st, &mem.stats[tag], sizeof(struct mem_stats));
+    pthread_mutex_unlock(&mem.mutex);
+}
+
+void mem_dump_stats(void)
+{
+    int i;
+    size_t total = 0;
+    struct mem_stats *st;
+
+    pthread_mutex_lock(&mem.mutex);
+    for(i = 0; i < MEM_TAG_CNT; ++i)
+    {
+        st = &mem.stats[i];
+        total += st->bytes;
+        INFO("mem: %-8s %9u bytes in %5u blocks, peak %9u bytes, %u allocations\n",
+            tag_names[i], (unsigned)st->bytes, st->count, (unsigned)st->peak_bytes, st->allocs);
+    }
+    INFO("mem: %u bytes tracked in total\n", (unsigned)total);
+    pthread_mutex_unlock(&mem.mutex);
+}
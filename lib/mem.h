@@ -0,0 +1,60 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+/*
+ * Tagged allocations, for finding out where the memory goes. The block
+ * sizes are taken from malloc_usable_size(), so a tagged block can still
+ * be released with plain free() - it only throws off the counters.
+ */
+enum
+{
+    MEM_TAG_MISC = 0,
+    MEM_TAG_PNG,
+    MEM_TAG_STRINGS,
+    MEM_TAG_FB,
+    MEM_TAG_KLOG,
+    MEM_TAG_ROMS,
+
+    MEM_TAG_CNT
+};
+
+struct mem_stats
+{
+    size_t bytes;
+    size_t peak_bytes;
+    unsigned count;
+    unsigned allocs;
+};
+
+void *mem_alloc(int tag, size_t size);
+void *mem_zalloc(int tag, size_t size);
+void *mem_realloc(int tag, void *ptr, size_t size);
+void mem_free(int tag, void *ptr);
+
+// for memory which is not from malloc, e.g. mmaped files
+void mem_track(int tag, size_t size);
+void mem_untrack(int tag, size_t size);
+
+void mem_get_stats(int tag, struct mem_stats *st);
+void mem_dump_stats(void);
+
+#endif
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 
 #include "tabview.h"
 #include "containers.h"
@@ -30,18 +31,26 @@ struct tabview_page
 {
     fb_item_pos **items;
     int last_offset;
+    fb_layer *layer;
 };
 
 typedef struct tabview_page tabview_page;
 
 static void tabview_page_destroy(tabview_page *p)
 {
+    fb_layer_destroy(p->layer);
     list_clear(&p->items, NULL);
     free(p);
 }
 
 static void tabview_page_update_offset(tabview_page *p, int offset)
 {
+    if(p->layer)
+    {
+        fb_layer_destroy(p->layer);
+        p->layer = NULL;
+    }
+
     if(!p->items || offset == p->last_offset)
         return;
 
@@ -54,6 +63,89 @@ static void tabview_page_update_offset(tabview_page *p, int offset)
     p->last_offset = offset;
 }
 
+// The part of the page which can show up on the screen: its items, clipped
+// to the tabview and to the screen. Items must be at offset 0.
+static int tabview_page_layer_rect(tabview *t, tabview_page *p, fb_item_pos *r)
+{
+    fb_item_pos **itr;
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+
+    for(itr = p->items; itr && *itr; ++itr)
+    {
+        x0 = imin(x0, (*itr)->x);
+        y0 = imin(y0, (*itr)->y);
+        x1 = imax(x1, (*itr)->x + (*itr)->w);
+        y1 = imax(y1, (*itr)->y + (*itr)->h);
+    }
+
+    x0 = imax(x0, imax(t->x, 0));
+    y0 = imax(y0, imax(t->y, 0));
+    x1 = imin(x1, imin(t->x + t->w, (int)fb_width));
+    y1 = imin(y1, imin(t->y + t->h, (int)fb_height));
+
+    r->x = x0;
+    r->y = y0;
+    r->w = x1 - x0;
+    r->h = y1 - y0;
+    return r->w > 0 && r->h > 0;
+}
+
+// While the page is moving, its items stay at offset 0 and a copy of
+// them is moved instead.
+static void tabview_page_update_layer(tabview *t, tabview_page *p, int offset)
+{
+    fb_item_pos r;
+
+    if(!p->layer)
+        tabview_page_update_offset(p, 0);
+
+    // nothing of it can be seen, let it move on its own
+    if(!tabview_page_layer_rect(t, p, &r))
+    {
+        tabview_page_update_offset(p, offset);
+        return;
+    }
+
+    // items can grow or move within the page, e.g. text being changed
+    if(!p->layer || p->layer->src_x != r.x || p->layer->src_y != r.y ||
+        p->layer->w != r.w || p->layer->h != r.h)
+    {
+        fb_layer_destroy(p->layer);
+        p->layer = fb_layer_create(r.x, r.y, r.w, r.h, p->items);
+    }
+    p->layer->x = r.x + offset;
+}
+
+// Items added to or removed from a page which is being moved have to
+// get into its layer right away, or they would show up at offset 0.
+static void tabview_page_refresh_layer(tabview *t, int page_idx)
+{
+    tabview_page *p;
+    int offset;
+
+    // same lock order as tabview_update_positions(), the batch also lets
+    // fb_layer_create() and fb_layer_destroy() take the items lock again
+    fb_batch_start();
+    pthread_mutex_lock(&t->mutex);
+
+    if(page_idx < t->count)
+    {
+        p = t->pages[page_idx];
+        if(p->layer)
+        {
+            offset = p->layer->x - p->layer->src_x;
+            fb_layer_destroy(p->layer);
+            p->layer = NULL;
+            tabview_page_update_layer(t, p, offset);
+        }
+    }
+
+    pthread_mutex_unlock(&t->mutex);
+    fb_batch_end();
+}
+
+static void tabview_update_positions_priv(tabview *t, int prepare);
+
 int tabview_touch_handler(touch_event *ev, void *data)
 {
     tabview *t = data;
@@ -74,6 +166,13 @@ int tabview_touch_handler(touch_event *ev, void *data)
             anim_cancel(t->anim_id, 0);
             t->anim_id = ANIM_INVALID_ID;
         }
+
+        // copy the pages now, not on the first frame of the swipe
+        if(t->use_layers)
+        {
+            t->touch_layers = 1;
+            tabview_update_positions_priv(t, 1);
+        }
         return -1;
     }
 
@@ -85,6 +184,13 @@ int tabview_touch_handler(touch_event *ev, void *data)
         t->touch_id = -1;
         touch_tracker_finish(t->tracker, ev);
 
+        if(t->touch_layers)
+        {
+            t->touch_layers = 0;
+            if(!t->touch_moving)
+                tabview_update_positions(t);
+        }
+
         if(!t->touch_moving)
             return -1;
 
@@ -119,6 +225,8 @@ int tabview_touch_handler(touch_event *ev, void *data)
 
             tabview_set_active_page(t, page_idx, duration);
         }
+        else
+            tabview_update_positions(t);
         return -1;
     }
 
@@ -128,6 +236,15 @@ int tabview_touch_handler(touch_event *ev, void *data)
 
         if(!t->touch_moving)
         {
+            // the page would have to be copied on every frame while
+            // something in it scrolls
+            if(t->touch_layers && t->tracker->distance_abs_y >= 25*DPI_MUL &&
+                t->tracker->distance_abs_y > t->tracker->distance_abs_x)
+            {
+                t->touch_layers = 0;
+                tabview_update_positions(t);
+            }
+
             if (t->tracker->distance_abs_x >= 25*DPI_MUL && t->tracker->distance_abs_x > t->tracker->distance_abs_y*3)
             {
                 t->touch_moving = 1;
@@ -191,11 +308,16 @@ void tabview_rm_page(tabview *t, int idx)
     if(idx < 0 || idx >= t->count)
         return;
 
+    tabview_page *p = t->pages[idx];
+
     pthread_mutex_lock(&t->mutex);
-    list_rm_at(&t->pages, idx, tabview_page_destroy);
+    list_rm_at(&t->pages, idx, NULL);
     --t->count;
     t->fullW = t->count*t->w;
     pthread_mutex_unlock(&t->mutex);
+
+    // fb_items_lock() can't be taken under t->mutex
+    tabview_page_destroy(p);
 }
 
 void tabview_add_item(tabview *t, int page_idx, void *fb_item)
@@ -206,6 +328,8 @@ void tabview_add_item(tabview *t, int page_idx, void *fb_item)
     pthread_mutex_lock(&t->mutex);
     list_add(&t->pages[page_idx]->items, fb_item);
     pthread_mutex_unlock(&t->mutex);
+
+    tabview_page_refresh_layer(t, page_idx);
 }
 
 void tabview_add_items(tabview *t, int page_idx, void *fb_items)
@@ -216,6 +340,8 @@ void tabview_add_items(tabview *t, int page_idx, void *fb_items)
     pthread_mutex_lock(&t->mutex);
     list_add_from_list(&t->pages[page_idx]->items, fb_items);
     pthread_mutex_unlock(&t->mutex);
+
+    tabview_page_refresh_layer(t, page_idx);
 }
 
 void tabview_rm_item(tabview *t, int page_idx, void *fb_item)
@@ -226,12 +352,21 @@ void tabview_rm_item(tabview *t, int page_idx, void *fb_item)
     pthread_mutex_lock(&t->mutex);
     list_rm(&t->pages[page_idx]->items, fb_item, NULL);
     pthread_mutex_unlock(&t->mutex);
+
+    tabview_page_refresh_layer(t, page_idx);
 }
 
 void tabview_update_positions(tabview *t)
 {
-    int i;
+    tabview_update_positions_priv(t, 0);
+}
+
+// With prepare set, the pages right next to the screen are copied too
+static void tabview_update_positions_priv(tabview *t, int prepare)
+{
+    int i, offset, layered;
     int x = 0;
+    tabview_page *p;
 
     if(t->last_reported_pos != t->pos)
     {
@@ -240,11 +375,26 @@ void tabview_update_positions(tabview *t)
         t->last_reported_pos = t->pos;
     }
 
+    // the pages next to the current one are in layers too until the finger
+    // is lifted, in case it starts a swipe
+    layered = t->use_layers && (t->pos % t->w != 0 || t->touch_layers ||
+        (t->touch_id != -1 && t->touch_moving));
+
     fb_batch_start();
     pthread_mutex_lock(&t->mutex);
     for(i = 0; i < t->count; ++i)
-    {   
-        tabview_page_update_offset(t->pages[i], x - t->pos);
+    {
+        offset = x - t->pos;
+        p = t->pages[i];
+        // a page just off the screen only keeps the copy it has, a new
+        // one would be taken in the middle of the swipe
+        if(layered && ((offset > -t->w && offset < t->w) ||
+            (iabs(offset) == t->w && (prepare || p->layer))))
+        {
+            tabview_page_update_layer(t, p, offset);
+        }
+        else
+            tabview_page_update_offset(p, offset);
         x += t->w;
     }
     pthread_mutex_unlock(&t->mutex);
@@ -48,6 +48,11 @@ typedef struct {
     int touch_id;
     int touch_moving;
     touch_tracker *tracker;
+
+    // draw pages through fb_layers while they move
+    int use_layers;
+    // the pages were put into layers on touch-down, before a swipe starts
+    int touch_layers;
 } tabview;
 
 tabview *tabview_create(int x, int y, int w, int h);
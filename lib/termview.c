@@ -0,0 +1,317 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "termview.h"
+#include "framebuffer.h"
+#include "util.h"
+#include "log.h"
+
+termview *termview_create(int x, int y, int w, int h, int font_size, int max_rows)
+{
+    fb_cell_font *font;
+    termview *v;
+
+    font = fb_cell_font_create(STYLE_MONOSPACE, font_size);
+    if(!font)
+    {
+        ERROR("termview: failed to load monospace font of size %d\n", font_size);
+        return NULL;
+    }
+
+    v = mzalloc(sizeof(termview));
+    v->x = x;
+    v->y = y;
+    v->w = w;
+    v->h = h;
+    v->font = font;
+    v->cols = imax(1, w / font->cell_w);
+    v->rows = imax(1, h / font->cell_h);
+    v->max_rows = imax(max_rows, v->rows);
+    v->cells = malloc(v->max_rows * v->cols);
+    v->lens = mzalloc(v->max_rows * sizeof(uint16_t));
+    v->touch_id = -1;
+    pthread_mutex_init(&v->mutex, NULL);
+
+    termview_set_colors(v, GRAYISH, BLACK);
+
+    // always 4 bytes per pixel cause of fb_img data structure
+    v->img = fb_add_img(LEVEL_PNG, x, y, w, h, FB_IMG_TYPE_GENERIC, malloc(w*h*4));
+    v->dirty = 1;
+    termview_update(v);
+    return v;
+}
+
+void termview_destroy(termview *v)
+{
+    fb_rm_img(v->img);
+    fb_cell_font_destroy(v->font);
+    pthread_mutex_destroy(&v->mutex);
+    free(v->cells);
+    free(v->lens);
+    free(v);
+}
+
+void termview_set_colors(termview *v, uint32_t fg, uint32_t bg)
+{
+    int i, sh, f, b;
+    uint32_t c;
+
+    pthread_mutex_lock(&v->mutex);
+    for(i = 0; i < 256; ++i)
+    {
+        c = 0xFF000000;
+        for(sh = 0; sh < 24; sh += 8)
+        {
+            f = (fg >> sh) & 0xFF;
+            b = (bg >> sh) & 0xFF;
+            c |= (uint32_t)(b + ((f - b)*i)/255) << sh;
+        }
+        v->lut[i] = fb_convert_color_img(c);
+    }
+    v->dirty = 1;
+    pthread_mutex_unlock(&v->mutex);
+}
+
+void termview_clear(termview *v)
+{
+    pthread_mutex_lock(&v->mutex);
+    v->first = v->count = 0;
+    v->open = 0;
+    v->scroll = 0;
+    v->dirty = 1;
+    pthread_mutex_unlock(&v->mutex);
+}
+
+static inline int termview_max_scroll(termview *v)
+{
+    return imax(0, v->count - v->rows);
+}
+
+static int termview_new_row(termview *v)
+{
+    int idx;
+
+    if(v->count < v->max_rows)
+        idx = (v->first + v->count++) % v->max_rows;
+    else
+    {
+        idx = v->first;
+        v->first = (v->first + 1) % v->max_rows;
+    }
+
+    // keep the scrolled-back content in place while new rows come in
+    if(v->scroll > 0)
+        v->scroll = imin(v->scroll + 1, termview_max_scroll(v));
+
+    v->lens[idx] = 0;
+    return idx;
+}
+
+void termview_append(termview *v, const char *text, size_t len)
+{
+    size_t i;
+    char c;
+    int row;
+
+    pthread_mutex_lock(&v->mutex);
+
+    row = v->count ? (v->first + v->count - 1) % v->max_rows : 0;
+
+    for(i = 0; i < len; ++i)
+    {
+        c = text[i];
+        if(c == '\n')
+        {
+            if(!v->open)
+                termview_new_row(v);
+            v->open = 0;
+            continue;
+        }
+
+        if(c == '\r')
+            continue;
+
+        if(c == '\t')
+            c = ' ';
+
+        if(!v->open || v->lens[row] >= v->cols)
+        {
+            row = termview_new_row(v);
+            v->open = 1;
+        }
+
+        v->cells[row * v->cols + v->lens[row]++] = c;
+    }
+
+    v->dirty = 1;
+    pthread_mutex_unlock(&v->mutex);
+}
+
+void termview_append_tail(termview *v, const char *text, size_t len)
+{
+    // Every line takes at least one row, so there is no point in going
+    // further back than max_rows line breaks.
+    const char *itr = text + len;
+    int lines = 0;
+
+    while(itr > text)
+    {
+        if(*(itr-1) == '\n' && ++lines > v->max_rows)
+            break;
+        --itr;
+    }
+
+    termview_append(v, itr, len - (itr - text));
+}
+
+void termview_scroll_by(termview *v, int rows)
+{
+    int scroll;
+
+    pthread_mutex_lock(&v->mutex);
+    scroll = imin(imax(v->scroll + rows, 0), termview_max_scroll(v));
+    if(scroll != v->scroll)
+    {
+        v->scroll = scroll;
+        v->dirty = 1;
+    }
+    pthread_mutex_unlock(&v->mutex);
+}
+
+void termview_scroll_to_bottom(termview *v)
+{
+    pthread_mutex_lock(&v->mutex);
+    if(v->scroll != 0)
+    {
+        v->scroll = 0;
+        v->dirty = 1;
+    }
+    pthread_mutex_unlock(&v->mutex);
+}
+
+static void termview_render(termview *v)
+{
+    int r, c, x, y, top, idx, len;
+    uint32_t *dst, *cell_dst;
+    const uint8_t *glyph;
+    const char *row;
+    const int stride = v->img->w;
+    const int cell_w = v->font->cell_w;
+    const int cell_h = v->font->cell_h;
+    const int cell_sz = cell_w * cell_h;
+    const uint32_t bg = v->lut[0];
+
+    dst = (uint32_t*)v->img->data;
+    for(x = 0; x < v->img->w * v->img->h; ++x)
+        dst[x] = bg;
+
+    top = imax(0, v->count - v->rows - v->scroll);
+
+    for(r = 0; r < v->rows && top + r < v->count; ++r)
+    {
+        idx = (v->first + top + r) % v->max_rows;
+        row = v->cells + idx * v->cols;
+        len = v->lens[idx];
+
+        for(c = 0; c < len; ++c)
+        {
+            const unsigned char ch = row[c];
+            if(ch < FB_CELL_FIRST || ch > FB_CELL_LAST || v->font->empty[ch - FB_CELL_FIRST])
+                continue;
+
+            glyph = v->font->coverage + (ch - FB_CELL_FIRST)*cell_sz;
+            cell_dst = dst + (r*cell_h)*stride + c*cell_w;
+
+            for(y = 0; y < cell_h; ++y)
+            {
+                for(x = 0; x < cell_w; ++x)
+                    if(glyph[x])
+                        cell_dst[x] = v->lut[glyph[x]];
+
+                glyph += cell_w;
+                cell_dst += stride;
+            }
+        }
+    }
+}
+
+int termview_update(termview *v)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&v->mutex);
+    if(v->dirty)
+    {
+        fb_items_lock();
+        termview_render(v);
+        fb_layer_item_changed(v->img);
+        fb_items_unlock();
+
+        v->dirty = 0;
+        res = 1;
+    }
+    pthread_mutex_unlock(&v->mutex);
+
+    if(res)
+        fb_request_draw();
+    return res;
+}
+
+int termview_touch_handler(touch_event *ev, void *data)
+{
+    termview *v = data;
+    int rows;
+
+    if(v->touch_id == -1 && (ev->changed & TCHNG_ADDED) && !ev->consumed)
+    {
+        if(!in_rect(ev->x, ev->y, v->x, v->y, v->w, v->h))
+            return -1;
+
+        v->touch_id = ev->id;
+        v->touch_last_y = ev->y;
+        v->touch_acc = 0;
+        return 0;
+    }
+
+    if(v->touch_id != ev->id)
+        return -1;
+
+    if(ev->changed & TCHNG_REMOVED)
+    {
+        v->touch_id = -1;
+        return 0;
+    }
+
+    if(ev->changed & TCHNG_POS)
+    {
+        v->touch_acc += ev->y - v->touch_last_y;
+        v->touch_last_y = ev->y;
+
+        rows = v->touch_acc / v->font->cell_h;
+        if(rows != 0)
+        {
+            v->touch_acc -= rows * v->font->cell_h;
+            termview_scroll_by(v, rows);
+            termview_update(v);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TERMVIEW_H
+#define TERMVIEW_H
+
+#include <pthread.h>
+#include "framebuffer.h"
+#include "input.h"
+
+/*
+ * Terminal-like monospace text view. Text is kept in a circular buffer
+ * of fixed-width rows (long lines are wrapped), and only the rows which
+ * are visible are drawn from a fb_cell_font into a single fb_img.
+ */
+typedef struct
+{
+    FB_ITEM_POS
+
+    fb_img *img;
+    fb_cell_font *font;
+    uint32_t lut[256]; // glyph coverage -> img pixel
+
+    int cols, rows;    // visible grid
+    int max_rows;      // capacity of the ring
+    char *cells;       // max_rows * cols characters
+    uint16_t *lens;
+    int first;         // ring index of the oldest row
+    int count;
+    int open;          // last row isn't terminated yet
+    int scroll;        // rows scrolled back from the bottom
+    int dirty;
+
+    int touch_id;
+    int touch_last_y;
+    int touch_acc;
+
+    pthread_mutex_t mutex;
+} termview;
+
+termview *termview_create(int x, int y, int w, int h, int font_size, int max_rows);
+void termview_destroy(termview *v);
+void termview_set_colors(termview *v, uint32_t fg, uint32_t bg);
+void termview_clear(termview *v);
+void termview_append(termview *v, const char *text, size_t len);
+void termview_append_tail(termview *v, const char *text, size_t len);
+void termview_scroll_by(termview *v, int rows);
+void termview_scroll_to_bottom(termview *v);
+int termview_update(termview *v);
+int termview_touch_handler(touch_event *ev, void *data);
+
+#endif
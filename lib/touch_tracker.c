@@ -21,6 +21,9 @@
 #include "touch_tracker.h"
 #include "util.h"
 
+// how far back from the release the velocity is measured
+#define RELEASE_WINDOW_US 80000
+
 touch_tracker *touch_tracker_create(void)
 {
     touch_tracker *t = mzalloc(sizeof(touch_tracker));
@@ -32,6 +35,17 @@ void touch_tracker_destroy(touch_tracker *t)
     free(t);
 }
 
+static void touch_tracker_add_sample(touch_tracker *t, touch_event *ev)
+{
+    struct touch_tracker_sample *s = &t->samples[t->samples_next];
+    memcpy(&s->time, &ev->time, sizeof(struct timeval));
+    s->x = ev->x;
+    s->y = ev->y;
+    t->samples_next = (t->samples_next + 1) % TRACKER_SAMPLES;
+    if(t->samples_cnt < TRACKER_SAMPLES)
+        ++t->samples_cnt;
+}
+
 void touch_tracker_start(touch_tracker *t, touch_event *ev)
 {
     t->distance_abs_x = t->distance_abs_y = 0;
@@ -43,10 +57,13 @@ void touch_tracker_start(touch_tracker *t, touch_event *ev)
     t->prev_x = ev->x;
     t->prev_y = ev->y;
     memcpy(&t->time_start, &ev->time, sizeof(struct timeval));
+    t->samples_cnt = t->samples_next = 0;
+    touch_tracker_add_sample(t, ev);
 }
 
 void touch_tracker_finish(touch_tracker *t, touch_event *ev)
 {
+    memcpy(&t->time_end, &ev->time, sizeof(struct timeval));
     t->period = timeval_us_diff(ev->time, t->time_start);
 }
 
@@ -60,6 +77,7 @@ void touch_tracker_add(touch_tracker *t, touch_event *ev)
     t->distance_abs_y += iabs(ev->y - t->last_y);
     t->last_x = ev->x;
     t->last_y = ev->y;
+    touch_tracker_add_sample(t, ev);
 }
 
 float touch_tracker_get_velocity(touch_tracker *t, int axis)
@@ -77,3 +95,32 @@ float touch_tracker_get_velocity_abs(touch_tracker *t, int axis)
     else
         return ((((float)t->distance_abs_y) / t->period) * 1000000) / DPI_MUL;
 }
+
+// Velocity over the last RELEASE_WINDOW_US before touch_tracker_finish(),
+// so a finger which stopped before it was lifted has none. There are no
+// events while the finger doesn't move, so the newest sample older than
+// the window is where the finger was when the window started.
+float touch_tracker_get_release_velocity(touch_tracker *t, int axis)
+{
+    const struct touch_tracker_sample *last, *from = NULL;
+    int64_t age = 0;
+    int i, dist;
+
+    if(t->samples_cnt == 0)
+        return 0.f;
+
+    last = &t->samples[(t->samples_next + TRACKER_SAMPLES - 1) % TRACKER_SAMPLES];
+    for(i = 1; i <= t->samples_cnt; ++i)
+    {
+        from = &t->samples[(t->samples_next + TRACKER_SAMPLES - i) % TRACKER_SAMPLES];
+        age = timeval_us_diff(t->time_end, from->time);
+        if(age >= RELEASE_WINDOW_US)
+            break;
+    }
+
+    if(from == last || age <= 0)
+        return 0.f;
+
+    dist = axis == TRACKER_X ? last->x - from->x : last->y - from->y;
+    return ((((float)dist) / age) * 1000000) / DPI_MUL;
+}
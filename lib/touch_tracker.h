@@ -25,15 +25,28 @@
 #define TRACKER_X 0
 #define TRACKER_Y 1
 
+#define TRACKER_SAMPLES 16
+
+struct touch_tracker_sample
+{
+    struct timeval time;
+    int x, y;
+};
+
 typedef struct
 {
     struct timeval time_start;
+    struct timeval time_end;
     int64_t period;
     int distance_x, distance_y;
     int distance_abs_x, distance_abs_y;
     int last_x, last_y;
     int prev_x, prev_y;
     int start_x, start_y;
+
+    // the last positions, for the velocity at release
+    struct touch_tracker_sample samples[TRACKER_SAMPLES];
+    int samples_cnt, samples_next;
 } touch_tracker;
 
 touch_tracker *touch_tracker_create(void);
@@ -43,5 +56,6 @@ void touch_tracker_finish(touch_tracker *t, touch_event *ev);
 void touch_tracker_add(touch_tracker *t, touch_event *ev);
 float touch_tracker_get_velocity(touch_tracker *t, int axis);
 float touch_tracker_get_velocity_abs(touch_tracker *t, int axis);
+float touch_tracker_get_release_velocity(touch_tracker *t, int axis);
 
 #endif
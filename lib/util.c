@@ -24,9 +24,9 @@
 #include <time.h>
 #include <dirent.h>
 #include <fcntl.h>
-#include <cutils/android_reboot.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <pthread.h>
 
 #ifdef HAVE_SELINUX
 #include <selinux/label.h>
@@ -42,8 +42,8 @@
 #include <sys/syscall.h>
 #include <sys/reboot.h>
 #include <linux/loop.h>
+#include <linux/reboot.h>
 
-#include <private/android_filesystem_config.h>
 
 #include "log.h"
 #include "util.h"
@@ -318,9 +318,52 @@ int write_file(const char *path, const char *value)
     }
 }
 
+// Replaces the file through a fsynced temporary file, so that readers
+// see either the old or the new contents. Does nothing if the contents
+// are the same already.
+int write_file_if_changed(const char *path, const void *data, size_t size)
+{
+    char tmp_path[256];
+    struct stat info;
+    char *old;
+    FILE *f;
+    int ok;
+
+    if(stat(path, &info) >= 0 && (size_t)info.st_size == size)
+    {
+        old = malloc(size ? size : 1);
+        f = fopen(path, "re");
+        ok = f && fread(old, 1, size, f) == size && memcmp(old, data, size) == 0;
+        if(f)
+            fclose(f);
+        free(old);
+        if(ok)
+            return 0;
+    }
+
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+        return -1;
+
+    f = fopen(tmp_path, "we");
+    if(!f)
+    {
+        ERROR("Failed to open file %s (%d: %s)\n", tmp_path, errno, strerror(errno));
+        return -1;
+    }
+
+    ok = fwrite(data, 1, size, f) == size && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if(fclose(f) != 0 || !ok || rename(tmp_path, path) < 0)
+    {
+        ERROR("Failed to write file %s (%d: %s)\n", path, errno, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
 int remove_dir(const char *dir)
 {
-    struct DIR *d = opendir(dir);
+    DIR *d = opendir(dir);
     if(!d)
         return -1;
 
@@ -712,11 +755,89 @@ int strendswith(const char *haystack, const char *needle)
     return strncmp(haystack + h_len - n_len, needle, n_len) == 0;
 }
 
-int create_loop_device(const char *dev_path, const char *img_path, int loop_num, int loop_chmod)
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+    uint32_t fd;
+    uint32_t block_size;
+    struct loop_info64 info;
+    uint64_t __reserved[8];
+};
+#endif
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_ADD 0x4C80
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+
+#define LOOP_CONTROL_PATH "/dev/loop-control"
+#define LOOP_CONTROL_MINOR 237
+
+#define EXT_SB_OFFSET 1024
+#define EXT_SB_LOG_BLOCK_SIZE 24
+#define EXT_SB_MAGIC 56
+#define EXT_MAGIC 0xEF53
+
+// Loop block size matching the filesystem's block size, so that the loop
+// device can do direct I/O in whole blocks. Only ext* images are recognized.
+static uint32_t loop_image_block_size(int file_fd)
+{
+    uint16_t magic;
+    uint32_t log_size;
+
+    if(pread(file_fd, &magic, sizeof(magic), EXT_SB_OFFSET + EXT_SB_MAGIC) != sizeof(magic) || magic != EXT_MAGIC)
+        return 512;
+
+    if(pread(file_fd, &log_size, sizeof(log_size), EXT_SB_OFFSET + EXT_SB_LOG_BLOCK_SIZE) != sizeof(log_size))
+        return 512;
+
+    // 1024 << log_size, loop supports 512 up to the page size
+    return log_size <= 2 ? (1024 << log_size) : 4096;
+}
+
+// Binds the file to the loop device, with direct I/O so that the image's
+// pages aren't cached twice, once for the file and once for the loop device.
+static int loop_configure(int device_fd, int file_fd, int read_only, const char *dev_path)
+{
+    struct loop_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.fd = file_fd;
+    config.block_size = loop_image_block_size(file_fd);
+    config.info.lo_flags = LO_FLAGS_DIRECT_IO;
+    if(read_only)
+        config.info.lo_flags |= LO_FLAGS_READ_ONLY;
+
+    if(ioctl(device_fd, LOOP_CONFIGURE, &config) >= 0)
+        return 0;
+
+    // kernels older than 5.8 don't have LOOP_CONFIGURE, the read-only flag
+    // comes from the file's open mode there.
+    if (ioctl(device_fd, LOOP_SET_FD, file_fd) < 0)
+    {
+        ERROR("ioctl LOOP_SET_FD failed on %s (%d: %s)\n", dev_path, errno, strerror(errno));
+        return -1;
+    }
+
+    // both are optional, the device works without them
+    ioctl(device_fd, LOOP_SET_BLOCK_SIZE, (unsigned long)config.block_size);
+    ioctl(device_fd, LOOP_SET_DIRECT_IO, 1UL);
+    return 0;
+}
+
+static int loop_attach(const char *dev_path, const char *img_path, int loop_num, int loop_chmod, int read_only)
 {
     int file_fd, device_fd, res = -1;
 
-    file_fd = open(img_path, O_RDWR | O_CLOEXEC);
+    file_fd = open(img_path, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
     if (file_fd < 0) {
         ERROR("Failed to open image %s\n", img_path);
         return -1;
@@ -742,11 +863,8 @@ int create_loop_device(const char *dev_path, const char *img_path, int loop_num,
         goto close_file;
     }
 
-    if (ioctl(device_fd, LOOP_SET_FD, file_fd) < 0)
-    {
-        ERROR("ioctl LOOP_SET_FD failed on %s (%d: %s)\n", dev_path, errno, strerror(errno));
+    if (loop_configure(device_fd, file_fd, read_only, dev_path) < 0)
         goto close_dev;
-    }
 
     res = 0;
 close_dev:
@@ -756,13 +874,22 @@ close_file:
     return res;
 }
 
+int create_loop_device(const char *dev_path, const char *img_path, int loop_num, int loop_chmod)
+{
+    return loop_attach(dev_path, img_path, loop_num, loop_chmod, 0);
+}
+
 #define MAX_LOOP_NUM 1023
-int mount_image(const char *src, const char *dst, const char *fs, int flags, const void *data)
+
+// Images may be mounted from several threads, the free number must not
+// be handed out again until the device is bound.
+static pthread_mutex_t loop_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Probes the loop devices one by one, for when /dev/loop-control isn't available
+static int loop_scan_free(int loop_num)
 {
     char path[64];
     int device_fd;
-    int loop_num = 0;
-    int res = -1;
     struct stat info;
     struct loop_info64 lo_info;
 
@@ -784,14 +911,72 @@ int mount_image(const char *src, const char *dst, const char *fs, int flags, con
         }
     }
 
-    if(loop_num == MAX_LOOP_NUM)
+    return loop_num < MAX_LOOP_NUM ? loop_num : -1;
+}
+
+static int loop_control_open(void)
+{
+    int fd = open(LOOP_CONTROL_PATH, O_RDWR | O_CLOEXEC);
+    if(fd < 0 && errno == ENOENT &&
+        mknod(LOOP_CONTROL_PATH, S_IFCHR | 0600, makedev(10, LOOP_CONTROL_MINOR)) >= 0)
+    {
+        fd = open(LOOP_CONTROL_PATH, O_RDWR | O_CLOEXEC);
+    }
+    return fd;
+}
+
+// Returns a free loop device number which is at least min_num, or -1
+static int loop_find_free(int min_num)
+{
+    int ctl, loop_num;
+
+    ctl = loop_control_open();
+    if(ctl < 0)
+        return loop_scan_free(min_num);
+
+    loop_num = ioctl(ctl, LOOP_CTL_GET_FREE);
+    if(loop_num < min_num)
+    {
+        // GET_FREE returns the lowest free one, so ask the kernel to create
+        // the device with the number we want instead.
+        for(loop_num = min_num; loop_num < MAX_LOOP_NUM; ++loop_num)
+        {
+            if(ioctl(ctl, LOOP_CTL_ADD, loop_num) >= 0)
+                break;
+
+            if(errno != EEXIST)
+            {
+                loop_num = loop_scan_free(min_num);
+                break;
+            }
+        }
+    }
+    close(ctl);
+
+    return loop_num < MAX_LOOP_NUM ? loop_num : -1;
+}
+
+int mount_image(const char *src, const char *dst, const char *fs, int flags, const void *data)
+{
+    char path[64];
+    int loop_num;
+    int res = -1;
+
+    pthread_mutex_lock(&loop_mutex);
+    loop_num = loop_find_free(0);
+    if(loop_num < 0)
     {
+        pthread_mutex_unlock(&loop_mutex);
         ERROR("mount_image: failed to find suitable loop device number!\n");
         return -1;
     }
 
-    if(create_loop_device(path, src, loop_num, 0777) < 0)
+    sprintf(path, "/dev/block/loop%d", loop_num);
+    res = loop_attach(path, src, loop_num, 0777, (flags & MS_RDONLY) != 0);
+    pthread_mutex_unlock(&loop_mutex);
+    if(res < 0)
         return -1;
+    res = -1;
 
     if(mount(path, dst, fs, flags, data) < 0)
         ERROR("Failed to mount loop (%d: %s)\n", errno, strerror(errno));
@@ -807,32 +992,14 @@ int multirom_mount_image(const char *src, const char *dst, const char *fs, int f
 {
     static int next_loop_num = MULTIROM_LOOP_NUM_START;
     char path[64];
-    int device_fd;
     int loop_num = 0;
     int res = -1;
-    struct stat info;
-    struct loop_info64 lo_info;
-
-    for(loop_num = next_loop_num; loop_num < MAX_LOOP_NUM; ++loop_num)
-    {
-        sprintf(path, "/dev/block/loop%d", loop_num);
-        if(stat(path, &info) < 0)
-        {
-            if(errno == ENOENT)
-                break;
-        }
-        else if(S_ISBLK(info.st_mode) && (device_fd = open(path, O_RDWR | O_CLOEXEC)) >= 0)
-        {
-            int ioctl_res = ioctl(device_fd, LOOP_GET_STATUS64, &lo_info);
-            close(device_fd);
-
-            if (ioctl_res < 0 && errno == ENXIO)
-                break;
-        }
-    }
 
-    if(loop_num == MAX_LOOP_NUM)
+    pthread_mutex_lock(&loop_mutex);
+    loop_num = loop_find_free(next_loop_num);
+    if(loop_num < 0)
     {
+        pthread_mutex_unlock(&loop_mutex);
         ERROR("mount_image: failed to find suitable loop device number!\n");
         return -1;
     }
@@ -842,11 +1009,12 @@ int multirom_mount_image(const char *src, const char *dst, const char *fs, int f
     sprintf(path, MULTIROM_DEV_PATH "/%s", dst);
 
 create_loop:
-    if(create_loop_device(path, src, loop_num, 0777) < 0)
+    if(loop_attach(path, src, loop_num, 0777, (flags & MS_RDONLY) != 0) < 0)
         res = -1;
 
     // never reuse an existing loop
     next_loop_num = loop_num + 1;
+    pthread_mutex_unlock(&loop_mutex);
 
     if(mount(path, dst, fs, flags, data) < 0)
         ERROR("Failed to mount loop (%d: %s)\n", errno, strerror(errno));
@@ -857,6 +1025,7 @@ create_loop:
         if (loop_num == MULTIROM_LOOP_NUM_START)
             loop_num = 0;
         sprintf(path, "/dev/block/loop%d", loop_num);
+        pthread_mutex_lock(&loop_mutex);
         goto create_loop;
     }
 
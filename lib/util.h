@@ -17,6 +17,7 @@
 #ifndef _INIT_UTIL_H_
 #define _INIT_UTIL_H_
 
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -43,6 +44,7 @@ int copy_file(const char *from, const char *to);
 int copy_dir(const char *from, const char *to);
 int mkdir_with_perms(const char *path, mode_t mode, const char *owner, __unused const char *group);
 int write_file(const char *path, const char *value);
+int write_file_if_changed(const char *path, const void *data, size_t size);
 int remove_dir(const char *dir);
 int run_cmd(char **cmd);
 int run_cmd_with_env(char **cmd, char *const *envp);
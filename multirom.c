@@ -31,7 +31,12 @@
 #include <sys/statvfs.h>
 #include <linux/loop.h>
 #include <ctype.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <cutils/uevent.h>
 
 // clone libbootimg to /system/extras/ from
 // https://github.com/Tasssadar/libbootimg.git
@@ -46,14 +51,17 @@
 #include "lib/inject.h"
 #include "lib/input.h"
 #include "lib/log.h"
+#include "lib/mem.h"
 #include "lib/util.h"
 #include "lib/mrom_data.h"
+#include "lib/termview.h"
 #include "multirom.h"
 #include "multirom_ui.h"
 #include "version.h"
 #include "hooks.h"
 #include "rom_quirks.h"
 #include "kexec.h"
+#include "status_snapshot.h"
 
 #ifdef MR_NO_KEXEC
 #include "no_kexec.h"
@@ -65,12 +73,11 @@
 #define KEXEC_BIN "kexec"
 #define NTFS_BIN "ntfs-3g"
 #define EXFAT_BIN "exfat-fuse"
-#define INTERNAL_ROM_NAME "Internal"
-#define MAX_ROM_NAME_LEN 26
 #define LAYOUT_VERSION "/data/.layout_version"
 
 #define BATTERY_CAP "/sys/class/power_supply/battery/capacity"
 #define DT_FSTAB_PATH "/proc/device-tree/firmware/android/fstab/"
+#define EMERGENCY_LOG_ROWS 2000
 
 static char busybox_path[64] = { 0 };
 static char kexec_path[64] = { 0 };
@@ -431,6 +438,8 @@ int multirom(const char *rom_to_boot)
         // any time when the UI is up
         multirom_has_kexec();
 
+        multirom_kexec_spec_start(&s);
+
         switch(multirom_ui(&s, &to_boot))
         {
             case UI_EXIT_BOOT_ROM: break;
@@ -447,6 +456,8 @@ int multirom(const char *rom_to_boot)
                 exit = (EXIT_SHUTDOWN | EXIT_UMOUNT);
                 break;
         }
+
+        multirom_kexec_spec_finish(to_boot);
     }
 
     if(to_boot)
@@ -545,6 +556,9 @@ finish:
     multirom_save_status(&s);
     multirom_free_status(&s);
 
+    // everything should have been released by now, what is left leaked
+    mem_dump_stats();
+
     sync();
 
     return exit;
@@ -565,11 +579,9 @@ int multirom_init_fb(int rotation)
 void multirom_emergency_reboot(void)
 {
     char *klog;
-    fb_text_proto *p;
     fb_img *t;
-    char *tail;
-    char *last_end;
-    int cur_y;
+    termview *log_view;
+    int key;
     char path_log_file[64];
 
     if(multirom_init_fb(0) < 0)
@@ -589,47 +601,46 @@ void multirom_emergency_reboot(void)
     t = fb_add_text(0, t->y + t->h + 100*DPI_MUL, GRAYISH, SIZE_SMALL, "Last lines from klog:");
     fb_add_rect(0, t->y + t->h + 5*DPI_MUL, fb_width, 1, GRAYISH);
 
-    tail = klog+strlen(klog);
-    last_end = tail;
-    cur_y = fb_height;
-    const int start_y = (t->y + t->h + 2);
-    while(tail > klog)
+    const int start_y = (t->y + t->h + 5*DPI_MUL + 2);
+    log_view = termview_create(0, start_y, fb_width, fb_height - start_y, 4*4, EMERGENCY_LOG_ROWS);
+    if(log_view && klog)
     {
-        --tail;
-        if(*tail == '\n')
-        {
-            p = fb_text_create(0, cur_y, GRAYISH, 4*4, NULL);
-            p->text = malloc(last_end - tail);
-            memcpy(p->text, tail + 1, last_end - (tail + 1));
-            p->text[last_end - (tail + 1)] = 0;
-            p->style = STYLE_MONOSPACE;
-            t = fb_text_finalize(p);
-
-            cur_y -= t->h;
-            t->y = cur_y;
-            last_end = tail;
-
-            if(cur_y < start_y)
-            {
-                fb_rm_text(t);
-                break;
-            }
-        }
+        termview_append_tail(log_view, klog, strlen(klog));
+        termview_update(log_view);
     }
 
     fb_force_draw();
 
     sprintf(path_log_file, "%s/multirom_log.txt", datamedia_dir);
     multirom_copy_log(klog, path_log_file);
-    free(klog);
+    mem_free(MEM_TAG_KLOG, klog);
 
     set_mediarw_perms(path_log_file);
 
-    // Wait for power key
+    // Wait for power key, volume keys scroll the log
     start_input_thread();
-    while(wait_for_key() != KEY_POWER);
+    if(log_view)
+        add_touch_handler(&termview_touch_handler, log_view);
+
+    while((key = wait_for_key()) != KEY_POWER)
+    {
+        if(!log_view)
+            continue;
+
+        if(key == KEY_VOLUMEUP)
+            termview_scroll_by(log_view, log_view->rows/2);
+        else if(key == KEY_VOLUMEDOWN)
+            termview_scroll_by(log_view, -log_view->rows/2);
+        termview_update(log_view);
+    }
+
+    if(log_view)
+        rm_touch_handler(&termview_touch_handler, log_view);
     stop_input_thread();
 
+    if(log_view)
+        termview_destroy(log_view);
+
     fb_clear();
     fb_close();
 }
@@ -778,8 +789,7 @@ int multirom_apk_get_roms(struct multirom_status *s)
 
             //printf("Adding ROM %s\n", dr->d_name);
 
-            struct multirom_rom *rom = malloc(sizeof(struct multirom_rom));
-            memset(rom, 0, sizeof(struct multirom_rom));
+            struct multirom_rom *rom = mem_zalloc(MEM_TAG_ROMS, sizeof(struct multirom_rom));
 
             rom->id = multirom_generate_rom_id();
             rom->name = strdup(dr->d_name);
@@ -833,7 +843,7 @@ int multirom_apk_get_roms(struct multirom_status *s)
     return 0;
 }
 
-int multirom_default_status(struct multirom_status *s)
+static void multirom_default_settings(struct multirom_status *s)
 {
     s->is_second_boot = 0;
     s->current_rom = NULL;
@@ -847,6 +857,11 @@ int multirom_default_status(struct multirom_status *s)
     s->enable_kmsg_logging = 0;
     s->rotation = MULTIROM_DEFAULT_ROTATION;
     s->anim_duration_coef = 1.f;
+}
+
+int multirom_default_status(struct multirom_status *s)
+{
+    multirom_default_settings(s);
 
     s->fstab = fstab_auto_load();
     if(!s->fstab)
@@ -890,8 +905,7 @@ int multirom_default_status(struct multirom_status *s)
 
         INFO("Adding ROM %s\n", dr->d_name);
 
-        struct multirom_rom *rom = malloc(sizeof(struct multirom_rom));
-        memset(rom, 0, sizeof(struct multirom_rom));
+        struct multirom_rom *rom = mem_zalloc(MEM_TAG_ROMS, sizeof(struct multirom_rom));
 
         rom->id = multirom_generate_rom_id();
         rom->name = strdup(dr->d_name);
@@ -934,19 +948,8 @@ int multirom_default_status(struct multirom_status *s)
     return 0;
 }
 
-int multirom_load_status(struct multirom_status *s)
+static int multirom_parse_ini(struct multirom_status *s, char *current_rom, char *auto_boot_rom)
 {
-    INFO("Loading MultiROM status...\n");
-
-    multirom_default_status(s);
-
-    if(mrom_is_second_boot())
-        s->is_second_boot = 1;
-
-    // is_second_boot might be reset later, but we need to know if this
-    // is second boot when filling in kexec info
-    s->is_running_in_primary_rom = !s->is_second_boot;
-
     char arg[256];
     sprintf(arg, "%s/multirom.ini", mrom_dir());
 
@@ -958,9 +961,6 @@ int multirom_load_status(struct multirom_status *s)
     }
 
     char line[1024];
-    char current_rom[256] = { 0 };
-    char auto_boot_rom[256] = { 0 };
-
     char name[64];
     char *pch;
 
@@ -1009,13 +1009,48 @@ int multirom_load_status(struct multirom_status *s)
 
     fclose(f);
 
+    return 0;
+}
+
+int multirom_load_status(struct multirom_status *s)
+{
+    char current_rom[256] = { 0 };
+    char auto_boot_rom[256] = { 0 };
+    int from_snapshot;
+
+    INFO("Loading MultiROM status...\n");
+
+    multirom_default_settings(s);
+
+    from_snapshot = status_snapshot_load(s, current_rom, auto_boot_rom, sizeof(current_rom)) >= 0;
+    if(from_snapshot)
+    {
+        INFO("Using status snapshot\n");
+        s->fstab = fstab_auto_load();
+    }
+    else
+        multirom_default_status(s);
+
+    if(mrom_is_second_boot())
+        s->is_second_boot = 1;
+
+    // is_second_boot might be reset later, but we need to know if this
+    // is second boot when filling in kexec info
+    s->is_running_in_primary_rom = !s->is_second_boot;
+
+    if(!from_snapshot && multirom_parse_ini(s, current_rom, auto_boot_rom) < 0)
+        return -1;
+
     // find USB drive if we're booting from it
     if(s->curr_rom_part) // && s->is_second_boot)
     {
         multirom_update_and_scan_for_external_roms(s, s->curr_rom_part);
     }
 
-    s->current_rom = multirom_get_rom(s, current_rom, s->curr_rom_part);
+    // the snapshot already resolved the internal ROMs through its index
+    if(!from_snapshot || s->curr_rom_part)
+        s->current_rom = multirom_get_rom(s, current_rom, s->curr_rom_part);
+
     if(!s->current_rom)
     {
         ERROR("Failed to select current rom (%s, part %s), using Internal!\n", current_rom, s->curr_rom_part);
@@ -1035,7 +1070,8 @@ int multirom_load_status(struct multirom_status *s)
     }
     else
     {
-        s->auto_boot_rom = multirom_get_rom(s, auto_boot_rom, NULL);
+        if(!from_snapshot || s->curr_rom_part)
+            s->auto_boot_rom = multirom_get_rom(s, auto_boot_rom, NULL);
         if(!s->auto_boot_rom)
             ERROR("Could not find rom %s to auto-boot\n", auto_boot_rom);
     }
@@ -1055,45 +1091,71 @@ int multirom_load_status(struct multirom_status *s)
     return 0;
 }
 
+static int multirom_ini_printf(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+    va_list ap;
+    int res;
+
+    va_start(ap, fmt);
+    res = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+
+    if(res < 0 || (size_t)res >= size - *len)
+        return -1;
+    *len += res;
+    return 0;
+}
+
 int multirom_save_status(struct multirom_status *s)
 {
     INFO("Saving multirom status\n");
 
     char path[256];
+    char buf[4096];
+    size_t len = 0;
+    int res = 0;
     char auto_boot_name[MAX_ROM_NAME_LEN+1];
     char current_name[MAX_ROM_NAME_LEN+1];
 
     snprintf(path, sizeof(path), "%s/multirom.ini", mrom_dir());
 
-    FILE *f = fopen(path, "we");
-    if(!f)
-    {
-        ERROR("Failed to open/create status file!\n");
-        return -1;
-    }
-
     multirom_fixup_rom_name(s->auto_boot_rom, auto_boot_name, "");
     multirom_fixup_rom_name(s->current_rom, current_name, INTERNAL_ROM_NAME);
 
-    fprintf(f, "current_rom=%s\n", current_name);
-    fprintf(f, "auto_boot_seconds=%d\n", s->auto_boot_seconds);
-    fprintf(f, "auto_boot_rom=%s\n", auto_boot_name);
-    fprintf(f, "auto_boot_type=%d\n", s->auto_boot_type);
-    fprintf(f, "curr_rom_part=%s\n", s->curr_rom_part ? s->curr_rom_part : "");
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "current_rom=%s\n", current_name);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "auto_boot_seconds=%d\n", s->auto_boot_seconds);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "auto_boot_rom=%s\n", auto_boot_name);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "auto_boot_type=%d\n", s->auto_boot_type);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "curr_rom_part=%s\n", s->curr_rom_part ? s->curr_rom_part : "");
 #ifdef MR_NO_KEXEC
-    fprintf(f, "no_kexec=%d\n", s->no_kexec);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "no_kexec=%d\n", s->no_kexec);
 #endif
-    fprintf(f, "colors_v2=%d\n", s->colors);
-    fprintf(f, "brightness=%d\n", s->brightness);
-    fprintf(f, "enable_adb=%d\n", s->enable_adb);
-    fprintf(f, "enable_kmsg_logging=%d\n", s->enable_kmsg_logging);
-    fprintf(f, "hide_internal=%d\n", s->hide_internal);
-    fprintf(f, "int_display_name=%s\n", s->int_display_name ? s->int_display_name : "");
-    fprintf(f, "rotation=%d\n", s->rotation);
-    fprintf(f, "force_generic_fb=%d\n", s->force_generic_fb);
-    fprintf(f, "anim_duration_coef_pct=%d\n", (int)(s->anim_duration_coef*100));
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "colors_v2=%d\n", s->colors);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "brightness=%d\n", s->brightness);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "enable_adb=%d\n", s->enable_adb);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "enable_kmsg_logging=%d\n", s->enable_kmsg_logging);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "hide_internal=%d\n", s->hide_internal);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "int_display_name=%s\n", s->int_display_name ? s->int_display_name : "");
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "rotation=%d\n", s->rotation);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "force_generic_fb=%d\n", s->force_generic_fb);
+    res |= multirom_ini_printf(buf, sizeof(buf), &len, "anim_duration_coef_pct=%d\n", (int)(s->anim_duration_coef*100));
+
+    if(res < 0)
+    {
+        ERROR("Status file is too long!\n");
+        return -1;
+    }
 
-    fclose(f);
+    // the ini is rewritten only when something changed, so that the
+    // snapshot written along with it stays valid across boots
+    if(write_file_if_changed(path, buf, len) < 0)
+    {
+        ERROR("Failed to write status file!\n");
+        return -1;
+    }
+
+    if(status_snapshot_store(s) < 0)
+        ERROR("Failed to write status snapshot!\n");
     return 0;
 }
 
@@ -1163,7 +1225,7 @@ void multirom_free_rom(void *rom)
     free(((struct multirom_rom*)rom)->name);
     free(((struct multirom_rom*)rom)->base_path);
     free(((struct multirom_rom*)rom)->icon_path);
-    free(rom);
+    mem_free(MEM_TAG_ROMS, rom);
 }
 
 void multirom_find_usb_roms(struct multirom_status *s)
@@ -1246,8 +1308,7 @@ int multirom_scan_partition_for_roms(struct multirom_status *s, struct usb_parti
         if(dr->d_name[0] == '.')
             continue;
 
-        struct multirom_rom *rom = malloc(sizeof(struct multirom_rom));
-        memset(rom, 0, sizeof(struct multirom_rom));
+        struct multirom_rom *rom = mem_zalloc(MEM_TAG_ROMS, sizeof(struct multirom_rom));
 
         rom->id = multirom_generate_rom_id();
         rom->name = strdup(dr->d_name);
@@ -1465,7 +1526,7 @@ int multirom_prepare_for_boot(struct multirom_status *s, struct multirom_rom *to
                     disable_dtb_fstab("system");
                 }
             }
-            rom_quirks_on_initrd_finalized();
+            rom_quirks_on_initrd_finalized(NULL);
             break;
         }
         case ROM_LINUX_INTERNAL:
@@ -1487,7 +1548,7 @@ int multirom_prepare_for_boot(struct multirom_status *s, struct multirom_rom *to
                 if(multirom_create_media_link(s) == -1)
                     return -1;
 
-                rom_quirks_on_initrd_finalized();
+                rom_quirks_on_initrd_finalized(&s->rc);
 
                 rom_quirks_change_patch_and_osver();
 
@@ -1589,22 +1650,166 @@ static int multirom_inject_fw_mounter(struct multirom_status *s, struct fstab_pa
     return 0;
 }
 
-int multirom_prep_android_mounts(struct multirom_status *s, struct multirom_rom *rom)
+#define MOUNT_PLAN_THREADS 4
+#define MOUNT_PLAN_MAX_STEPS 8
+
+enum
+{
+    MSTEP_WAITING,
+    MSTEP_RUNNING,
+    MSTEP_DONE,
+};
+
+struct mount_step
+{
+    const char *name;
+    int (*run)(void *data);
+    void *data;
+    uint32_t deps; // bitmask of the steps which have to succeed first
+    int state;
+    int res;
+    uint32_t time_ms;
+};
+
+// Runs independent steps of the ROM's boot preparation concurrently
+struct mount_plan
+{
+    struct mount_step steps[MOUNT_PLAN_MAX_STEPS];
+    int steps_cnt;
+    uint32_t done;
+    uint32_t failed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void mount_plan_init(struct mount_plan *p)
+{
+    memset(p, 0, sizeof(struct mount_plan));
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+}
+
+static void mount_plan_destroy(struct mount_plan *p)
+{
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+}
+
+// deps may only contain steps which were added before, so there are no cycles
+static int mount_plan_add(struct mount_plan *p, const char *name, int (*run)(void*), void *data, uint32_t deps)
+{
+    struct mount_step *st;
+
+    if(p->steps_cnt >= MOUNT_PLAN_MAX_STEPS || deps >= (1u << p->steps_cnt))
+    {
+        ERROR("mount plan: invalid step %s\n", name);
+        return -1;
+    }
+
+    st = &p->steps[p->steps_cnt];
+    st->name = name;
+    st->run = run;
+    st->data = data;
+    st->deps = deps;
+    st->state = MSTEP_WAITING;
+    return p->steps_cnt++;
+}
+
+static void *mount_plan_worker(void *data)
 {
+    struct mount_plan *p = data;
+    const uint32_t all = (1u << p->steps_cnt) - 1;
+    struct mount_step *st;
+    struct timespec start, end;
+    int i, res;
+
+    pthread_mutex_lock(&p->mutex);
+    while(p->done != all)
+    {
+        for(i = 0; i < p->steps_cnt; ++i)
+        {
+            if(p->steps[i].state == MSTEP_WAITING && (p->steps[i].deps & ~p->done) == 0)
+                break;
+        }
+
+        if(i == p->steps_cnt)
+        {
+            pthread_cond_wait(&p->cond, &p->mutex);
+            continue;
+        }
+
+        st = &p->steps[i];
+
+        if(st->deps & p->failed)
+        {
+            ERROR("mount plan: skipping %s, its dependency failed\n", st->name);
+            res = -1;
+        }
+        else
+        {
+            st->state = MSTEP_RUNNING;
+            pthread_mutex_unlock(&p->mutex);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            res = st->run(st->data);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            pthread_mutex_lock(&p->mutex);
+            st->time_ms = timespec_diff(&start, &end);
+        }
+
+        st->state = MSTEP_DONE;
+        st->res = res;
+        p->done |= (1u << i);
+        if(res != 0)
+            p->failed |= (1u << i);
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+// returns 0 if all steps succeeded
+static int mount_plan_run(struct mount_plan *p)
+{
+    pthread_t threads[MOUNT_PLAN_THREADS];
+    struct timespec start, end;
+    int i, threads_cnt = imin(MOUNT_PLAN_THREADS, p->steps_cnt);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < threads_cnt; ++i)
+        pthread_create(&threads[i], NULL, mount_plan_worker, p);
+    for(i = 0; i < threads_cnt; ++i)
+        pthread_join(threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for(i = 0; i < p->steps_cnt; ++i)
+        INFO("mount plan: %-8s %5u ms%s\n", p->steps[i].name, p->steps[i].time_ms, p->steps[i].res ? " FAILED" : "");
+    INFO("mount plan: total    %5u ms\n", timespec_diff(&start, &end));
+
+    return p->failed ? -1 : 0;
+}
+
+struct android_boot_files
+{
+    struct multirom_rom *rom;
+    int has_fw;
+    struct fstab_part *fw_part;
+    int found_fstab;
+};
+
+// Copies ROM's ramdisk files from its boot folder and processes its fstab
+static int multirom_copy_android_boot(void *data)
+{
+    struct android_boot_files *b = data;
     char in[128];
     char out[128];
     char path[256];
     char *fstab_name = NULL;
-    struct stat stat;
-    int has_fw = 0;
-    int found_fstab = 0;
-    struct fstab_part *fw_part = NULL;
-    int res = -1;
 
-    sprintf(path, "%s/firmware.img", rom->base_path);
-    has_fw = (access(path, R_OK) >= 0);
-
-    sprintf(path, "%s/boot", rom->base_path);
+    sprintf(path, "%s/boot", b->rom->base_path);
 
     DIR *d = opendir(path);
     char* prefix = NULL;
@@ -1649,12 +1854,91 @@ int multirom_prep_android_mounts(struct multirom_status *s, struct multirom_rom
     }
     closedir(d);
 
-    if(multirom_process_android_fstab(fstab_name, has_fw, &fw_part, 0) != 0) {
+    if(multirom_process_android_fstab(fstab_name, b->has_fw, &b->fw_part, 0) != 0) {
         INFO("fstab couldnt be found in ramdisk. Rom maybe treble. Retry after vendor mount\n");
     } else {
-        found_fstab = 1;
+        b->found_fstab = 1;
+    }
+    return 0;
+}
+
+struct android_mount
+{
+    struct multirom_rom *rom;
+    const char *folder;
+    unsigned long flags;
+};
+
+// Mounts ROM's folder, image or sparse image on /<folder>
+static int multirom_mount_android_part(void *data)
+{
+    struct android_mount *m = data;
+    char from[256];
+    char to[256];
+
+    snprintf(to, sizeof(to), "/%s", m->folder);
+    snprintf(from, sizeof(from), "%s/%s", m->rom->base_path, m->folder);
+    if (!access(from, R_OK)) {
+        if (strstr(from, "vendor") && multirom_path_exists(m->rom->base_path, "vendor/etc")) {
+            return 0;
+        }
+        if(mount(from, to, "ext4", MS_BIND | m->flags, "discard,nomblk_io_submit") < 0) {
+            ERROR("Failed to mount %s to %s (%d: %s)\n", from, to, errno, strerror(errno));
+            return -1;
+        } else
+            INFO("Bind mounted %s on %s\n", from, to);
+        return 0;
+    }
+
+    snprintf(from, sizeof(from), "%s/%s.img", m->rom->base_path, m->folder);
+    if (!access(from, R_OK)) {
+        if(mount_image(from, to, "ext4", m->flags, NULL) < 0)
+            return -1;
+        else
+            INFO("Loop mounted %s on %s\n", from, to);
+        return 0;
     }
 
+    snprintf(from, sizeof(from), "%s/%s.sparse.img", m->rom->base_path, m->folder);
+    if (!access(from, R_OK)) {
+        if(multirom_mount_image(from, to, "ext4", m->flags, NULL) < 0)
+            return -1;
+        else
+            INFO("MultiROM Loop mounted %s on %s\n", from, to);
+        return 0;
+    }
+
+    if (strstr(from, "vendor")) {
+        INFO("vendor not found, skipping\n");
+        return 0;
+    }
+    // Neither directory nor .img nor .sparse.img was found, panic
+    return -1;
+}
+
+int multirom_prep_android_mounts(struct multirom_status *s, struct multirom_rom *rom)
+{
+    char path[256];
+    struct stat stat;
+    int has_fw = 0;
+    struct fstab_part *fw_part = NULL;
+    int res = -1;
+    struct mount_plan plan;
+    struct android_boot_files boot_files;
+    struct android_mount mounts[4];
+
+    sprintf(path, "%s/firmware.img", rom->base_path);
+    has_fw = (access(path, R_OK) >= 0);
+
+    // The ramdisk files go to /<dir>/, which has to happen before anything
+    // is mounted over those dirs, so only the mounts run concurrently.
+    memset(&boot_files, 0, sizeof(boot_files));
+    boot_files.rom = rom;
+    boot_files.has_fw = has_fw;
+    if(multirom_copy_android_boot(&boot_files) != 0)
+        return -1;
+    fw_part = boot_files.fw_part;
+
     unlink("/cache");
 
     mkdir_with_perms("/system", 0755, NULL, NULL);
@@ -1679,46 +1963,23 @@ int multirom_prep_android_mounts(struct multirom_status *s, struct multirom_rom
     char from[256];
     char to[256];
 
-    for (i = 0; i < ARRAY_SIZE(folders); ++i) {
-        snprintf(to, sizeof(to), "/%s", folders[i]);
-        snprintf(from, sizeof(from), "%s/%s", rom->base_path, folders[i]);
-        if (!access(from, R_OK)) {
-            if (strstr(from, "vendor") && multirom_path_exists(rom->base_path, "vendor/etc")) {
-                continue;
-            }
-            if(mount(from, to, "ext4", MS_BIND | flags[i], "discard,nomblk_io_submit") < 0) {
-                ERROR("Failed to mount %s to %s (%d: %s)\n", from, to, errno, strerror(errno));
-                goto exit;
-            } else
-                INFO("Bind mounted %s on %s\n", from, to);
-            continue;
-        }
+    // The partitions don't depend on each other, so the (possibly loop)
+    // mounts can all run at once.
+    mount_plan_init(&plan);
 
-        snprintf(from, sizeof(from), "%s/%s.img", rom->base_path, folders[i]);
-        if (!access(from, R_OK)) {
-            if(mount_image(from, to, "ext4", flags[i], NULL) < 0)
-                goto exit;
-            else
-                INFO("Loop mounted %s on %s\n", from, to);
-            continue;
-        }
-
-        snprintf(from, sizeof(from), "%s/%s.sparse.img", rom->base_path, folders[i]);
-        if (!access(from, R_OK)) {
-            if(multirom_mount_image(from, to, "ext4", flags[i], NULL) < 0)
-                goto exit;
-            else
-                INFO("MultiROM Loop mounted %s on %s\n", from, to);
-            continue;
-        }
+    for (i = 0; i < ARRAY_SIZE(folders); ++i) {
+        mounts[i].rom = rom;
+        mounts[i].folder = folders[i];
+        mounts[i].flags = flags[i];
+        mount_plan_add(&plan, folders[i], multirom_mount_android_part, &mounts[i], 0);
+    }
 
-        if (strstr(from, "vendor")) {
-            INFO("vendor not found, skipping\n");
-            continue;
-        }
-        // Neither directory nor .img nor .sparse.img was found, panic
+    if(mount_plan_run(&plan) != 0)
+    {
+        mount_plan_destroy(&plan);
         goto exit;
     }
+    mount_plan_destroy(&plan);
 
     if((multirom_path_exists("/system", "vendor/etc") == -1) &&
             (multirom_path_exists(rom->base_path, "vendor/etc") == -1) &&
@@ -1730,7 +1991,7 @@ int multirom_prep_android_mounts(struct multirom_status *s, struct multirom_rom
     if (!access(DT_FSTAB_PATH, F_OK)) {
         remove_dtb_fstab();
     }
-    if(!found_fstab && multirom_process_android_fstab(NULL, has_fw, &fw_part, 1) != 0) {
+    if(!boot_files.found_fstab && multirom_process_android_fstab(NULL, has_fw, &fw_part, 1) != 0) {
         INFO("fstab not found even in vendor!\n");
         goto exit;
     }
@@ -2228,11 +2489,116 @@ int multirom_find_file(char *res, const char *name_part, const char *path)
     return ret;
 }
 
+static void multirom_kexec_init(struct kexec *kexec)
+{
+    kexec_init(kexec, kexec_path);
+    kexec_add_arg(kexec, "--mem-min="MR_KEXEC_MEM_MIN);
+#ifdef MR_KEXEC_DTB
+    kexec_add_arg_prefix(kexec, "--boardname=", TARGET_DEVICE);
+#endif
+}
+
+// The ROM which is most likely going to be booted is loaded into kexec
+// while the UI is shown, so that it doesn't have to be done after the
+// user picks it. Loading a kexec image is undone by "kexec -u".
+static struct
+{
+    pthread_t thread;
+    int running;
+    struct multirom_status *s;
+    struct multirom_rom *rom;
+    int res;
+} kexec_spec = {
+    .running = 0,
+    .rom = NULL,
+    .res = -1,
+};
+
+static void *multirom_kexec_spec_work(UNUSED void *data)
+{
+    struct kexec kexec;
+
+    INFO("Speculatively loading kexec for ROM %s\n", kexec_spec.rom->name);
+
+    multirom_kexec_init(&kexec);
+    if(multirom_fill_kexec_android(kexec_spec.s, kexec_spec.rom, &kexec) == 0)
+        kexec_spec.res = kexec_load_exec(&kexec);
+    kexec_destroy(&kexec);
+    return NULL;
+}
+
+void multirom_kexec_spec_start(struct multirom_status *s)
+{
+    struct multirom_rom *rom;
+
+    if(kexec_spec.running || s->is_second_boot != 0)
+        return;
+
+    if(s->auto_boot_rom && s->auto_boot_seconds > 0)
+        rom = s->auto_boot_rom;
+    else
+        rom = s->current_rom;
+
+    if(!rom || rom->type == ROM_DEFAULT || !(M(rom->type) & MASK_ANDROID) || !rom->has_bootimg)
+        return;
+
+    // USB ROMs are freed and scanned again when USB drives change while
+    // the UI is running, and the cmdline depends on current_rom.
+    if(rom->partition || (s->current_rom && s->current_rom->partition))
+        return;
+
+    // run-on-boot scripts run after the UI and may change the ROM's boot.img
+    if(multirom_has_scripts("run-on-boot", rom))
+    {
+        INFO("ROM %s has run-on-boot scripts, not loading it into kexec early\n", rom->name);
+        return;
+    }
+
+    if(!multirom_has_kexec())
+        return;
+
+    kexec_spec.s = s;
+    kexec_spec.rom = rom;
+    kexec_spec.res = -1;
+    kexec_spec.running = 1;
+    pthread_create(&kexec_spec.thread, NULL, multirom_kexec_spec_work, NULL);
+}
+
+// Waits for the speculative load and unloads it if to_boot is a different ROM
+void multirom_kexec_spec_finish(struct multirom_rom *to_boot)
+{
+    if(!kexec_spec.running)
+        return;
+
+    pthread_join(kexec_spec.thread, NULL);
+    kexec_spec.running = 0;
+
+    if(kexec_spec.res == 0 && kexec_spec.rom != to_boot)
+    {
+        INFO("Discarding speculative kexec of ROM %s\n", kexec_spec.rom->name);
+        mr_system("%s -u", kexec_path);
+        kexec_spec.res = -1;
+    }
+}
+
+// returns 0 if rom is already loaded in kexec
+static int multirom_kexec_spec_take(struct multirom_rom *rom)
+{
+    multirom_kexec_spec_finish(rom);
+
+    if(kexec_spec.res != 0 || kexec_spec.rom != rom)
+        return -1;
+
+    kexec_spec.res = -1;
+    return 0;
+}
+
 int multirom_load_kexec(struct multirom_status *s, struct multirom_rom *rom)
 {
     int res = -1;
     struct kexec kexec;
     int loop_mounted = 0;
+    char *cmd_cp[] = { busybox_path, "cp", kexec_path, "/kexec", NULL };
 
     // to find /data partition
     if(!rom->partition && multirom_update_partitions(s) < 0)
@@ -2241,11 +2607,14 @@ int multirom_load_kexec(struct multirom_status *s, struct multirom_rom *rom)
         return -1;
     }
 
-    kexec_init(&kexec, kexec_path);
-    kexec_add_arg(&kexec, "--mem-min="MR_KEXEC_MEM_MIN);
-#ifdef MR_KEXEC_DTB
-    kexec_add_arg_prefix(&kexec, "--boardname=", TARGET_DEVICE);
-#endif
+    multirom_kexec_init(&kexec);
+
+    if(multirom_kexec_spec_take(rom) == 0)
+    {
+        INFO("ROM %s was already loaded into kexec while the UI was running\n", rom->name);
+        res = 0;
+        goto loaded;
+    }
 
     switch(rom->type)
     {
@@ -2270,7 +2639,7 @@ int multirom_load_kexec(struct multirom_status *s, struct multirom_rom *rom)
 
     res = kexec_load_exec(&kexec);
 
-    char *cmd_cp[] = { busybox_path, "cp", kexec_path, "/kexec", NULL };
+loaded:
     run_cmd(cmd_cp);
     chmod("/kexec", 0755);
 
@@ -2840,6 +3209,83 @@ void multirom_destroy_partition(void *part)
     free(p);
 }
 
+static int multirom_is_ignored_partition(const char *name)
+{
+    // ignore internal nand
+    if(strncmp(name, "mmcblk0", 7) == 0 || strncmp(name, "dm-", 3) == 0 || strncmp(name, "sd", 2) == 0)
+        return 1;
+
+    // ignore loop devices
+    if(strncmp(name, "loop", 4) == 0)
+        return 1;
+
+    return 0;
+}
+
+// Parses one line of blkid output, returns NULL if the partition
+// should not be used. The partition is not mounted yet.
+static struct usb_partition *multirom_parse_blkid_line(const char *line)
+{
+    const char *tok;
+    char *name;
+    struct usb_partition *part;
+
+    if(strstr(line, "/dev/") != line)
+    {
+        ERROR("blkid line does not start with /dev/!\n");
+        return NULL;
+    }
+
+    tok = strrchr(line, '/')+1;
+    name = strndup(tok, strchr(tok, ':') - tok);
+    if(multirom_is_ignored_partition(name))
+    {
+        free(name);
+        return NULL;
+    }
+
+    part = mzalloc(sizeof(struct usb_partition));
+    part->name = name;
+
+    tok = strstr(line, "UUID=\"");
+    if(tok)
+    {
+        tok += sizeof("UUID=\"")-1;
+        part->uuid = strndup(tok, strchr(tok, '"') - tok);
+    }
+    else
+    {
+        ERROR("Part %s does not have UUID, line: \"%s\"\n", part->name, line);
+        multirom_destroy_partition(part);
+        return NULL;
+    }
+
+    tok = strstr(line, "TYPE=\"");
+    if(tok)
+    {
+        tok += sizeof("TYPE=\"")-1;
+        part->fs = strndup(tok, strchr(tok, '"') - tok);
+    }
+    return part;
+}
+
+// expects locked parts_mutex
+static int multirom_mount_and_add_partition(struct multirom_status *s, struct usb_partition *part)
+{
+    if(part->fs && multirom_mount_usb(part) == 0)
+    {
+        list_add(&s->partitions, part);
+        ERROR("Found part %s: %s, %s\n", part->name, part->uuid, part->fs);
+        return 0;
+    }
+    else
+    {
+        ERROR("Failed to mount part %s %s, %s\n", part->name, part->uuid, part->fs);
+        multirom_destroy_partition(part);
+        return -1;
+    }
+}
+
 int multirom_update_partitions(struct multirom_status *s)
 {
     pthread_mutex_lock(&parts_mutex);
@@ -2856,8 +3302,6 @@ int multirom_update_partitions(struct multirom_status *s)
         return exit_code == 0 ? 0 : -1;
     }
 
-    char *tok;
-    char *name;
     struct usb_partition *part;
 
     char *line = strtok(res, "\n");
@@ -2869,61 +3313,86 @@ int multirom_update_partitions(struct multirom_status *s)
             break;
         }
 
-        tok = strrchr(line, '/')+1;
-        name = strndup(tok, strchr(tok, ':') - tok);
-        if(strncmp(name, "mmcblk0", 7) == 0 || strncmp(name, "dm-", 3) == 0 || strncmp(name, "sd", 2) == 0) // ignore internal nand
-        {
-            free(name);
-            goto next_itr;
-        }
+        part = multirom_parse_blkid_line(line);
+        if(part)
+            multirom_mount_and_add_partition(s, part);
 
-        if(strncmp(name, "loop", 4) == 0) // ignore loop devices
-        {
-            free(name);
-            goto next_itr;
-        }
+        line = strtok(NULL, "\n");
+    }
+    pthread_mutex_unlock(&parts_mutex);
+    free(res);
 
-        part = mzalloc(sizeof(struct usb_partition));
-        part->name = name;
+    return 0;
+}
 
-        tok = strstr(line, "UUID=\"");
-        if(tok)
-        {
-            tok += sizeof("UUID=\"")-1;
-            part->uuid = strndup(tok, strchr(tok, '"') - tok);
-        }
-        else
-        {
-            ERROR("Part %s does not have UUID, line: \"%s\"\n", part->name, line);
-            multirom_destroy_partition(part);
-            goto next_itr;
-        }
+// expects locked parts_mutex
+static int multirom_find_partition_by_name(struct multirom_status *s, const char *name)
+{
+    int i;
+    for(i = 0; s->partitions && s->partitions[i]; ++i)
+        if(strcmp(s->partitions[i]->name, name) == 0)
+            return i;
+    return -1;
+}
 
-        tok = strstr(line, "TYPE=\"");
-        if(tok)
-        {
-            tok += sizeof("TYPE=\"")-1;
-            part->fs = strndup(tok, strchr(tok, '"') - tok);
-        }
+// Probes and mounts a single block device, returns 1 if the partition
+// list has changed.
+static int multirom_add_partition(struct multirom_status *s, const char *name)
+{
+    int exit_code = 0, idx, changed = 0;
+    char src[128];
+    char *res, *line;
+    struct usb_partition *part;
 
-        if(part->fs && multirom_mount_usb(part) == 0)
-        {
-            list_add(&s->partitions, part);
-            ERROR("Found part %s: %s, %s\n", part->name, part->uuid, part->fs);
-        }
-        else
-        {
-            ERROR("Failed to mount part %s %s, %s\n", part->name, part->uuid, part->fs);
-            multirom_destroy_partition(part);
-        }
+    if(multirom_is_ignored_partition(name))
+        return 0;
 
-next_itr:
-        line = strtok(NULL, "\n");
+    snprintf(src, sizeof(src), "/dev/block/%s", name);
+
+    char *cmd[] = { busybox_path, "blkid", src, NULL };
+    res = run_get_stdout_with_exit(cmd, &exit_code);
+
+    // no filesystem on it (e.g. the whole disk with a partition table)
+    if(exit_code != 0 || res == NULL || (line = strtok(res, "\n")) == NULL)
+    {
+        free(res);
+        return 0;
     }
-    pthread_mutex_unlock(&parts_mutex);
+
+    part = multirom_parse_blkid_line(line);
     free(res);
+    if(!part)
+        return 0;
 
-    return 0;
+    pthread_mutex_lock(&parts_mutex);
+    // change event or a different medium in the same device
+    idx = multirom_find_partition_by_name(s, name);
+    if(idx != -1)
+    {
+        list_rm_at(&s->partitions, idx, &multirom_destroy_partition);
+        changed = 1;
+    }
+
+    if(multirom_mount_and_add_partition(s, part) == 0)
+        changed = 1;
+    pthread_mutex_unlock(&parts_mutex);
+    return changed;
+}
+
+// returns 1 if the partition list has changed
+static int multirom_remove_partition(struct multirom_status *s, const char *name)
+{
+    int idx;
+
+    pthread_mutex_lock(&parts_mutex);
+    idx = multirom_find_partition_by_name(s, name);
+    if(idx != -1)
+    {
+        INFO("Removing part %s\n", name);
+        list_rm_at(&s->partitions, idx, &multirom_destroy_partition);
+    }
+    pthread_mutex_unlock(&parts_mutex);
+    return idx != -1;
 }
 
 int is_mounted_properly(const char *src, const char *mnt_path)
@@ -3060,7 +3529,22 @@ void multirom_update_and_scan_for_external_roms(struct multirom_status *s, char
     }
 }
 
-void *multirom_usb_refresh_thread_work(void *status)
+#define HOTPLUG_DEBOUNCE_MS 300
+#define HOTPLUG_MAX_TRIES 10
+#define UEVENT_MSG_LEN 2048
+
+struct hotplug_dev
+{
+    char name[32];
+    int add;
+    int tries;
+    struct timespec since;
+};
+
+static int usb_refresh_wake_fd = -1;
+
+// Fallback for when the uevent socket can't be opened
+static void multirom_usb_poll_work(struct multirom_status *s)
 {
     uint32_t timer = 0;
     struct stat info;
@@ -3077,7 +3561,7 @@ void *multirom_usb_refresh_thread_work(void *status)
             if (stat("/dev/block", &info) >= 0 &&
                 ((unsigned long)info.st_ctime != last_ctime || (unsigned long)info.st_ctimensec != last_ctime_nsec))
             {
-                multirom_update_partitions((struct multirom_status*)status);
+                multirom_update_partitions(s);
 
                 if(usb_refresh_handler)
                     (*usb_refresh_handler)();
@@ -3091,19 +3575,206 @@ void *multirom_usb_refresh_thread_work(void *status)
             timer -= 50;
         usleep(50000);
     }
+}
+
+// Events for the same device are merged, the last one wins
+static void multirom_hotplug_queue(struct hotplug_dev ***pending, const char *name, int add)
+{
+    int i;
+    struct hotplug_dev *d = NULL;
+
+    for(i = 0; *pending && (*pending)[i]; ++i)
+    {
+        if(strcmp((*pending)[i]->name, name) == 0)
+        {
+            d = (*pending)[i];
+            break;
+        }
+    }
+
+    if(!d)
+    {
+        d = mzalloc(sizeof(struct hotplug_dev));
+        snprintf(d->name, sizeof(d->name), "%s", name);
+        list_add(pending, d);
+    }
+
+    d->add = add;
+    d->tries = 0;
+    clock_gettime(CLOCK_MONOTONIC, &d->since);
+}
+
+static void multirom_hotplug_parse(struct hotplug_dev ***pending, const char *msg)
+{
+    const char *action = NULL, *subsystem = NULL, *name = NULL;
+
+    while(*msg)
+    {
+        if(strncmp(msg, "ACTION=", 7) == 0)
+            action = msg + 7;
+        else if(strncmp(msg, "SUBSYSTEM=", 10) == 0)
+            subsystem = msg + 10;
+        else if(strncmp(msg, "DEVNAME=", 8) == 0)
+            name = msg + 8;
+
+        // advance to after the next \0
+        while(*msg++)
+            ;
+    }
+
+    if(!action || !subsystem || !name || strcmp(subsystem, "block") != 0)
+        return;
+
+    if(strrchr(name, '/'))
+        name = strrchr(name, '/') + 1;
+
+    if(strlen(name) >= sizeof(((struct hotplug_dev*)0)->name))
+        return;
+
+    if(strcmp(action, "add") == 0 || strcmp(action, "change") == 0)
+        multirom_hotplug_queue(pending, name, 1);
+    else if(strcmp(action, "remove") == 0)
+        multirom_hotplug_queue(pending, name, 0);
+}
+
+// Handles the devices which were quiet for HOTPLUG_DEBOUNCE_MS, returns
+// poll() timeout until the next one is due.
+static int multirom_hotplug_process(struct multirom_status *s, struct hotplug_dev ***pending, int *changed)
+{
+    int i, timeout = -1;
+    uint32_t elapsed;
+    char path[64];
+    struct timespec now;
+    struct hotplug_dev *d;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(i = 0; *pending && (*pending)[i];)
+    {
+        d = (*pending)[i];
+        elapsed = timespec_diff(&d->since, &now);
+
+        if(elapsed < HOTPLUG_DEBOUNCE_MS)
+        {
+            timeout = (timeout == -1) ? (int)(HOTPLUG_DEBOUNCE_MS - elapsed) : imin(timeout, HOTPLUG_DEBOUNCE_MS - elapsed);
+            ++i;
+            continue;
+        }
+
+        if(d->add)
+        {
+            // the node is created by trampoline's uevent thread, which
+            // might not have got to it yet
+            snprintf(path, sizeof(path), "/dev/block/%s", d->name);
+            if(access(path, F_OK) < 0 && ++d->tries < HOTPLUG_MAX_TRIES)
+            {
+                d->since = now;
+                timeout = (timeout == -1) ? HOTPLUG_DEBOUNCE_MS : imin(timeout, HOTPLUG_DEBOUNCE_MS);
+                ++i;
+                continue;
+            }
+
+            *changed |= multirom_add_partition(s, d->name);
+        }
+        else
+            *changed |= multirom_remove_partition(s, d->name);
+
+        list_rm_at(pending, i, &free);
+    }
+    return timeout;
+}
+
+void *multirom_usb_refresh_thread_work(void *status)
+{
+    struct multirom_status *s = status;
+    struct hotplug_dev **pending = NULL;
+    struct pollfd fds[2];
+    char msg[UEVENT_MSG_LEN+2];
+    int n, timeout = -1, changed;
+
+    // without the wake up fd, the thread could not be stopped while
+    // it waits for uevents
+    if(usb_refresh_wake_fd < 0)
+    {
+        ERROR("No USB hotplug wake up fd, falling back to polling /dev/block\n");
+        multirom_usb_poll_work(s);
+        return NULL;
+    }
+
+    fds[0].fd = uevent_open_socket(64*1024, true);
+    if(fds[0].fd < 0)
+    {
+        ERROR("Failed to open uevent socket, falling back to polling /dev/block\n");
+        multirom_usb_poll_work(s);
+        return NULL;
+    }
+
+    fcntl(fds[0].fd, F_SETFL, O_NONBLOCK);
+    fds[0].events = POLLIN;
+    fds[1].fd = usb_refresh_wake_fd;
+    fds[1].events = POLLIN;
+
+    // Something might have been plugged in before the socket was opened
+    multirom_update_partitions(s);
+    if(usb_refresh_handler)
+        (*usb_refresh_handler)();
+
+    while(run_usb_refresh)
+    {
+        if(poll(fds, 2, timeout) < 0 && errno != EINTR)
+        {
+            ERROR("USB hotplug poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            while((n = uevent_kernel_multicast_recv(fds[0].fd, msg, UEVENT_MSG_LEN)) > 0)
+            {
+                if(n >= UEVENT_MSG_LEN) // overflow -- discard
+                    continue;
+
+                msg[n] = '\0';
+                msg[n+1] = '\0';
+                multirom_hotplug_parse(&pending, msg);
+            }
+        }
+
+        changed = 0;
+        timeout = multirom_hotplug_process(s, &pending, &changed);
+        if(changed && usb_refresh_handler)
+            (*usb_refresh_handler)();
+    }
+
+    list_clear(&pending, &free);
+    close(fds[0].fd);
     return NULL;
 }
 
 void multirom_set_usb_refresh_thread(struct multirom_status *s, int run)
 {
+    uint64_t val = 1;
+
     if(run_usb_refresh == run)
         return;
 
     run_usb_refresh = run;
     if(run)
+    {
+        usb_refresh_wake_fd = eventfd(0, EFD_CLOEXEC);
+        if(usb_refresh_wake_fd < 0)
+            ERROR("Failed to create USB hotplug eventfd: %s\n", strerror(errno));
         pthread_create(&usb_refresh_thread, NULL, multirom_usb_refresh_thread_work, s);
+    }
     else
+    {
+        if(usb_refresh_wake_fd >= 0 && write(usb_refresh_wake_fd, &val, sizeof(val)) < 0)
+            ERROR("Failed to wake up the USB hotplug thread: %s\n", strerror(errno));
         pthread_join(usb_refresh_thread, NULL);
+        if(usb_refresh_wake_fd >= 0)
+            close(usb_refresh_wake_fd);
+        usb_refresh_wake_fd = -1;
+    }
 }
 
 void multirom_set_usb_refresh_handler(void (*handler)(void))
@@ -3117,12 +3788,12 @@ char *multirom_get_klog(void)
     if      (len < 16*1024)      len = 16*1024;
     else if (len > 16*1024*1024) len = 16*1024*1024;
 
-    char *buff = malloc(len + 1);
+    char *buff = mem_alloc(MEM_TAG_KLOG, len + 1);
     len = klogctl(3, buff, len);
     if(len <= 0)
     {
         ERROR("Could not get klog!\n");
-        free(buff);
+        mem_free(MEM_TAG_KLOG, buff);
         return NULL;
     }
     buff[len] = 0;
@@ -3162,7 +3833,7 @@ int multirom_copy_log(char *klog, const char *dest_path_relative)
     }
 
     if(freeLog)
-        free(klog);
+        mem_free(MEM_TAG_KLOG, klog);
     return res;
 }
 
@@ -3192,6 +3863,33 @@ int multirom_get_battery(void)
     return atoi(buff);
 }
 
+// returns 1 if the ROM's folder for type contains any scripts
+int multirom_has_scripts(const char *type, struct multirom_rom *rom)
+{
+    char buff[512];
+    struct dirent *dp;
+    size_t len;
+    int res = 0;
+    DIR *d;
+
+    snprintf(buff, sizeof(buff), "%s/%s", rom->base_path, type);
+    d = opendir(buff);
+    if(!d)
+        return 0;
+
+    while((dp = readdir(d)))
+    {
+        len = strlen(dp->d_name);
+        if(len > 3 && strcmp(dp->d_name + len - 3, ".sh") == 0)
+        {
+            res = 1;
+            break;
+        }
+    }
+    closedir(d);
+    return res;
+}
+
 int multirom_run_scripts(const char *type, struct multirom_rom *rom)
 {
     char buff[512];
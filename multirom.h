@@ -45,6 +45,9 @@ enum
     ROM_UNKNOWN                  = 10
 };
 
+#define INTERNAL_ROM_NAME "Internal"
+#define MAX_ROM_NAME_LEN 26
+
 #define M(x) (1 << x)
 #define MASK_INTERNAL (M(ROM_DEFAULT) | M(ROM_ANDROID_INTERNAL) | M(ROM_ANDROID_INTERNAL_HYBRID) | M(ROM_UNSUPPORTED_INT) | M(ROM_LINUX_INTERNAL))
 #define MASK_USB_ROMS (M(ROM_ANDROID_USB_IMG) | M(ROM_ANDROID_USB_DIR) | M(ROM_ANDROID_USB_HYBRID) | M(ROM_UNSUPPORTED_USB) | M(ROM_LINUX_USB))
@@ -152,6 +155,8 @@ int multirom_get_rom_type(struct multirom_rom *rom);
 int multirom_get_trampoline_ver(void);
 int multirom_has_kexec(void);
 int multirom_load_kexec(struct multirom_status *s, struct multirom_rom *rom);
+void multirom_kexec_spec_start(struct multirom_status *s);
+void multirom_kexec_spec_finish(struct multirom_rom *to_boot);
 int multirom_get_bootloader_cmdline(struct multirom_status *s, char *str, size_t size);
 int multirom_find_file(char *res, const char *name_part, const char *path);
 int multirom_fill_kexec_linux(struct multirom_status *s, struct multirom_rom *rom, struct kexec *kexec);
@@ -173,6 +178,7 @@ int multirom_replace_aliases_cmdline(char **s, struct rom_info *i, struct multir
 int multirom_replace_aliases_root_path(char **s, struct multirom_rom *rom);
 char *multirom_get_klog(void);
 int multirom_get_battery(void);
+int multirom_has_scripts(const char *type, struct multirom_rom *rom);
 int multirom_run_scripts(const char *type, struct multirom_rom *rom);
 int multirom_update_rd_trampoline(const char *path);
 char *multirom_find_fstab_in_rc(const char *rcfile);
@@ -23,11 +23,13 @@
 #include <dirent.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include "lib/framebuffer.h"
 #include "lib/input.h"
 #include "lib/log.h"
 #include "lib/listview.h"
+#include "lib/mem.h"
 #include "lib/util.h"
 #include "lib/button.h"
 #include "lib/progressdots.h"
@@ -43,6 +45,7 @@
 #include "hooks.h"
 #include "version.h"
 #include "pong.h"
+#include "klog_view.h"
 
 #ifdef MR_NO_KEXEC
 #include "no_kexec.h"
@@ -55,7 +58,10 @@ static volatile int loop_act = 0;
 static multirom_themes_info *themes_info = NULL;
 static multirom_theme *cur_theme = NULL;
 
+// Guards exit_ui_code and loop_act, loop_cond is signalled when either
+// changes so that the main loop can sleep until there is work to do.
 static pthread_mutex_t exit_code_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loop_cond = PTHREAD_COND_INITIALIZER;
 
 static struct auto_boot_data
 {
@@ -76,6 +82,46 @@ uint32_t CLR_SECONDARY = LBLUE2;
 #define LOOP_UPDATE_USB 0x01
 #define LOOP_START_PONG 0x02
 #define LOOP_CHANGE_CLR 0x04
+#define LOOP_START_KLOG 0x08
+
+// how often to retry USB update which waits for the ncard animation
+#define LOOP_RETRY_MS 50
+
+// expects locked exit_code_mutex
+static void multirom_ui_post_exit(int code)
+{
+    exit_ui_code = code;
+    pthread_cond_signal(&loop_cond);
+}
+
+// expects locked exit_code_mutex
+static void multirom_ui_post_act(int act)
+{
+    loop_act |= act;
+    pthread_cond_signal(&loop_cond);
+}
+
+// expects locked exit_code_mutex
+static void multirom_ui_wait_for_act(void)
+{
+    struct timespec ts;
+
+    while(exit_ui_code == -1 && loop_act == 0)
+        pthread_cond_wait(&loop_cond, &exit_code_mutex);
+
+    // USB update is postponed until the ncard stops moving
+    if(exit_ui_code == -1 && loop_act == LOOP_UPDATE_USB && ncard_is_moving())
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOOP_RETRY_MS*1000000;
+        if(ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_nsec -= 1000000000;
+            ++ts.tv_sec;
+        }
+        pthread_cond_timedwait(&loop_cond, &exit_code_mutex, &ts);
+    }
+}
 
 /*static void list_block(char *path, int rec)
 {
@@ -118,7 +164,7 @@ static void nokexec_multirom_ui_use_kexec(UNUSED void *data)
 {
     pthread_mutex_lock(&exit_code_mutex);
     nokexec()->selected_method = NO_KEXEC_BOOT_NORMAL;
-    exit_ui_code = UI_EXIT_BOOT_ROM;
+    multirom_ui_post_exit(UI_EXIT_BOOT_ROM);
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
@@ -126,7 +172,7 @@ static void nokexec_multirom_ui_use_nokexec(UNUSED void *data)
 {
     pthread_mutex_lock(&exit_code_mutex);
     nokexec()->selected_method = NO_KEXEC_BOOT_NOKEXEC;
-    exit_ui_code = UI_EXIT_BOOT_ROM;
+    multirom_ui_post_exit(UI_EXIT_BOOT_ROM);
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
@@ -306,6 +352,22 @@ int multirom_ui(struct multirom_status *s, struct multirom_rom **to_boot)
             keyaction_enable(1);
         }
 
+        if(loop_act & LOOP_START_KLOG)
+        {
+            loop_act &= ~(LOOP_START_KLOG);
+            keyaction_enable(0);
+            input_push_context();
+            anim_push_context();
+            fb_push_context();
+
+            klog_view();
+
+            fb_pop_context();
+            anim_pop_context();
+            input_pop_context();
+            keyaction_enable(1);
+        }
+
         if(loop_act & LOOP_CHANGE_CLR)
         {
             pthread_mutex_unlock(&exit_code_mutex);
@@ -322,9 +384,8 @@ int multirom_ui(struct multirom_status *s, struct multirom_rom **to_boot)
             loop_act &= ~(LOOP_CHANGE_CLR);
         }
 
+        multirom_ui_wait_for_act();
         pthread_mutex_unlock(&exit_code_mutex);
-
-        usleep(100000);
     }
 
     keyaction_enable(0);
@@ -397,6 +458,8 @@ void multirom_ui_init_theme(int tab)
 
     themes_info->data->tabs->on_page_changed_by_swipe = multirom_ui_switch;
     themes_info->data->tabs->on_pos_changed = multirom_ui_change_header_selector_pos;
+    // blitting the pages costs more than drawing them, see fb_bench's tabs scenes
+    themes_info->data->tabs->use_layers = 0;
 
     int i;
     for(i = 0; i < TAB_COUNT; ++i)
@@ -535,7 +598,7 @@ static void multirom_ui_auto_boot_now(void *data)
 
     pthread_mutex_lock(&exit_code_mutex);
     selected_rom = mrom_status->auto_boot_rom;
-    exit_ui_code = UI_EXIT_BOOT_ROM;
+    multirom_ui_post_exit(UI_EXIT_BOOT_ROM);
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
@@ -558,7 +621,7 @@ static void multirom_ui_auto_boot_tick(UNUSED void *data)
 
         pthread_mutex_lock(&exit_code_mutex);
         selected_rom = mrom_status->auto_boot_rom;
-        exit_ui_code = UI_EXIT_BOOT_ROM;
+        multirom_ui_post_exit(UI_EXIT_BOOT_ROM);
         pthread_mutex_unlock(&exit_code_mutex);
     }
     else
@@ -598,14 +661,14 @@ void multirom_ui_auto_boot(void)
 void multirom_ui_refresh_usb_handler(void)
 {
     pthread_mutex_lock(&exit_code_mutex);
-    loop_act |= LOOP_UPDATE_USB;
+    multirom_ui_post_act(LOOP_UPDATE_USB);
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
 void multirom_ui_start_pong(UNUSED void *data)
 {
     pthread_mutex_lock(&exit_code_mutex);
-    loop_act |= LOOP_START_PONG;
+    multirom_ui_post_act(LOOP_START_PONG);
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
@@ -743,7 +806,7 @@ void multirom_ui_tab_rom_boot(void)
 
     pthread_mutex_lock(&exit_code_mutex);
     selected_rom = rom;
-    exit_ui_code = UI_EXIT_BOOT_ROM;
+    multirom_ui_post_exit(UI_EXIT_BOOT_ROM);
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
@@ -845,7 +908,14 @@ void multirom_ui_tab_misc_change_clr(void *data)
 
     pthread_mutex_lock(&exit_code_mutex);
     mrom_status->colors = clr;
-    loop_act |= LOOP_CHANGE_CLR;
+    multirom_ui_post_act(LOOP_CHANGE_CLR);
+    pthread_mutex_unlock(&exit_code_mutex);
+}
+
+void multirom_ui_tab_misc_view_klog(UNUSED void *data)
+{
+    pthread_mutex_lock(&exit_code_mutex);
+    multirom_ui_post_act(LOOP_START_KLOG);
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
@@ -853,13 +923,14 @@ void multirom_ui_reboot_btn(void *data)
 {
     int action = *((int*)data);
     pthread_mutex_lock(&exit_code_mutex);
-    exit_ui_code = action;
+    multirom_ui_post_exit(action);
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
 void multirom_ui_tab_misc_copy_log(UNUSED void *data)
 {
     multirom_dump_status(mrom_status);
+    mem_dump_stats();
 
     int res = multirom_copy_log(NULL, "../../multirom_log.txt");
 
@@ -71,6 +71,7 @@ void multirom_ui_tab_rom_set_empty(void *data, int empty);
 void *multirom_ui_tab_misc_init(void);
 void multirom_ui_tab_misc_destroy(void *data);
 void multirom_ui_tab_misc_copy_log(void *data);
+void multirom_ui_tab_misc_view_klog(void *data);
 void multirom_ui_tab_misc_change_clr(void *data);
 
 void multirom_ui_reboot_btn(void *data);
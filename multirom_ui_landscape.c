@@ -166,9 +166,23 @@ static void tab_misc_init(multirom_theme_data *t, tab_data_misc *d, int color_sc
     int y = HEADER_HEIGHT + ((fb_height - HEADER_HEIGHT)/2 - 2*(MISCBTN_H + 30*DPI_MUL));
     fb_rect *shadow;
 
+    button *b = mzalloc(sizeof(button));
+    b->x = x;
+    b->y = y;
+    b->w = MISCBTN_W;
+    b->h = MISCBTN_H;
+    b->clicked = &multirom_ui_tab_misc_view_klog;
+    shadow = fb_add_rect_lvl(LEVEL_RECT, b->x + BTN_SHADOW_OFF, b->y + BTN_SHADOW_OFF, b->w, b->h, C_BTN_FAKE_SHADOW);
+    button_init_ui(b, "VIEW KERNEL LOG", SIZE_NORMAL);
+    list_add(&d->buttons, b);
+    list_add(&d->ui_elements, shadow);
+    tabview_add_item(t->tabs, TAB_MISC, b->text);
+    tabview_add_item(t->tabs, TAB_MISC, b->rect);
+    tabview_add_item(t->tabs, TAB_MISC, b);
+
     y += MISCBTN_H + 30*DPI_MUL;
 
-    button *b = mzalloc(sizeof(button));
+    b = mzalloc(sizeof(button));
     b->x = x;
     b->y = y;
     b->w = MISCBTN_W;
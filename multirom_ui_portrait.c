@@ -178,7 +178,7 @@ static void tab_rom_init(UNUSED multirom_theme_data *t, tab_data_roms *d, UNUSED
 static void tab_misc_init(multirom_theme_data *t, tab_data_misc *d, int color_scheme)
 {
     int x = fb_width/2 - MISCBTN_W/2;
-    int y = 270*DPI_MUL;
+    int y = 200*DPI_MUL;
     fb_rect *shadow;
 
     button *b = mzalloc(sizeof(button));
@@ -195,6 +195,22 @@ static void tab_misc_init(multirom_theme_data *t, tab_data_misc *d, int color_sc
     tabview_add_item(t->tabs, TAB_MISC, b->rect);
     tabview_add_item(t->tabs, TAB_MISC, b);
 
+    y += MISCBTN_H+20*DPI_MUL;
+
+    b = mzalloc(sizeof(button));
+    b->x = x;
+    b->y = y;
+    b->w = MISCBTN_W;
+    b->h = MISCBTN_H;
+    b->clicked = &multirom_ui_tab_misc_view_klog;
+    shadow = fb_add_rect_lvl(LEVEL_RECT, b->x + BTN_SHADOW_OFF, b->y + BTN_SHADOW_OFF, b->w, b->h, C_BTN_FAKE_SHADOW);
+    button_init_ui(b, "VIEW KERNEL LOG", SIZE_NORMAL);
+    list_add(&d->buttons, b);
+    list_add(&d->ui_elements, shadow);
+    tabview_add_item(t->tabs, TAB_MISC, b->text);
+    tabview_add_item(t->tabs, TAB_MISC, b->rect);
+    tabview_add_item(t->tabs, TAB_MISC, b);
+
     y += MISCBTN_H+70*DPI_MUL;
 
     static const char *texts[] =
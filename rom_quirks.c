@@ -27,129 +27,208 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
 #include <errno.h>
 
 #include "rom_quirks.h"
 #include "rq_inject_file_contexts.h"
+#include "rcadditions.h"
 #include "lib/log.h"
 #include "lib/util.h"
+#include "lib/containers.h"
 #include "libbootimg.h"
 
-static void workaround_mount_in_sh(const char *path)
+#define RQ_FILE_SH  0x01
+#define RQ_FILE_RC  0x02
+
+// A line rule comments out matching lines in files of given types. All
+// enabled rules are applied during a single scan over the mmaped file and
+// the file is only rewritten when at least one line has changed.
+struct rq_line_rule
 {
-    char line[512];
-    char *tmp_name = NULL;
-    FILE *f_in, *f_out;
+    int file_types;
+    int (*match)(const char *line, size_t len);
+};
 
-    f_in = fopen(path, "re");
-    if(!f_in)
-        return;
+struct rq_candidate
+{
+    char *path;
+    int type;
+};
 
-    const int size = strlen(path) + 5;
-    tmp_name = malloc(size);
-    snprintf(tmp_name, size, "%s-new", path);
-    f_out = fopen(tmp_name, "we");
-    if(!f_out)
-    {
-        fclose(f_in);
-        free(tmp_name);
-        return;
-    }
+static int line_has(const char *line, size_t len, const char *needle)
+{
+    return memmem(line, len, needle, strlen(needle)) != NULL;
+}
 
-    while(fgets(line, sizeof(line), f_in))
-    {
-        if(strstr(line, "mount ") && strstr(line, "/system"))
-            fputc('#', f_out);
-        fputs(line, f_out);
-    }
+// franco.Kernel includes script init.fk.sh which remounts /system as read only
+static int rule_mount_system(const char *line, size_t len)
+{
+    return line_has(line, len, "mount ") && line_has(line, len, "/system");
+}
 
-    fclose(f_in);
-    fclose(f_out);
+// Keep this as a backup in case the file_contexts injection doesn't work
+static int rule_restorecon_recursive(const char *line, size_t len)
+{
+    if(!line_has(line, len, "restorecon_recursive ") &&
+        !(line_has(line, len, "restorecon ") && line_has(line, len, "--recursive")))
+        return 0;
 
-    struct stat info;
-    stat(path, &info);
-    chmod(tmp_name, info.st_mode);
+    return line_has(line, len, "/data") || line_has(line, len, "/system") ||
+            line_has(line, len, "/cache") || line_has(line, len, "/mnt") ||
+            line_has(line, len, "/vendor");
+}
 
-    rename(tmp_name, path);
-    free(tmp_name);
+static const struct rq_line_rule rq_rule_mount_system = { RQ_FILE_SH, rule_mount_system };
+static const struct rq_line_rule rq_rule_restorecon = { RQ_FILE_RC, rule_restorecon_recursive };
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+    while(len > 0)
+    {
+        res = write(fd, buf, len);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
 }
 
-// Keep this as a backup function in case the file_contexts binary injection doesn't work
-static void disable_restorecon_recursive(void)
+// Returns 1 if the file was changed, 0 if not and -1 on error
+static int rq_patch_file(const char *path, int type, const struct rq_line_rule **rules, const char *append)
 {
-    DIR *d = opendir("/");
-    if(d)
+    int fd, out_fd, i, res = -1;
+    struct stat info;
+    char *data = NULL;
+    char *out = NULL;
+    char *tmp_name = NULL;
+    size_t *marks = NULL;
+    size_t marks_cnt = 0, marks_cap = 0;
+    size_t size, append_len = append ? strlen(append) : 0;
+    const char *p, *next, *end, *eol;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    if(fstat(fd, &info) < 0)
+        goto exit;
+
+    size = info.st_size;
+    if(size > 0)
     {
-        struct dirent *dt;
-        char path[128];
-        while((dt = readdir(d)))
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED)
         {
-            if(dt->d_type != DT_REG)
+            ERROR("Failed to mmap %s: %s\n", path, strerror(errno));
+            data = NULL;
+            goto exit;
+        }
+    }
+
+    end = data + size;
+    for(p = data; p && p < end; p = next)
+    {
+        eol = memchr(p, '\n', end - p);
+        next = eol ? eol + 1 : end;
+
+        for(i = 0; rules[i]; ++i)
+        {
+            if(!(rules[i]->file_types & type) || !rules[i]->match(p, next - p))
                 continue;
 
-            if(strendswith(dt->d_name, ".rc"))
+            if(marks_cnt >= marks_cap)
             {
-                snprintf(path, sizeof(path), "/%s", dt->d_name);
-                char line[512];
-                char *tmp_name = NULL;
-                FILE *f_in, *f_out;
-
-                f_in = fopen(path, "re");
-                if(!f_in)
-                    return;
-
-                const int size = strlen(path) + 5;
-                tmp_name = malloc(size);
-                snprintf(tmp_name, size, "%s-new", path);
-                f_out = fopen(tmp_name, "we");
-                if(!f_out)
-                {
-                    fclose(f_in);
-                    free(tmp_name);
-                    return;
-                }
-
-                while(fgets(line, sizeof(line), f_in))
-                {
-                    if (strstr(line, "restorecon_recursive ") || (strstr(line, "restorecon ") && strstr(line, "--recursive"))) {
-                        if (strstr(line, "/data") || strstr(line, "/system") || strstr(line, "/cache") || strstr(line, "/mnt") ||
-                                strstr(line, "/vendor")) {
-                            fputc('#', f_out);
-                        }
-                    }
-                    fputs(line, f_out);
-                }
-
-                fclose(f_in);
-                fclose(f_out);
-                rename(tmp_name, path);
-                free(tmp_name);
-
-                chmod(path, 0750);
+                marks_cap = marks_cap ? marks_cap*2 : 8;
+                marks = realloc(marks, marks_cap*sizeof(size_t));
             }
+            marks[marks_cnt++] = p - data;
+            break;
         }
-        closedir(d);
     }
+
+    if(marks_cnt == 0 && append_len == 0)
+    {
+        res = 0;
+        goto exit;
+    }
+
+    size_t out_len = 0, last = 0;
+    out = malloc(size + marks_cnt + append_len);
+    for(i = 0; (size_t)i < marks_cnt; ++i)
+    {
+        memcpy(out + out_len, data + last, marks[i] - last);
+        out_len += marks[i] - last;
+        out[out_len++] = '#';
+        last = marks[i];
+    }
+    memcpy(out + out_len, data + last, size - last);
+    out_len += size - last;
+    memcpy(out + out_len, append, append_len);
+    out_len += append_len;
+
+    const int tmp_size = strlen(path) + 5;
+    tmp_name = malloc(tmp_size);
+    snprintf(tmp_name, tmp_size, "%s-new", path);
+
+    out_fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 07777);
+    if(out_fd < 0)
+    {
+        ERROR("Failed to create %s: %s\n", tmp_name, strerror(errno));
+        goto exit;
+    }
+
+    if(write_all(out_fd, out, out_len) < 0)
+    {
+        ERROR("Failed to write %s: %s\n", tmp_name, strerror(errno));
+        close(out_fd);
+        unlink(tmp_name);
+        goto exit;
+    }
+
+    fchmod(out_fd, info.st_mode & 07777);
+    close(out_fd);
+
+    if(rename(tmp_name, path) < 0)
+    {
+        ERROR("Failed to rename %s: %s\n", tmp_name, strerror(errno));
+        unlink(tmp_name);
+        goto exit;
+    }
+
+    res = 1;
+exit:
+    if(data)
+        munmap(data, size);
+    close(fd);
+    free(marks);
+    free(out);
+    free(tmp_name);
+    return res;
 }
 
-void rom_quirks_on_initrd_finalized(void)
+void rom_quirks_on_initrd_finalized(struct rcadditions *rc)
 {
     int failed_file_contexts_injections = 0;
+    int has_file_contexts = 0;
+    struct rq_candidate **candidates = NULL;
+    const struct rq_line_rule *rules[3] = { NULL };
+    int i, rules_cnt = 0;
 
-    // walk over all _regular_ files in /
-    char* path = "/system/etc/selinux/plat_file_contexts";
+    const char *path = "/system/etc/selinux/plat_file_contexts";
     if (!access(path, F_OK)) {
-        char buf;
-        int sourcefile, destfile, n;
-        sourcefile = open(path, O_RDONLY);
-        destfile = open("/plat_file_contexts", O_WRONLY | O_CREAT, 0644);
-        while((n = read(sourcefile, &buf, 1)))
-        {
-            write(destfile, &buf, 1 );
-        }
-        close(sourcefile);
-        close(destfile);
+        if(copy_file(path, "/plat_file_contexts") < 0)
+            ERROR("Failed to copy %s: %s\n", path, strerror(errno));
+        chmod("/plat_file_contexts", 0644);
     }
+
+    // walk over all _regular_ files in /, just once
     DIR *d = opendir("/");
     if(d)
     {
@@ -187,15 +266,30 @@ void rom_quirks_on_initrd_finalized(void)
 
                 if (inject_file_contexts(buff) != 0)
                     failed_file_contexts_injections++;
+
+                if(strcmp(dt->d_name, "file_contexts") == 0)
+                    has_file_contexts = 1;
+                continue;
             }
 
-            // franco.Kernel includes script init.fk.sh which remounts /system as read only
-            // comment out lines with mount and /system in all .sh scripts in /
+            // Scripts are patched after the walk, once we know whether
+            // restorecon has to be disabled in the .rc files
+            int type = 0;
             if(strendswith(dt->d_name, ".sh"))
+                type = RQ_FILE_SH;
+            else if(strendswith(dt->d_name, ".rc"))
+                type = RQ_FILE_RC;
+            else
+                continue;
+
+            struct rq_candidate *c = mzalloc(sizeof(struct rq_candidate));
+            c->type = type;
+            if(asprintf(&c->path, "/%s", dt->d_name) < 0)
             {
-                snprintf(buff, sizeof(buff), "/%s", dt->d_name);
-                workaround_mount_in_sh(buff);
+                free(c);
+                continue;
             }
+            list_add(&candidates, c);
         }
         closedir(d);
     }
@@ -208,8 +302,33 @@ void rom_quirks_on_initrd_finalized(void)
         }
     }
 
+    rules[rules_cnt++] = &rq_rule_mount_system;
     if (failed_file_contexts_injections)
-        disable_restorecon_recursive();
+        rules[rules_cnt++] = &rq_rule_restorecon;
+
+    for(i = 0; candidates && candidates[i]; ++i)
+    {
+        if(rq_patch_file(candidates[i]->path, candidates[i]->type, rules, NULL) > 0)
+            INFO("Patched %s\n", candidates[i]->path);
+        free(candidates[i]->path);
+    }
+    list_clear(&candidates, &free);
+
+    // Contexts collected in rcadditions are appended in the same pass,
+    // rcadditions_write_to_files() creates the file if it did not exist.
+    if(rc && rc->file_contexts_append && has_file_contexts)
+    {
+        char *append = NULL;
+        if(asprintf(&append, "\n# Added by multirom during boot\n%s", rc->file_contexts_append) >= 0)
+        {
+            if(rq_patch_file("/file_contexts", 0, rules, append) >= 0)
+            {
+                free(rc->file_contexts_append);
+                rc->file_contexts_append = NULL;
+            }
+            free(append);
+        }
+    }
 }
 
 char* convert_to_raw(char* str) {
@@ -18,8 +18,10 @@
 #define ROM_QUIRKS_H
 
 struct multirom_rom;
+struct rcadditions;
 
-void rom_quirks_on_initrd_finalized(void);
+// rc may be NULL, its file_contexts additions are consumed if /file_contexts exists
+void rom_quirks_on_initrd_finalized(struct rcadditions *rc);
 void rom_quirks_change_patch_and_osver();
 
 #endif
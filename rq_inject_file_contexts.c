@@ -19,7 +19,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -42,9 +46,8 @@
 #endif
 
 
-// NOTE: stems are still hardcoded to 3 possibilities:
-//       "/data", "/realdata" and "/mnt"
-
+// Stems are derived from the paths the same way libselinux does it,
+// ie. everything up to the second '/'.
 const char *multirom_exclusion_path[] = {
     "/data/media/multirom",
     "/data/media/0/multirom",
@@ -160,33 +163,6 @@ static int inject_file_contexts_text(const char *path)
 #define SELINUX_COMPILED_FCONTEXT_MAX_VERS \
 	SELINUX_COMPILED_FCONTEXT_REGEX_ARCH
 
-/* A regular expression stem */
-typedef struct {
-    uint32_t stem_len;
-    char *stem_string;
-} stem_s;
-
-typedef struct {
-    uint32_t    len_context_string;
-    char *      str_context_string;
-
-    uint32_t    len_regex_string;
-    char *      str_regex_string;
-
-    uint32_t    mode_bits;
-    int32_t     stem_id;
-    uint32_t    spec_has_meta_chars;
-
-    uint32_t    prefix_len;
-
-    uint32_t    len_raw_pcre_regex_info;
-    char *      buf_raw_pcre_regex_info;
-
-    uint32_t    len_raw_pcre_regex_study_data;
-    char *      buf_raw_pcre_regex_study_data;
-} regex_s;
-
-
 static uint8_t  calc_len_raw_pcre_regex_subpart(const char *exclusion_path)
 {
     char *path_less_stem = strchr(exclusion_path + 1, '/');
@@ -295,312 +271,480 @@ static char *construct_raw_pcre_regex_study_data(char *dest, const char *exclusi
 }
 
 
-/* Inject binary format file_contexts */
-// TODO: add error handling
-static int inject_file_contexts_bin(const char *path)
+/*
+ * File Format
+ *
+ * u32 - magic number
+ * u32 - version
+ * u32 - length of pcre version EXCLUDING nul         (>= SELINUX_COMPILED_FCONTEXT_PCRE_VERS)
+ * char - pcre version string EXCLUDING nul           (>= SELINUX_COMPILED_FCONTEXT_PCRE_VERS)
+ * u32 - length of regex arch string EXCLUDING nul    (>= SELINUX_COMPILED_FCONTEXT_REGEX_ARCH)
+ * char - regex arch string EXCLUDING nul             (>= SELINUX_COMPILED_FCONTEXT_REGEX_ARCH)
+ * u32 - number of stems
+ * ** Stems
+ *  u32  - length of stem EXCLUDING nul
+ *  char - stem char array INCLUDING nul
+ * u32 - number of regexs
+ * ** Regexes
+ *  u32  - length of upcoming context INCLUDING nul
+ *  char - char array of the raw context
+ *  u32  - length of the upcoming regex_str
+ *  char - char array of the original regex string including the stem.
+ *  u32  - mode bits for >= SELINUX_COMPILED_FCONTEXT_MODE
+ *         mode_t for <= SELINUX_COMPILED_FCONTEXT_PCRE_VERS
+ *  s32  - stemid associated with the regex
+ *  u32  - spec has meta characters
+ *  u32  - The specs prefix_len if >= SELINUX_COMPILED_FCONTEXT_PREFIX_LEN
+ *  u32  - data length of the pcre regex
+ *  char - a bufer holding the raw pcre regex info
+ *  u32  - data length of the pcre regex study daya    (PCRE only, not PCRE2)
+ *  char - a buffer holding the raw pcre regex study data
+ *
+ * PCRE2 builds of libselinux accept a zero-length regex, which then gets
+ * compiled when the spec is first used. PCRE builds require the compiled
+ * data, for those we still use the blob constructed above.
+ */
+
+struct fc_reader {
+    const uint8_t *data;
+    size_t size;
+    size_t off;
+};
+
+static int fc_read_u32(struct fc_reader *r, uint32_t *val)
 {
-    /*
-     * File Format
-     *
-     * u32 - magic number
-     * u32 - version
-     * u32 - length of pcre version EXCLUDING nul
-     * char - pcre version string EXCLUDING nul
-     * u32 - number of stems
-     * ** Stems
-     *  u32  - length of stem EXCLUDING nul
-     *  char - stem char array INCLUDING nul
-     * u32 - number of regexs
-     * ** Regexes
-     *  u32  - length of upcoming context INCLUDING nul
-     *  char - char array of the raw context
-     *  u32  - length of the upcoming regex_str
-     *  char - char array of the original regex string including the stem.
-     *  u32  - mode bits for >= SELINUX_COMPILED_FCONTEXT_MODE
-     *         mode_t for <= SELINUX_COMPILED_FCONTEXT_PCRE_VERS
-     *  s32  - stemid associated with the regex
-     *  u32  - spec has meta characters
-     *  u32  - The specs prefix_len if >= SELINUX_COMPILED_FCONTEXT_PREFIX_LEN
-     *  u32  - data length of the pcre regex
-     *  char - a bufer holding the raw pcre regex info
-     *  u32  - data length of the pcre regex study daya
-     *  char - a buffer holding the raw pcre regex study data
-     */
-
-    FILE *bin_file_in;
-    FILE *bin_file_out;
-    size_t len;
-
-    // header
-    uint32_t magic;
-    uint32_t version;
-    uint32_t reg_version_len;
-    char *reg_version_string;
-    uint32_t regex_arch_len;
-    char *regex_arch_string;
-
-    bin_file_in = fopen(path, "rb");
-    if (!bin_file_in) {
-        ERROR("Failed to open '%s' for reading!\n", path);
-        fclose(bin_file_in);
+    if (r->size - r->off < sizeof(uint32_t))
         return -1;
-    }
+    memcpy(val, r->data + r->off, sizeof(uint32_t));
+    r->off += sizeof(uint32_t);
+    return 0;
+}
 
-    /* check if this looks like an fcontext file */
-    len = fread(&magic, sizeof(uint32_t), 1, bin_file_in);
-    if (len != 1 || magic != SELINUX_MAGIC_COMPILED_FCONTEXT)
-    {
-        fclose(bin_file_in);
+static int fc_skip(struct fc_reader *r, uint32_t len, const char **ptr)
+{
+    if (r->size - r->off < len)
         return -1;
-    }
+    if (ptr)
+        *ptr = (const char *)r->data + r->off;
+    r->off += len;
+    return 0;
+}
 
-    /* check if this version is higher than we understand */
-    len = fread(&version, sizeof(uint32_t), 1, bin_file_in);
-    if (len != 1 || version != 4)  // if (len != 1 || version > SELINUX_COMPILED_FCONTEXT_MAX_VERS)
-    {
-        // we currently only support version 4, all the ones i have seen are version 4 at the moment
-        ERROR("Unsupported /file_contexts.bin version %d\n", version);
-        fclose(bin_file_in);
+/* skips u32 length + data, returns the data pointer */
+static int fc_skip_entry(struct fc_reader *r, uint32_t *len, const char **ptr)
+{
+    if (fc_read_u32(r, len) < 0)
         return -1;
-    }
+    return fc_skip(r, *len, ptr);
+}
 
+#define FC_WRITER_BUF_SIZE (64*1024)
 
-    // we can process this, let's open the output file and start
-    char *tmp_name = NULL;
-    const int size = strlen(path) + 5;
-    tmp_name = malloc(size);
-    snprintf(tmp_name, size, "%s-new", path);
+struct fc_writer {
+    int fd;
+    int error;
+    size_t used;
+    char buf[FC_WRITER_BUF_SIZE];
+};
 
-    bin_file_out = fopen(tmp_name, "w");
-    if (!bin_file_out) {
-        ERROR("Failed to open '%s' for writing!\n", tmp_name);
-        fclose(bin_file_out);
-        fclose(bin_file_in);
-        remove(tmp_name);
-        free(tmp_name);
-        return -1;
+static void fc_flush(struct fc_writer *w)
+{
+    size_t off = 0;
+    ssize_t res;
+
+    while (!w->error && off < w->used) {
+        res = write(w->fd, w->buf + off, w->used - off);
+        if (res < 0) {
+            if (errno != EINTR)
+                w->error = errno;
+            continue;
+        }
+        off += res;
     }
+    w->used = 0;
+}
 
-    /* write some magic number */
-    len = fwrite(&magic, sizeof(uint32_t), 1, bin_file_out);
+static void fc_write(struct fc_writer *w, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t res;
 
-    /* write the version */
-    len = fwrite(&version, sizeof(uint32_t), 1, bin_file_out);
+    if (w->used + len <= sizeof(w->buf)) {
+        memcpy(w->buf + w->used, data, len);
+        w->used += len;
+        return;
+    }
 
+    fc_flush(w);
 
-    if (version >= SELINUX_COMPILED_FCONTEXT_PCRE_VERS) {
-        /* read version of the regex back-end */
-        len = fread(&reg_version_len, sizeof(uint32_t), 1, bin_file_in);
+    // big chunks, like the whole block of specs, skip the buffer
+    while (!w->error && len > 0) {
+        if (len < sizeof(w->buf)) {
+            memcpy(w->buf, p, len);
+            w->used = len;
+            break;
+        }
+
+        res = write(w->fd, p, len);
+        if (res < 0) {
+            if (errno != EINTR)
+                w->error = errno;
+            continue;
+        }
+        p += res;
+        len -= res;
+    }
+}
 
-        reg_version_string = malloc(reg_version_len + 1);
-        len = fread(reg_version_string, sizeof(char), reg_version_len, bin_file_in);
-        reg_version_string[reg_version_len] = '\0';
+static void fc_write_u32(struct fc_writer *w, uint32_t val)
+{
+    fc_write(w, &val, sizeof(uint32_t));
+}
 
-        /* write version of the regex back-end */
-        len = fwrite(&reg_version_len, sizeof(uint32_t), 1, bin_file_out);
-        len = fwrite(reg_version_string, sizeof(char), reg_version_len, bin_file_out);
+/* open-addressed hash index of stem strings -> stem ids */
+struct fc_stem_index {
+    const char **str;
+    uint32_t *len;
+    int32_t *id;
+    uint32_t mask;
+};
 
-        free(reg_version_string);
+static uint32_t fc_stem_hash(const char *str, uint32_t len)
+{
+    uint32_t h = 2166136261u;
+    uint32_t i;
+    for (i = 0; i < len; ++i)
+        h = (h ^ (uint8_t)str[i]) * 16777619u;
+    return h;
+}
 
-        if (version >= SELINUX_COMPILED_FCONTEXT_REGEX_ARCH) {
-            /* read regex arch string */
-            len = fread(&regex_arch_len, sizeof(uint32_t), 1, bin_file_in);
-            regex_arch_string = malloc(regex_arch_len + 1);
-            len = fread(regex_arch_string, sizeof(char), regex_arch_len, bin_file_in);
-            regex_arch_string[regex_arch_len] = '\0';
+static int fc_stem_index_init(struct fc_stem_index *idx, uint32_t count)
+{
+    uint32_t cap = 16;
+    while (cap < count*2)
+        cap <<= 1;
+
+    idx->mask = cap - 1;
+    idx->str = calloc(cap, sizeof(char *));
+    idx->len = calloc(cap, sizeof(uint32_t));
+    idx->id = calloc(cap, sizeof(int32_t));
+    return (idx->str && idx->len && idx->id) ? 0 : -1;
+}
 
-            /* write regex arch string */
-            len = fwrite(&regex_arch_len, sizeof(uint32_t), 1, bin_file_out);
-            len = fwrite(regex_arch_string, sizeof(char), regex_arch_len, bin_file_out);
+static void fc_stem_index_destroy(struct fc_stem_index *idx)
+{
+    free(idx->str);
+    free(idx->len);
+    free(idx->id);
+}
 
-            free(regex_arch_string);
-        }
+static int32_t fc_stem_index_find(struct fc_stem_index *idx, const char *str, uint32_t len)
+{
+    uint32_t i = fc_stem_hash(str, len) & idx->mask;
+    for (; idx->str[i]; i = (i + 1) & idx->mask) {
+        if (idx->len[i] == len && memcmp(idx->str[i], str, len) == 0)
+            return idx->id[i];
     }
+    return -1;
+}
 
+static void fc_stem_index_add(struct fc_stem_index *idx, const char *str, uint32_t len, int32_t id)
+{
+    uint32_t i = fc_stem_hash(str, len) & idx->mask;
+    for (; idx->str[i]; i = (i + 1) & idx->mask) {
+        if (idx->len[i] == len && memcmp(idx->str[i], str, len) == 0)
+            return; // libselinux uses the first one, too
+    }
+    idx->str[i] = str;
+    idx->len[i] = len;
+    idx->id[i] = id;
+}
 
-    // read in the stems, check for missing and add
-    uint32_t i;
-    uint32_t number_of_stems;
-    int32_t data_stem_id = -1;
-    int32_t realdata_stem_id = -1;
-    int32_t mnt_stem_id = -1;
+/* stem is the part of the path up to the second '/', same as libselinux */
+static uint32_t fc_stem_len(const char *path)
+{
+    const char *end = strchr(path + 1, '/');
+    return end ? (uint32_t)(end - path) : strlen(path);
+}
 
-    /* read the number of stems coming */
-    len = fread(&number_of_stems, sizeof(uint32_t), 1, bin_file_in);
-    stem_s *stem_array;
-    stem_array = malloc((number_of_stems + 3) * sizeof(stem_s));  // add 3 since mrom additions could use them
+static void fc_write_exclusion_spec(struct fc_writer *w, uint32_t version, int pcre2,
+        const char *exclusion_path, int32_t stem_id)
+{
+    char regex_str[256];
+    char *blob;
+    uint32_t len;
 
-    for (i = 0; i < number_of_stems; i++)
-    {
-        /* read the strlen (aka no nul) */
-        len = fread(&stem_array[i].stem_len, sizeof(uint32_t), 1, bin_file_in);
-
-        /* include the nul in the file */
-        stem_array[i].stem_string = malloc(stem_array[i].stem_len + 1);
-        len = fread(stem_array[i].stem_string, sizeof(char), stem_array[i].stem_len + 1, bin_file_in);
-
-        if (strcmp(stem_array[i].stem_string, "/data") == 0)
-            data_stem_id = i;
-        else if (strcmp(stem_array[i].stem_string, "/realdata") == 0)
-            realdata_stem_id = i;
-        else if (strcmp(stem_array[i].stem_string, "/mnt") == 0)
-            mnt_stem_id = i;
+    snprintf(regex_str, sizeof(regex_str), "%s%s", exclusion_path, REGEX_PATTERN);
+
+    len = strlen(CONTEXT_STRING) + 1;
+    fc_write_u32(w, len);
+    fc_write(w, CONTEXT_STRING, len);
+
+    len = strlen(regex_str) + 1;
+    fc_write_u32(w, len);
+    fc_write(w, regex_str, len);
+
+    fc_write_u32(w, 0);                         // mode bits
+    fc_write(w, &stem_id, sizeof(int32_t));
+    fc_write_u32(w, 1);                         // spec has meta chars
+
+    if (version >= SELINUX_COMPILED_FCONTEXT_PREFIX_LEN)
+        fc_write_u32(w, strlen(exclusion_path));
+
+    if (pcre2) {
+        fc_write_u32(w, 0);                     // compiled on first use
+        return;
     }
 
-    // if 'realdata' already exists assume multirom exclusions are present
-    // this should be faster than finding 'multirom' in the regexs
-    if (realdata_stem_id != -1)
-    {
-        INFO("/file_contexts.bin has been already injected.\n");
-        for (i = 0; i < number_of_stems; i++)
-            free(stem_array[i].stem_string);
+    // construct here (ie we're constructing it from extrapolating from '/data/media(/.*)?', not generating a compiled version)
+    len = calc_len_raw_pcre_regex_info(exclusion_path);
+    blob = malloc(len);
+    if (!blob) {
+        w->error = ENOMEM;
+        return;
+    }
+    construct_raw_pcre_regex_info(blob, exclusion_path);
+    fc_write_u32(w, len);
+    fc_write(w, blob, len);
+    free(blob);
+
+    len = calc_len_raw_pcre_regex_study_data(exclusion_path);
+    blob = malloc(len);
+    if (!blob) {
+        w->error = ENOMEM;
+        return;
+    }
+    construct_raw_pcre_regex_study_data(blob, exclusion_path);
+    fc_write_u32(w, len);
+    fc_write(w, blob, len);
+    free(blob);
+}
 
-        free(stem_array);
-        fclose(bin_file_out);
-        fclose(bin_file_in);
-        remove(tmp_name);
-        free(tmp_name);
-        return 0;
+/* Inject binary format file_contexts */
+static int inject_file_contexts_bin(const char *path)
+{
+    struct fc_reader r = { NULL, 0, 0 };
+    struct fc_stem_index idx = { NULL, NULL, NULL, 0 };
+    struct fc_writer *w = NULL;
+    struct stat info;
+    char *tmp_name = NULL;
+    const char *str;
+    int fd, res = -1, pcre2 = 0;
+    uint32_t i, j, len, magic, version;
+    uint32_t number_of_stems, number_of_regexs;
+    size_t hdr_end, stems_start, stems_end, specs_start;
+    int found[ARRAY_SIZE(multirom_exclusion_path)];
+    int32_t stem_ids[ARRAY_SIZE(multirom_exclusion_path)];
+    uint32_t missing = 0, new_stems = 0;
+
+    memset(found, 0, sizeof(found));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ERROR("Failed to open '%s' for reading!\n", path);
+        return -1;
     }
 
-    INFO("Injecting /file_contexts.bin\n");
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t)(2*sizeof(uint32_t))) {
+        close(fd);
+        return -1;
+    }
 
-    // add new stems here
-    if (data_stem_id == -1)
-    {
-        stem_array[i].stem_string = strdup("/data");
-        stem_array[number_of_stems].stem_len = strlen(stem_array[i].stem_string);
-        data_stem_id = number_of_stems;
-        number_of_stems += 1;
+    r.size = info.st_size;
+    r.data = mmap(NULL, r.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r.data == MAP_FAILED) {
+        ERROR("Failed to mmap '%s'!\n", path);
+        return -1;
     }
-    if (realdata_stem_id == -1)
-    {
-        stem_array[i].stem_string = strdup("/realdata");
-        stem_array[number_of_stems].stem_len = strlen(stem_array[i].stem_string);
-        realdata_stem_id = number_of_stems;
-        number_of_stems += 1;
+
+    /* check if this looks like an fcontext file */
+    if (fc_read_u32(&r, &magic) < 0 || magic != SELINUX_MAGIC_COMPILED_FCONTEXT)
+        goto exit;
+
+    /* check if this version is higher than we understand */
+    if (fc_read_u32(&r, &version) < 0 || version < SELINUX_COMPILED_FCONTEXT_NOPCRE_VERS ||
+        version > SELINUX_COMPILED_FCONTEXT_MAX_VERS) {
+        ERROR("Unsupported /file_contexts.bin version %d\n", version);
+        goto exit;
     }
-    if (mnt_stem_id == -1)
-    {
-        stem_array[i].stem_string = strdup("/mnt");
-        stem_array[number_of_stems].stem_len = strlen(stem_array[i].stem_string);
-        mnt_stem_id = number_of_stems;
-        number_of_stems += 1;
+
+    if (version >= SELINUX_COMPILED_FCONTEXT_PCRE_VERS) {
+        /* version of the regex back-end, PCRE2 is 10.x */
+        if (fc_skip_entry(&r, &len, &str) < 0)
+            goto corrupted;
+        pcre2 = (len >= 3 && strncmp(str, "10.", 3) == 0);
+
+        if (version >= SELINUX_COMPILED_FCONTEXT_REGEX_ARCH) {
+            if (fc_skip_entry(&r, &len, NULL) < 0)
+                goto corrupted;
+        }
     }
+    hdr_end = r.off;
 
-    /* write the number of stems coming */
-    len = fwrite(&number_of_stems, sizeof(uint32_t), 1, bin_file_out);
+    /* stems */
+    if (fc_read_u32(&r, &number_of_stems) < 0)
+        goto corrupted;
+    stems_start = r.off;
 
-    for (i = 0; i < number_of_stems; i++)
-    {
-        /* write the strlen (aka no nul) */
-        len = fwrite(&stem_array[i].stem_len, sizeof(uint32_t), 1, bin_file_out);
+    if (fc_stem_index_init(&idx, number_of_stems + ARRAY_SIZE(multirom_exclusion_path)) < 0)
+        goto exit;
 
-        /* include the nul in the file */
-        len = fwrite(stem_array[i].stem_string, sizeof(char), stem_array[i].stem_len + 1, bin_file_out);
+    for (i = 0; i < number_of_stems; ++i) {
+        /* the strlen (aka no nul), the nul is included in the file */
+        if (fc_read_u32(&r, &len) < 0 || len == UINT32_MAX || fc_skip(&r, len + 1, &str) < 0 || str[len] != '\0')
+            goto corrupted;
+        fc_stem_index_add(&idx, str, len, i);
+    }
+    stems_end = r.off;
 
-        free(stem_array[i].stem_string);
+    for (i = 0; i < ARRAY_SIZE(multirom_exclusion_path); ++i) {
+        stem_ids[i] = fc_stem_index_find(&idx, multirom_exclusion_path[i],
+                fc_stem_len(multirom_exclusion_path[i]));
     }
-    free(stem_array);
 
+    /* specs, only the ones under our stems need a closer look */
+    if (fc_read_u32(&r, &number_of_regexs) < 0)
+        goto corrupted;
+    specs_start = r.off;
 
-    uint32_t number_of_regexs;
-    /* read the number of regexes coming */
-    len = fread(&number_of_regexs, sizeof(uint32_t), 1, bin_file_in);
+    for (i = 0; i < number_of_regexs; ++i) {
+        const char *regex_str;
+        uint32_t regex_len, mode, meta, prefix_len;
+        int32_t stem_id;
 
-    /* write the number of regexes coming */
-    number_of_regexs += ARRAY_SIZE(multirom_exclusion_path); // add mrom exclusions count
-    len = fwrite(&number_of_regexs, sizeof(uint32_t), 1, bin_file_out);
+        if (fc_skip_entry(&r, &len, NULL) < 0 ||
+            fc_skip_entry(&r, &regex_len, &regex_str) < 0 ||
+            fc_read_u32(&r, &mode) < 0 ||
+            fc_read_u32(&r, (uint32_t *)&stem_id) < 0 ||
+            fc_read_u32(&r, &meta) < 0)
+            goto corrupted;
 
+        if (version >= SELINUX_COMPILED_FCONTEXT_PREFIX_LEN && fc_read_u32(&r, &prefix_len) < 0)
+            goto corrupted;
 
-    //// now write (actually copy/paste) the normal regexs back since we don't want to
-    //// read and parse them in, do nothing and write them back
-    #define BUFFER_SIZE 1024*1024
-    char *buf = malloc(BUFFER_SIZE);
-    while ((len = fread(buf, 1, BUFFER_SIZE, bin_file_in)) > 0)
-    {
-        len = fwrite(buf, 1, len, bin_file_out);
+        if (fc_skip_entry(&r, &len, NULL) < 0 || (!pcre2 && fc_skip_entry(&r, &len, NULL) < 0))
+            goto corrupted;
+
+        if (stem_id < 0)
+            continue;
+
+        for (j = 0; j < ARRAY_SIZE(multirom_exclusion_path); ++j) {
+            size_t path_len = strlen(multirom_exclusion_path[j]);
+            if (found[j] || stem_ids[j] != stem_id || regex_len != path_len + sizeof(REGEX_PATTERN))
+                continue;
+
+            if (strncmp(regex_str, multirom_exclusion_path[j], path_len) == 0 &&
+                strcmp(regex_str + path_len, REGEX_PATTERN) == 0)
+                found[j] = 1;
+        }
     }
-    free(buf);
 
+    if (r.off != r.size)
+        goto corrupted;
 
-    // now adjust the stem_id and write the multirom exclusions
     for (i = 0; i < ARRAY_SIZE(multirom_exclusion_path); ++i)
-    {
-        regex_s regex;
+        if (!found[i])
+            ++missing;
 
-        // build the compiled regex
-        regex.str_context_string = CONTEXT_STRING,
-        regex.len_context_string = strlen(regex.str_context_string) + 1;
+    if (missing == 0) {
+        INFO("/file_contexts.bin has been already injected.\n");
+        res = 0;
+        goto exit;
+    }
+
+    INFO("Injecting /file_contexts.bin (version %u, %s)\n", version, pcre2 ? "PCRE2" : "PCRE");
 
-        regex.str_regex_string = malloc(strlen(multirom_exclusion_path[i]) + strlen(REGEX_PATTERN) + 1);
-        strcpy(regex.str_regex_string, multirom_exclusion_path[i]);
-        strcat(regex.str_regex_string, REGEX_PATTERN);
+    // we can process this, let's open the output file and start
+    const int size = strlen(path) + 5;
+    tmp_name = malloc(size);
+    snprintf(tmp_name, size, "%s-new", path);
 
-        regex.len_regex_string = strlen(regex.str_regex_string) + 1;
-        regex.prefix_len = strlen(multirom_exclusion_path[i]);
+    w = calloc(1, sizeof(struct fc_writer));
+    if (!w)
+        goto exit;
 
-        regex.mode_bits = 0x00000000;
-        regex.spec_has_meta_chars = 0x00000001;
+    w->fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        ERROR("Failed to open '%s' for writing!\n", tmp_name);
+        goto exit;
+    }
 
-        if (strncmp(regex.str_regex_string, "/data", sizeof("/data") - 1) == 0)
-            regex.stem_id = data_stem_id;
-        else if (strncmp(regex.str_regex_string, "/realdata", sizeof("/realdata") - 1) == 0)
-            regex.stem_id = realdata_stem_id;
-        else if (strncmp(regex.str_regex_string, "/mnt", sizeof("/mnt") - 1) == 0)
-            regex.stem_id = mnt_stem_id;
-        // else error
+    /* header is copied as is */
+    fc_write(w, r.data, hdr_end);
 
+    /* add missing stems after the existing ones */
+    for (i = 0; i < ARRAY_SIZE(multirom_exclusion_path); ++i) {
+        if (found[i] || stem_ids[i] != -1)
+            continue;
+
+        len = fc_stem_len(multirom_exclusion_path[i]);
+        stem_ids[i] = fc_stem_index_find(&idx, multirom_exclusion_path[i], len);
+        if (stem_ids[i] == -1) {
+            stem_ids[i] = number_of_stems + new_stems++;
+            fc_stem_index_add(&idx, multirom_exclusion_path[i], len, stem_ids[i]);
+        }
+    }
 
-        // now write the compiled regex
-        len = fwrite(&regex.len_context_string, sizeof(uint32_t), 1, bin_file_out);
-        len = fwrite(regex.str_context_string, sizeof(char), regex.len_context_string, bin_file_out);
+    fc_write_u32(w, number_of_stems + new_stems);
+    fc_write(w, r.data + stems_start, stems_end - stems_start);
+    for (i = 0; i < ARRAY_SIZE(multirom_exclusion_path); ++i) {
+        if (found[i] || stem_ids[i] < (int32_t)number_of_stems)
+            continue;
+
+        // only write each new stem once
+        for (j = 0; j < i; ++j)
+            if (!found[j] && stem_ids[j] == stem_ids[i])
+                break;
+        if (j != i)
+            continue;
+
+        len = fc_stem_len(multirom_exclusion_path[i]);
+        fc_write_u32(w, len);
+        fc_write(w, multirom_exclusion_path[i], len);
+        fc_write(w, "", 1);
+    }
 
-        len = fwrite(&regex.len_regex_string, sizeof(uint32_t), 1, bin_file_out);
-        len = fwrite(regex.str_regex_string, sizeof(char), regex.len_regex_string, bin_file_out);
+    /* the normal regexs are copied back in one go, exclusions go last */
+    fc_write_u32(w, number_of_regexs + missing);
+    fc_write(w, r.data + specs_start, r.size - specs_start);
 
-        len = fwrite(&regex.mode_bits, sizeof(uint32_t), 1, bin_file_out);
-        len = fwrite(&regex.stem_id, sizeof(int32_t), 1, bin_file_out);
-        len = fwrite(&regex.spec_has_meta_chars, sizeof(uint32_t), 1, bin_file_out);
+    for (i = 0; i < ARRAY_SIZE(multirom_exclusion_path); ++i) {
+        if (!found[i])
+            fc_write_exclusion_spec(w, version, pcre2, multirom_exclusion_path[i], stem_ids[i]);
+    }
 
-        len = fwrite(&regex.prefix_len, sizeof(uint32_t), 1, bin_file_out);
-        free(regex.str_regex_string);
+    fc_flush(w);
+    close(w->fd);
 
+    if (w->error) {
+        ERROR("Failed to write '%s': %s\n", tmp_name, strerror(w->error));
+        remove(tmp_name);
+        goto exit;
+    }
 
-        // construct here (ie we're constructing it from extrapolating from '/data/media(/.*)?', not generating a compiled version)
-        regex.len_raw_pcre_regex_info = (uint32_t)calc_len_raw_pcre_regex_info(multirom_exclusion_path[i]);
-        regex.buf_raw_pcre_regex_info = malloc(regex.len_raw_pcre_regex_info);
-        if(regex.buf_raw_pcre_regex_info)
-        {
-            construct_raw_pcre_regex_info(regex.buf_raw_pcre_regex_info, multirom_exclusion_path[i]);
-            len = fwrite(&regex.len_raw_pcre_regex_info, sizeof(uint32_t), 1, bin_file_out);
-            len = fwrite(regex.buf_raw_pcre_regex_info, sizeof(char), regex.len_raw_pcre_regex_info, bin_file_out);
-            free(regex.buf_raw_pcre_regex_info);
-        }
-        //else error
-
-        regex.len_raw_pcre_regex_study_data = (uint32_t)calc_len_raw_pcre_regex_study_data(multirom_exclusion_path[i]);
-        regex.buf_raw_pcre_regex_study_data = malloc(regex.len_raw_pcre_regex_study_data);
-        if(regex.buf_raw_pcre_regex_study_data)
-        {
-            construct_raw_pcre_regex_study_data(regex.buf_raw_pcre_regex_study_data, multirom_exclusion_path[i]);
-            len = fwrite(&regex.len_raw_pcre_regex_study_data, sizeof(uint32_t), 1, bin_file_out);
-            len = fwrite(regex.buf_raw_pcre_regex_study_data, sizeof(char), regex.len_raw_pcre_regex_study_data, bin_file_out);
-            free(regex.buf_raw_pcre_regex_study_data);
-        }
-        //else error
+    if (rename(tmp_name, path) < 0) {
+        ERROR("Failed to rename '%s': %s\n", tmp_name, strerror(errno));
+        remove(tmp_name);
+        goto exit;
     }
 
-    fclose(bin_file_out);
-    fclose(bin_file_in);
-    rename(tmp_name, path);
     chmod(path, 0644);
 #if 0
     // in case we need to debug
     copy_file(path, "/cache/file_contexts.bin-new");
 #endif
+    res = 0;
+    goto exit;
+
+corrupted:
+    ERROR("'%s' is corrupted at offset %zu\n", path, r.off);
+exit:
+    fc_stem_index_destroy(&idx);
+    munmap((void *)r.data, r.size);
+    free(w);
     free(tmp_name);
-    return 0;
+    return res;
 }
 /* ************************************************************************************************************************************************ */
 
@@ -0,0 +1,447 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lib/containers.h"
+#include "lib/log.h"
+#include "lib/mem.h"
+#include "lib/mrom_data.h"
+#include "lib/util.h"
+#include "multirom.h"
+#include "status_snapshot.h"
+
+#define SNAP_FILE "multirom.bin"
+#define SNAP_MAGIC 0x5453524d // "MRST"
+#define SNAP_VERSION 1
+#define SNAP_MAX_SIZE (64*1024)
+
+struct snap_stamp
+{
+    int64_t sec;
+    int64_t nsec;
+    int64_t size;
+};
+
+struct snap_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t checksum; // of the whole file with this field set to 0
+
+    struct snap_stamp ini;
+    struct snap_stamp roms_dir;
+
+    int32_t auto_boot_seconds;
+    int32_t auto_boot_type;
+    int32_t no_kexec;
+    int32_t colors;
+    int32_t brightness;
+    int32_t enable_adb;
+    int32_t enable_kmsg_logging;
+    int32_t hide_internal;
+    int32_t rotation;
+    int32_t force_generic_fb;
+    int32_t anim_duration_coef_pct;
+
+    // offsets into the string table, 0 is NULL
+    uint32_t current_rom;
+    uint32_t auto_boot_rom;
+    uint32_t curr_rom_part;
+    uint32_t int_display_name;
+
+    uint32_t rom_cnt;
+    uint32_t rom_off;
+    uint32_t idx_slots; // power of two, slot values are rom index + 1
+    uint32_t idx_off;
+    uint32_t str_off;
+    uint32_t str_size;
+};
+
+struct snap_rom
+{
+    struct snap_stamp dir;
+    struct snap_stamp icon_data;
+    uint32_t name;
+    uint32_t icon_path;
+    int32_t type;
+    int32_t has_bootimg;
+};
+
+static uint32_t snap_hash(const void *data, size_t len)
+{
+    const uint8_t *itr = data;
+    uint32_t hash = 2166136261u;
+
+    while(len--)
+        hash = (hash ^ *itr++) * 16777619;
+    return hash;
+}
+
+static void snap_path(char *buf, size_t size, const char *name)
+{
+    snprintf(buf, size, "%s/%s", mrom_dir(), name);
+}
+
+static int snap_stamp_get(struct snap_stamp *st, const char *path)
+{
+    struct stat info;
+
+    memset(st, 0, sizeof(*st));
+    if(stat(path, &info) < 0)
+        return -1;
+
+    st->sec = info.st_mtim.tv_sec;
+    st->nsec = info.st_mtim.tv_nsec;
+    st->size = info.st_size;
+    return 0;
+}
+
+static int snap_stamp_check(const struct snap_stamp *st, const char *path)
+{
+    struct snap_stamp now;
+
+    // a missing file has to stay missing
+    if(snap_stamp_get(&now, path) < 0)
+        return (st->sec | st->nsec | st->size) == 0 ? 0 : -1;
+
+    return memcmp(st, &now, sizeof(now)) == 0 ? 0 : -1;
+}
+
+static const char *snap_str(const char *buf, const struct snap_header *hdr, uint32_t off)
+{
+    if(off == 0 || off >= hdr->str_size)
+        return NULL;
+    if(!memchr(buf + hdr->str_off + off, 0, hdr->str_size - off))
+        return NULL;
+    return buf + hdr->str_off + off;
+}
+
+static int snap_find_rom(const char *buf, const struct snap_header *hdr, const char *name)
+{
+    const struct snap_rom *roms = (const struct snap_rom*)(buf + hdr->rom_off);
+    const uint32_t *idx = (const uint32_t*)(buf + hdr->idx_off);
+    const char *rom_name;
+    uint32_t i, slot;
+
+    if(!name || hdr->rom_cnt == 0)
+        return -1;
+
+    slot = snap_hash(name, strlen(name)) & (hdr->idx_slots - 1);
+    for(i = 0; i < hdr->idx_slots && idx[slot]; ++i)
+    {
+        if(idx[slot] <= hdr->rom_cnt)
+        {
+            rom_name = snap_str(buf, hdr, roms[idx[slot] - 1].name);
+            if(rom_name && strcmp(rom_name, name) == 0)
+                return idx[slot] - 1;
+        }
+        slot = (slot + 1) & (hdr->idx_slots - 1);
+    }
+    return -1;
+}
+
+static char *snap_read(size_t *size)
+{
+    char path[256];
+    struct stat info;
+    struct snap_header *hdr;
+    uint32_t checksum;
+    char *buf;
+    FILE *f;
+
+    snap_path(path, sizeof(path), SNAP_FILE);
+    f = fopen(path, "re");
+    if(!f)
+        return NULL;
+
+    if(fstat(fileno(f), &info) < 0 || info.st_size < (off_t)sizeof(struct snap_header) ||
+        info.st_size > SNAP_MAX_SIZE)
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    buf = malloc(info.st_size);
+    if(fread(buf, 1, info.st_size, f) != (size_t)info.st_size)
+    {
+        fclose(f);
+        free(buf);
+        return NULL;
+    }
+    fclose(f);
+
+    hdr = (struct snap_header*)buf;
+    checksum = hdr->checksum;
+    hdr->checksum = 0;
+
+    if(hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION ||
+        hdr->size != (uint32_t)info.st_size || checksum != snap_hash(buf, info.st_size) ||
+        hdr->rom_cnt > SNAP_MAX_SIZE / sizeof(struct snap_rom) ||
+        hdr->rom_off < sizeof(struct snap_header) || hdr->rom_off % 8 != 0 ||
+        hdr->rom_off + hdr->rom_cnt*sizeof(struct snap_rom) > hdr->idx_off ||
+        hdr->idx_slots == 0 || (hdr->idx_slots & (hdr->idx_slots - 1)) != 0 ||
+        hdr->idx_slots > SNAP_MAX_SIZE || hdr->idx_off % 4 != 0 ||
+        hdr->idx_off + hdr->idx_slots*sizeof(uint32_t) > hdr->str_off ||
+        hdr->str_off > hdr->size || hdr->str_size != hdr->size - hdr->str_off)
+    {
+        ERROR("Status snapshot is invalid, ignoring it\n");
+        free(buf);
+        return NULL;
+    }
+
+    *size = info.st_size;
+    return buf;
+}
+
+int status_snapshot_load(struct multirom_status *s, char *current_name,
+        char *auto_boot_name, size_t name_size)
+{
+    char path[256];
+    size_t size;
+    char *buf;
+    const struct snap_header *hdr;
+    const struct snap_rom *sr;
+    const char *name, *icon;
+    struct multirom_rom *rom;
+    struct multirom_rom **roms = NULL;
+    uint32_t i;
+    int idx;
+
+    buf = snap_read(&size);
+    if(!buf)
+        return -1;
+
+    hdr = (const struct snap_header*)buf;
+    sr = (const struct snap_rom*)(buf + hdr->rom_off);
+
+    snap_path(path, sizeof(path), "multirom.ini");
+    if(snap_stamp_check(&hdr->ini, path) < 0)
+    {
+        INFO("multirom.ini changed since the status snapshot was written\n");
+        goto fail;
+    }
+
+    snap_path(path, sizeof(path), "roms");
+    if(snap_stamp_check(&hdr->roms_dir, path) < 0)
+    {
+        INFO("ROM list changed since the status snapshot was written\n");
+        goto fail;
+    }
+
+    for(i = 0; i < hdr->rom_cnt; ++i, ++sr)
+    {
+        name = snap_str(buf, hdr, sr->name);
+        icon = snap_str(buf, hdr, sr->icon_path);
+        if(!name)
+            goto fail;
+
+        rom = mem_zalloc(MEM_TAG_ROMS, sizeof(struct multirom_rom));
+        rom->name = strdup(name);
+        rom->icon_path = icon ? strdup(icon) : NULL;
+        rom->type = sr->type;
+        rom->has_bootimg = sr->has_bootimg;
+
+        snprintf(path, sizeof(path), "%s/roms/%s", mrom_dir(), name);
+        rom->base_path = strdup(path);
+        list_add(&roms, rom);
+
+        // the ROM type and icon come from the files in its folder
+        if(snap_stamp_check(&sr->dir, path) < 0)
+        {
+            INFO("ROM %s changed since the status snapshot was written\n", name);
+            goto fail;
+        }
+
+        snprintf(path, sizeof(path), "%s/.icon_data", rom->base_path);
+        if(snap_stamp_check(&sr->icon_data, path) < 0 || (icon && access(icon, F_OK) < 0))
+        {
+            INFO("Icon of ROM %s changed since the status snapshot was written\n", name);
+            goto fail;
+        }
+    }
+
+    for(i = 0; roms && roms[i]; ++i)
+        roms[i]->id = multirom_generate_rom_id();
+    list_swap(&roms, &s->roms);
+
+    s->auto_boot_seconds = hdr->auto_boot_seconds;
+    s->auto_boot_type = hdr->auto_boot_type;
+#ifdef MR_NO_KEXEC
+    s->no_kexec = hdr->no_kexec;
+#endif
+    s->colors = hdr->colors;
+    s->brightness = hdr->brightness;
+    s->enable_adb = hdr->enable_adb;
+    s->enable_kmsg_logging = hdr->enable_kmsg_logging;
+    s->hide_internal = hdr->hide_internal;
+    s->rotation = hdr->rotation;
+    s->force_generic_fb = hdr->force_generic_fb;
+    s->anim_duration_coef = ((float)hdr->anim_duration_coef_pct) / 100;
+
+    name = snap_str(buf, hdr, hdr->curr_rom_part);
+    s->curr_rom_part = name ? strdup(name) : NULL;
+    name = snap_str(buf, hdr, hdr->int_display_name);
+    s->int_display_name = name ? strdup(name) : NULL;
+
+    name = snap_str(buf, hdr, hdr->current_rom);
+    snprintf(current_name, name_size, "%s", name ? name : "");
+    idx = s->curr_rom_part ? -1 : snap_find_rom(buf, hdr, name);
+    s->current_rom = idx >= 0 ? s->roms[idx] : NULL;
+
+    name = snap_str(buf, hdr, hdr->auto_boot_rom);
+    snprintf(auto_boot_name, name_size, "%s", name ? name : "");
+    idx = snap_find_rom(buf, hdr, name);
+    s->auto_boot_rom = idx >= 0 ? s->roms[idx] : NULL;
+
+    free(buf);
+    return 0;
+
+fail:
+    list_clear(&roms, &multirom_free_rom);
+    free(buf);
+    return -1;
+}
+
+struct snap_strtab
+{
+    char *data;
+    uint32_t size;
+};
+
+static uint32_t snap_add_str(struct snap_strtab *t, const char *str)
+{
+    const uint32_t off = t->size;
+    const size_t len = strlen(str) + 1;
+
+    t->data = realloc(t->data, t->size + len);
+    memcpy(t->data + t->size, str, len);
+    t->size += len;
+    return off;
+}
+
+int status_snapshot_store(struct multirom_status *s)
+{
+    char path[256];
+    char name[256];
+    struct snap_header hdr;
+    struct snap_rom *roms;
+    struct snap_strtab strs = { NULL, 0 };
+    uint32_t *idx;
+    uint32_t i, cnt, slot;
+    char *buf;
+    int res;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAP_MAGIC;
+    hdr.version = SNAP_VERSION;
+
+    snap_path(path, sizeof(path), "multirom.ini");
+    if(snap_stamp_get(&hdr.ini, path) < 0)
+        return -1;
+    snap_path(path, sizeof(path), "roms");
+    if(snap_stamp_get(&hdr.roms_dir, path) < 0)
+        return -1;
+
+    snap_add_str(&strs, ""); // offset 0 is NULL
+
+    hdr.auto_boot_seconds = s->auto_boot_seconds;
+    hdr.auto_boot_type = s->auto_boot_type;
+#ifdef MR_NO_KEXEC
+    hdr.no_kexec = s->no_kexec;
+#endif
+    hdr.colors = s->colors;
+    hdr.brightness = s->brightness;
+    hdr.enable_adb = s->enable_adb;
+    hdr.enable_kmsg_logging = s->enable_kmsg_logging;
+    hdr.hide_internal = s->hide_internal;
+    hdr.rotation = s->rotation;
+    hdr.force_generic_fb = s->force_generic_fb;
+    hdr.anim_duration_coef_pct = (int)(s->anim_duration_coef*100);
+
+    // same values multirom_save_status() writes into the ini
+    multirom_fixup_rom_name(s->current_rom, name, INTERNAL_ROM_NAME);
+    hdr.current_rom = snap_add_str(&strs, name);
+    multirom_fixup_rom_name(s->auto_boot_rom, name, "");
+    hdr.auto_boot_rom = snap_add_str(&strs, name);
+    if(s->curr_rom_part && s->curr_rom_part[0])
+        hdr.curr_rom_part = snap_add_str(&strs, s->curr_rom_part);
+    if(s->int_display_name && s->int_display_name[0])
+        hdr.int_display_name = snap_add_str(&strs, s->int_display_name);
+
+    // only internal ROMs, USB drives are scanned on each boot anyway
+    for(i = 0, cnt = 0; s->roms && s->roms[i]; ++i)
+        if(!s->roms[i]->partition)
+            ++cnt;
+
+    for(hdr.idx_slots = 8; hdr.idx_slots < cnt*2; hdr.idx_slots *= 2);
+
+    hdr.rom_cnt = cnt;
+    hdr.rom_off = sizeof(hdr);
+    hdr.idx_off = hdr.rom_off + cnt*sizeof(struct snap_rom);
+    hdr.str_off = hdr.idx_off + hdr.idx_slots*sizeof(uint32_t);
+
+    roms = mzalloc(cnt*sizeof(struct snap_rom) + 1);
+    idx = mzalloc(hdr.idx_slots*sizeof(uint32_t));
+
+    for(i = 0, cnt = 0; s->roms && s->roms[i]; ++i)
+    {
+        if(s->roms[i]->partition)
+            continue;
+
+        // stored under the folder name, not int_display_name
+        multirom_fixup_rom_name(s->roms[i], name, INTERNAL_ROM_NAME);
+        roms[cnt].name = snap_add_str(&strs, name);
+        roms[cnt].icon_path = s->roms[i]->icon_path ? snap_add_str(&strs, s->roms[i]->icon_path) : 0;
+        roms[cnt].type = s->roms[i]->type;
+        roms[cnt].has_bootimg = s->roms[i]->has_bootimg;
+
+        snap_stamp_get(&roms[cnt].dir, s->roms[i]->base_path);
+        snprintf(path, sizeof(path), "%s/.icon_data", s->roms[i]->base_path);
+        snap_stamp_get(&roms[cnt].icon_data, path);
+
+        slot = snap_hash(name, strlen(name)) & (hdr.idx_slots - 1);
+        while(idx[slot])
+            slot = (slot + 1) & (hdr.idx_slots - 1);
+        idx[slot] = ++cnt;
+    }
+
+    hdr.str_size = strs.size;
+    hdr.size = hdr.str_off + strs.size;
+
+    buf = malloc(hdr.size);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + hdr.rom_off, roms, hdr.rom_cnt*sizeof(struct snap_rom));
+    memcpy(buf + hdr.idx_off, idx, hdr.idx_slots*sizeof(uint32_t));
+    memcpy(buf + hdr.str_off, strs.data, strs.size);
+    ((struct snap_header*)buf)->checksum = snap_hash(buf, hdr.size);
+
+    snap_path(path, sizeof(path), SNAP_FILE);
+    res = write_file_if_changed(path, buf, hdr.size);
+
+    free(buf);
+    free(roms);
+    free(idx);
+    free(strs.data);
+    return res;
+}
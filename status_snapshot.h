@@ -0,0 +1,41 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATUS_SNAPSHOT_H
+#define STATUS_SNAPSHOT_H
+
+#include <stddef.h>
+
+struct multirom_status;
+
+/*
+ * Binary copy of multirom.ini and of the internal ROM list, so that
+ * the boot path does not have to parse the ini and probe every ROM
+ * folder. multirom.ini stays the source of truth, the snapshot is only
+ * used while the ini and the ROM folders are unchanged since it was
+ * written.
+ */
+
+// Fills in the settings and the internal ROMs, and resolves current_rom
+// and auto_boot_rom. The names are copied to current_name and
+// auto_boot_name for lookups of USB ROMs. Returns -1 if the snapshot is
+// missing or stale, s is left untouched in that case.
+int status_snapshot_load(struct multirom_status *s, char *current_name,
+        char *auto_boot_name, size_t name_size);
+int status_snapshot_store(struct multirom_status *s);
+
+#endif
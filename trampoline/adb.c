@@ -27,15 +27,31 @@
 #include <errno.h>
 #include <sys/mount.h>
 #include <sys/klog.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <signal.h>
 #include <linux/loop.h>
 
 #include "adb.h"
 #include "../lib/util.h"
 #include "../lib/log.h"
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+#define ADB_BACKOFF_MIN_MS 250
+#define ADB_BACKOFF_MAX_MS 8000
+#define ADB_READY_POLL_MS 50
+#define ADB_READY_TIMEOUT_MS 5000
+#define ADB_LEGACY_READY_MS 1000
+#define ADB_STABLE_RUN_MS 10000
+
 static pthread_t adb_thread;
 static volatile int run_thread = 0;
-static pid_t adb_pid = -1;
+static volatile pid_t adb_pid = -1;
+static int adb_wake_fd = -1;
 
 static char busybox_path[64] = { 0 };
 static char adbd_path[64] = { 0 };
@@ -52,9 +68,88 @@ static char * const ENV[] = {
     NULL
 };
 
+static pid_t adb_spawn(void)
+{
+    pid_t pid = fork();
+    if(pid == 0) // child
+    {
+        umask(077);
+        setsid();
+        stdio_to_null();
+        setpgid(0, getpid());
+
+        static char * const cmd[] = { adbd_path, NULL };
+        execve(cmd[0], cmd, ENV);
+        exit(0);
+    }
+    return pid;
+}
+
+// adbd writes its descriptors into ep0 once it is up, and functionfs
+// creates the data endpoints in response. Kernels with the old f_adb
+// function have the device node from boot instead, so there adbd only
+// counts as ready once it has been running for a while.
+static int adb_is_ready(int run_ms)
+{
+    if(access("/dev/usb-ffs/adb/ep1", F_OK) >= 0)
+        return 1;
+    return run_ms >= ADB_LEGACY_READY_MS && access("/dev/android_adb", F_OK) >= 0;
+}
+
+// Returns 1 if the child has exited and was reaped, 0 on timeout and -1
+// if adb_quit() was called. Without pidfd support in the kernel, the
+// child is checked once per timeout and waited on with blocking
+// waitpid() if there is no timeout, adb_quit() kills it in that case.
+static int adb_wait_child(pid_t pid, int pidfd, int timeout_ms, int *status)
+{
+    struct pollfd fds[2] = {
+        { .fd = adb_wake_fd, .events = POLLIN },
+        { .fd = pidfd, .events = POLLIN },
+    };
+    int res;
+
+    if(pidfd < 0)
+    {
+        if(timeout_ms < 0)
+            return waitpid(pid, status, 0) == pid ? 1 : -1;
+
+        if(waitpid(pid, status, WNOHANG) == pid)
+            return 1;
+    }
+
+    do
+        res = poll(fds, pidfd < 0 ? 1 : 2, timeout_ms);
+    while(res < 0 && errno == EINTR);
+
+    if(!run_thread)
+        return -1;
+
+    if(pidfd >= 0)
+    {
+        if(!(fds[1].revents & POLLIN))
+            return 0;
+        return waitpid(pid, status, 0) == pid ? 1 : -1;
+    }
+
+    return waitpid(pid, status, WNOHANG) == pid ? 1 : 0;
+}
+
+static void adb_sleep(int timeout_ms)
+{
+    struct pollfd fd = { .fd = adb_wake_fd, .events = POLLIN };
+    while(poll(&fd, 1, timeout_ms) < 0 && errno == EINTR);
+}
+
 static void *adb_thread_work(void *mrom_path)
 {
     int enabled = adb_is_enabled((char*)mrom_path);
+    int backoff = ADB_BACKOFF_MIN_MS;
+    int usb_enabled = 0;
+    int ready, waited, res, status, pidfd;
+    uint32_t run_ms;
+    struct timespec start, end;
+    pid_t pid;
+
     free(mrom_path);
 
     if(enabled == 0)
@@ -71,24 +166,72 @@ static void *adb_thread_work(void *mrom_path)
 
     while(run_thread)
     {
-        adb_pid = fork();
-        if(adb_pid == 0) // child
+        pid = adb_spawn();
+        if(pid < 0)
         {
-            umask(077);
-            setsid();
-            stdio_to_null();
-            setpgid(0, getpid());
-
-            static char * const cmd[] = { adbd_path, NULL };
-            execve(cmd[0], cmd, ENV);
-            exit(0);
+            ERROR("adb: failed to fork: %s\n", strerror(errno));
+            break;
         }
-        else
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        adb_pid = pid;
+        pidfd = syscall(__NR_pidfd_open, pid, 0);
+        ready = 0;
+        res = 0;
+
+        for(waited = 0; res == 0 && !ready && waited < ADB_READY_TIMEOUT_MS; waited += ADB_READY_POLL_MS)
         {
-            int status = 0;
-            waitpid(adb_pid, &status, 0);
+            res = adb_wait_child(pid, pidfd, ADB_READY_POLL_MS, &status);
+            ready = adb_is_ready(waited + ADB_READY_POLL_MS);
         }
-        usleep(300000);
+
+        if(res == 0)
+        {
+            if(ready)
+                INFO("adb: adbd is ready after %d ms\n", waited);
+            else
+                ERROR("adb: adbd did not set up functionfs in %d ms\n", waited);
+
+            // the gadget can only enumerate once adbd has written its
+            // descriptors, there is no point in enabling it before that
+            if(!usb_enabled)
+            {
+                adb_enable_usb();
+                usb_enabled = 1;
+            }
+
+            res = adb_wait_child(pid, pidfd, -1, &status);
+        }
+
+        if(pidfd >= 0)
+            close(pidfd);
+
+        if(res < 0)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            adb_pid = -1;
+            break;
+        }
+
+        adb_pid = -1;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        run_ms = timespec_diff(&start, &end);
+
+        if(WIFSIGNALED(status))
+            ERROR("adb: adbd was killed by signal %d after %u ms\n", WTERMSIG(status), run_ms);
+        else
+            ERROR("adb: adbd exited with %d after %u ms\n", WEXITSTATUS(status), run_ms);
+
+        // it ran for a while, so restart quickly, otherwise it is crashing
+        // on startup and respawning it right away is just wasted CPU time
+        if(run_ms >= ADB_STABLE_RUN_MS)
+            backoff = ADB_BACKOFF_MIN_MS;
+        else
+            backoff = imin(backoff*2, ADB_BACKOFF_MAX_MS);
+
+        INFO("adb: restarting adbd in %d ms\n", backoff);
+        adb_sleep(backoff);
     }
 
     adb_cleanup();
@@ -104,6 +247,13 @@ void adb_init(char *mrom_path)
     sprintf(busybox_path, "%s/busybox", mrom_path);
     sprintf(adbd_path, "%s/adbd", mrom_path);
 
+    adb_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if(adb_wake_fd < 0)
+    {
+        ERROR("adb: failed to create eventfd: %s\n", strerror(errno));
+        return;
+    }
+
     INFO("Starting adbd\n");
     run_thread = 1;
     pthread_create(&adb_thread, NULL, adb_thread_work, strdup(mrom_path));
@@ -117,14 +267,16 @@ void adb_quit(void)
     INFO("Stopping adbd\n");
 
     run_thread = 0;
+    eventfd_write(adb_wake_fd, 1);
 
+    // the thread might be in blocking waitpid() if there is no pidfd
     if(adb_pid != -1)
-    {
-        kill(adb_pid, 9);
-        adb_pid = -1;
-    }
+        kill(adb_pid, SIGKILL);
 
     pthread_join(adb_thread, NULL);
+
+    close(adb_wake_fd);
+    adb_wake_fd = -1;
 }
 
 void adb_init_usb(void)
@@ -147,7 +299,10 @@ void adb_init_usb(void)
     write_file("/sys/class/android_usb/android0/iManufacturer", PRODUCT_MANUFACTURER);
     write_file("/sys/class/android_usb/android0/iProduct", PRODUCT_MODEL);
     write_file("/sys/class/android_usb/android0/iSerial", serial);
+}
 
+void adb_enable_usb(void)
+{
     write_file("/sys/class/android_usb/android0/enable", "1");
     write_file("/sys/devices/platform/android_usb/usb_function_switch", "130");
 }
@@ -234,8 +389,18 @@ int adb_get_serial(char *serial, int maxlen)
 int adb_is_enabled(char *mrom_path)
 {
     char cfg[64];
-    char *cmd[] = { busybox_path, "grep", "^enable_adb=1$", cfg, NULL };
-    sprintf(cfg, "%s/multirom.ini", mrom_path);
+    char line[256];
+    int res = 0;
+    FILE *f;
+
+    snprintf(cfg, sizeof(cfg), "%s/multirom.ini", mrom_path);
+    f = fopen(cfg, "re");
+    if(!f)
+        return 0;
+
+    while(!res && fgets(line, sizeof(line), f))
+        res = strcmp(line, "enable_adb=1\n") == 0 || strcmp(line, "enable_adb=1") == 0;
 
-    return run_cmd(cmd) == 0 ? 1 : 0;
+    fclose(f);
+    return res;
 }
@@ -21,6 +21,7 @@
 void adb_init(char *mrom_path);
 void adb_quit(void);
 void adb_init_usb(void);
+void adb_enable_usb(void);
 int adb_init_busybox(void);
 void adb_init_fs(void);
 void adb_cleanup(void);
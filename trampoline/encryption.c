@@ -23,7 +23,10 @@
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <linux/dm-ioctl.h>
 
 #include "../lib/fstab.h"
 #include "../lib/util.h"
@@ -130,12 +133,41 @@ exit:
     return res;
 }
 
+// Same as cryptfs' delete_crypto_blk_dev(), but without spawning
+// trampoline_encmnt and linking the whole cryptfs/keymaster stack just
+// to issue a single ioctl.
+static int encryption_remove_dm(const char *name)
+{
+    struct dm_ioctl io;
+    int fd, res;
+
+    fd = open("/dev/device-mapper", O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+    {
+        ERROR("Failed to open /dev/device-mapper: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&io, 0, sizeof(io));
+    io.data_size = sizeof(io);
+    io.version[0] = DM_VERSION_MAJOR;
+    strncpy(io.name, name, sizeof(io.name) - 1);
+
+    res = ioctl(fd, DM_DEV_REMOVE, &io);
+    if(res < 0)
+        ERROR("Failed to remove dm device %s: %s\n", name, strerror(errno));
+
+    close(fd);
+    return res;
+}
+
 void encryption_destroy(void)
 {
-    int res = -1;
     int exit_code = -1;
     char *output = NULL;
-    struct stat info;
+
+    if(g_decrypted && encryption_remove_dm(ENCMNT_DM_NAME) >= 0)
+        g_decrypted = 0;
 
     if(g_decrypted)
     {
@@ -356,6 +356,9 @@ static int run_core(void)
     if(!fstab)
         goto exit;
 
+    // multirom would otherwise find, parse and resolve the same fstab again
+    fstab_snapshot_save(fstab, FSTAB_SNAPSHOT_PATH);
+
 #if 0
     fstab_dump(fstab); //debug
 #endif
@@ -383,6 +386,7 @@ static int run_core(void)
 exit:
     if(fstab)
         fstab_destroy(fstab);
+    unlink(FSTAB_SNAPSHOT_PATH);
 
     return res;
 }
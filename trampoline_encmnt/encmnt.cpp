@@ -211,7 +211,7 @@ static int handle_decrypt(int stdout_fd, char *password)
 
 static int handle_remove(void)
 {
-    if(delete_crypto_blk_dev("userdata") < 0)
+    if(delete_crypto_blk_dev((char*)ENCMNT_DM_NAME) < 0)
     {
         ERROR("delete_crypto_blk_dev failed!");
         return -1;
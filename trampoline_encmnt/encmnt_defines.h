@@ -21,6 +21,9 @@
 #define ENCMNT_BOOT_INTERNAL_OUTPUT "boot-internal-requested"
 #define ENCMNT_BOOT_RECOVERY_OUTPUT "boot-recovery-requested"
 
+// name of the dm-crypt device cryptfs creates for /data
+#define ENCMNT_DM_NAME "userdata"
+
 #define ENCMNT_UIRES_BOOT_INTERNAL 1
 #define ENCMNT_UIRES_BOOT_RECOVERY 2
 #define ENCMNT_UIRES_PASS_OK 0
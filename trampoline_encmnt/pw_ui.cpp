@@ -80,7 +80,7 @@ static void boot_internal_clicked(UNUSED void *data)
 
     // We need to run quirks for primary ROM to prevent
     // restorecon breaking everything
-    rom_quirks_on_initrd_finalized();
+    rom_quirks_on_initrd_finalized(NULL);
 
     pthread_mutex_lock(&exit_code_mutex);
     exit_code = ENCMNT_UIRES_BOOT_INTERNAL;
@@ -98,7 +98,7 @@ static void boot_reboot_to_recovery(UNUSED void *data)
     // restorecon breaking everything
 
     // not when going back to recovery
-    // rom_quirks_on_initrd_finalized();
+    // rom_quirks_on_initrd_finalized(NULL);
 
     pthread_mutex_lock(&exit_code_mutex);
     exit_code = ENCMNT_UIRES_BOOT_RECOVERY;